@@ -0,0 +1,135 @@
+/*===--------------------------------------------------------------------------------------------===
+ * index_bench.c - compares task ID lookups through an AVL tree and through the hash index
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../src/index.h"
+#include <utils/avl.h>
+#include <utils/helpers.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The shape of a task as far as either index is concerned.
+typedef struct {
+    char        id[9];
+    avl_node_t  node;
+} item_t;
+
+static int item_cmp(const void *a, const void *b) {
+    int r = strcmp(((const item_t *)a)->id, ((const item_t *)b)->id);
+    if(r < 0) return -1;
+    if(r > 0) return 1;
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// IDs shaped like the ones tq hands out: a base-36 counter in front of a four letter mnemonic.
+static void make_id(char *id, size_t n) {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    char tmp[8];
+    int len = 0;
+    do {
+        tmp[len++] = digits[n % 36];
+        n /= 36;
+    } while(n);
+    
+    int i = 0;
+    while(len) id[i++] = tmp[--len];
+    for(const char *m = "bmnp"; *m && i < 8; ++m) id[i++] = *m;
+    id[i] = '\0';
+}
+
+static void run(size_t count, size_t lookups) {
+    item_t *items = safe_calloc(count, sizeof(*items));
+    for(size_t i = 0; i < count; ++i) make_id(items[i].id, i);
+    
+    // Insert in a random order, and look up a random sequence of existing IDs.
+    size_t *order = safe_calloc(count, sizeof(*order));
+    for(size_t i = 0; i < count; ++i) order[i] = i;
+    for(size_t i = count - 1; i > 0; --i) {
+        size_t j = rng() % (i + 1);
+        size_t t = order[i]; order[i] = order[j]; order[j] = t;
+    }
+    const char **queries = safe_calloc(lookups, sizeof(*queries));
+    for(size_t i = 0; i < lookups; ++i) queries[i] = items[rng() % count].id;
+    
+    avl_tree_t tree;
+    avl_create(&tree, item_cmp, sizeof(item_t), offsetof(item_t, node));
+    double start = now();
+    for(size_t i = 0; i < count; ++i) avl_add(&tree, &items[order[i]]);
+    double avl_insert_time = now() - start;
+    
+    size_t found = 0;
+    start = now();
+    for(size_t i = 0; i < lookups; ++i) {
+        item_t search;
+        strcpy(search.id, queries[i]);
+        found += avl_find(&tree, &search, NULL) != NULL;
+    }
+    double avl_find_time = now() - start;
+    
+    tq_index_t index;
+    index_init(&index);
+    start = now();
+    for(size_t i = 0; i < count; ++i) {
+        item_t *item = &items[order[i]];
+        index_insert(&index, index_key(item->id, strlen(item->id)), item);
+    }
+    double index_insert_time = now() - start;
+    
+    start = now();
+    for(size_t i = 0; i < lookups; ++i) {
+        found += index_find(&index, index_key(queries[i], strlen(queries[i]))) != NULL;
+    }
+    double index_find_time = now() - start;
+    
+    if(found != 2 * lookups) {
+        fprintf(stderr, "index_bench: lookups failed (%zu/%zu)\n", found, 2 * lookups);
+        exit(1);
+    }
+    
+    printf("%10zu %12.1f %12.1f %12.1f %12.1f %8.1fx\n", count,
+           avl_insert_time * 1e9 / count, avl_find_time * 1e9 / lookups,
+           index_insert_time * 1e9 / count, index_find_time * 1e9 / lookups,
+           avl_find_time / index_find_time);
+    
+    void *cookie = NULL;
+    while(avl_destroy_nodes(&tree, &cookie)) {}
+    avl_destroy(&tree);
+    index_fini(&index);
+    free(queries);
+    free(order);
+    free(items);
+}
+
+int main(int argc, const char **argv) {
+    size_t max = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    size_t lookups = 1000000;
+    
+    printf("%10s %12s %12s %12s %12s %9s\n", "tasks", "avl add ns", "avl find ns",
+           "hash add ns", "hash find ns", "speedup");
+    for(size_t count = 10000; count <= max; count *= 10) run(count, lookups);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*===--------------------------------------------------------------------------------------------===
+ * parse_bench.c - measures the throughput of the text queue parser
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../src/scan.h"
+#include "../src/tq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS (5)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// The line splitting tq used before the scanner: find the newline, trim the line, then look for
+// each separator in turn.
+static size_t split_memchr(const char *cur, const char *end) {
+    size_t fields = 0;
+    while(cur < end) {
+        const char *eol = memchr(cur, '\n', end - cur);
+        if(!eol) eol = end;
+        const char *line = cur, *line_end = eol;
+        cur = eol + 1;
+        
+        while(line < line_end && is_space(*line)) ++line;
+        while(line_end > line && is_space(line_end[-1])) --line_end;
+        for(int i = 0; i < 2 && line < line_end; ++i) {
+            const char *sep = memchr(line, ':', line_end - line);
+            if(!sep) break;
+            fields += sep - line;
+            line = sep + 1;
+        }
+    }
+    return fields;
+}
+
+static size_t split_scan(const char *cur, const char *end) {
+    size_t fields = 0;
+    while(cur < end) {
+        const char *seps[2];
+        int num_seps;
+        const char *eol = scan_line(cur, end, seps, 2, &num_seps);
+        const char *line = cur, *line_end = eol;
+        cur = eol + 1;
+        
+        while(line < line_end && is_space(*line)) ++line;
+        while(line_end > line && is_space(line_end[-1])) --line_end;
+        if(num_seps == 2) fields += (seps[0] - line) + (seps[1] - seps[0] - 1);
+    }
+    return fields;
+}
+
+static void report(const char *what, size_t size, double best) {
+    printf("%-24s %10.1f MB/s\n", what, size / best / (1024.0 * 1024.0));
+}
+
+static void bench_split(const char *what, size_t (*split)(const char *, const char *),
+                        const char *data, size_t size, size_t expected) {
+    double best = 1e9;
+    for(int i = 0; i < RUNS; ++i) {
+        double start = now();
+        size_t fields = split(data, data + size);
+        double time = now() - start;
+        if(fields != expected) {
+            fprintf(stderr, "parse_bench: %s split the queue differently\n", what);
+            exit(1);
+        }
+        if(time < best) best = time;
+    }
+    report(what, size, best);
+}
+
+static void bench_load(const char *what, const char *path, size_t size, size_t count) {
+    double best = 1e9;
+    for(int i = 0; i < RUNS; ++i) {
+        tq_t tq;
+        double start = now();
+        tq_status_t status = tq_init(&tq, path, TQ_ACCESS_READ);
+        double time = now() - start;
+        if(status != TQ_OK || tq_num_todo(&tq) != count) {
+            fprintf(stderr, "parse_bench: %s failed to load the queue\n", what);
+            exit(1);
+        }
+        tq_fini(&tq);
+        if(time < best) best = time;
+    }
+    report(what, size, best);
+}
+
+int main(int argc, const char **argv) {
+    size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    
+    // A queue shaped like a real one: short IDs, descriptions of a few dozen characters.
+    char path[] = "/tmp/tq-parse-bench.XXXXXX";
+    int fd = mkstemp(path);
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(!out) {
+        fprintf(stderr, "parse_bench: unable to create a test queue\n");
+        return 1;
+    }
+    for(size_t i = 0; i < count; ++i) {
+        fprintf(out, "todo:%zx:%s task number %zu, which needs doing%s\n", i,
+            i % 3 ? "a fairly ordinary" : "an unusually long-winded description for a", i,
+            i % 7 ? "" : " before the end of the week: really");
+    }
+    fclose(out);
+    
+    FILE *in = fopen(path, "rb");
+    fseek(in, 0, SEEK_END);
+    size_t size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *data = malloc(size);
+    if(fread(data, 1, size, in) != size) {
+        fprintf(stderr, "parse_bench: unable to read the test queue\n");
+        return 1;
+    }
+    fclose(in);
+    
+    printf("%zu tasks, %.1f MB\n\n", count, size / (1024.0 * 1024.0));
+    size_t expected = split_memchr(data, data + size);
+    bench_split("split (memchr)", split_memchr, data, size, expected);
+    
+    const scan_impl_t impls[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+    for(int i = 0; i < 3; ++i) {
+        if(!scan_select(impls[i])) continue;
+        char what[64];
+        snprintf(what, sizeof(what), "split (%s)", scan_impl_name(impls[i]));
+        bench_split(what, split_scan, data, size, expected);
+    }
+    puts("");
+    for(int i = 0; i < 3; ++i) {
+        if(!scan_select(impls[i])) continue;
+        char what[64];
+        snprintf(what, sizeof(what), "tq_init (%s)", scan_impl_name(impls[i]));
+        bench_load(what, path, size, count);
+    }
+    
+    free(data);
+    unlink(path);
+    return 0;
+}
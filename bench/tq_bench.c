@@ -0,0 +1,628 @@
+/*===--------------------------------------------------------------------------------------------===
+ * tq_bench.c - times the main queue operations on synthetic queues
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../src/binary.h"
+#include "../src/render.h"
+#include "../src/tq.h"
+#include <utils/helpers.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DB_DEPTH (8)
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_SKEWED,    // mostly short descriptions, with a long tail
+} dist_t;
+
+typedef struct {
+    size_t      tasks;
+    double      done_ratio;
+    size_t      desc_min;
+    size_t      desc_max;
+    dist_t      dist;
+    tq_format_t format;
+    size_t      runs;
+    size_t      ops;        // per run, for the phases timed one operation at a time
+    uint64_t    seed;
+    bool        json;
+} config_t;
+
+// The samples of one phase: how long each operation took, and how many tasks each one handled.
+typedef struct {
+    const char  *name;
+    size_t      items;
+    double      *samples;
+    size_t      count;
+    size_t      cap;
+    long        peak_rss_kb;    // once the phase is over
+} phase_t;
+
+static const char *prog = "tq_bench";
+static char *work_dir = NULL;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) < 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_unit(void) {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static _Noreturn void fail(const char *what) {
+    fprintf(stderr, "%s: %s\n", prog, what);
+    exit(1);
+}
+
+// Synthetic queues -------------------------------------------------------------------------------
+
+static size_t desc_length(const config_t *config) {
+    double u = rng_unit();
+    if(config->dist == DIST_SKEWED) u = u * u * u;
+    return config->desc_min + (size_t)(u * (config->desc_max - config->desc_min + 1));
+}
+
+// Fills [desc] with [len] characters of lowercase words.
+static void make_desc(char *desc, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        size_t word = 2 + rng() % 8;
+        for(size_t j = 0; j < word && i < len; ++j) desc[i++] = 'a' + rng() % 26;
+        if(i < len - 1) desc[i++] = ' ';
+    }
+    desc[len] = '\0';
+}
+
+static char *queue_path(const char *dir) {
+    return fs_make_path(dir, TQ_DB_NAME, NULL);
+}
+
+// Writes a text queue: pending tasks first, then done ones, as a compaction would.
+static void write_text_queue(const config_t *config, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if(!out) fail("unable to create the test queue");
+    
+    char *desc = safe_malloc(config->desc_max + 1);
+    size_t num_done = (size_t)(config->tasks * config->done_ratio);
+    for(size_t i = 0; i < config->tasks; ++i) {
+        make_desc(desc, desc_length(config));
+        fprintf(out, "%s:%zx:%s\n", i < config->tasks - num_done ? "todo" : "done", i, desc);
+    }
+    free(desc);
+    if(fclose(out) != 0) fail("unable to write the test queue");
+}
+
+static void generate(const config_t *config, const char *dir) {
+    char *path = queue_path(dir);
+    if(config->format == TQ_FORMAT_TEXT) {
+        write_text_queue(config, path);
+        free(path);
+        return;
+    }
+    
+    // Binary queues are written straight from the loaded text one: compacting it would archive the
+    // done tasks.
+    char *text_path = fs_make_path(dir, "source.txt", NULL);
+    write_text_queue(config, text_path);
+    tq_t tq;
+    if(tq_init(&tq, text_path, TQ_ACCESS_READ) != TQ_OK) fail("unable to load the test queue");
+    FILE *out = fopen(path, "wb");
+    if(!out || !bin_write(&tq, out) || fclose(out) != 0) fail("unable to write the test queue");
+    tq_fini(&tq);
+    
+    unlink(text_path);
+    char *lock_path = fs_make_path(dir, "source.txt" TQ_LOCK_EXT, NULL);
+    unlink(lock_path);
+    free(lock_path);
+    free(text_path);
+    free(path);
+}
+
+static void copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(in < 0 || out < 0) fail("unable to copy the test queue");
+    
+    char buffer[64 * 1024];
+    ssize_t len;
+    while((len = read(in, buffer, sizeof(buffer))) > 0) {
+        if(write(out, buffer, len) != len) fail("unable to copy the test queue");
+    }
+    if(len < 0) fail("unable to copy the test queue");
+    close(in);
+    close(out);
+}
+
+static void remove_tree(const char *path) {
+    DIR *dir = opendir(path);
+    if(dir) {
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL) {
+            if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+            char *child = fs_make_path(path, entry->d_name, NULL);
+            remove_tree(child);
+            free(child);
+        }
+        closedir(dir);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+// Gives each run that changes the queue a fresh copy of it, in [dir], so every run starts from
+// the same queue.
+static char *fresh_queue(const char *source, const char *dir) {
+    remove_tree(dir);
+    if(mkdir(dir, 0755) < 0) fail("unable to create a working directory");
+    char *path = queue_path(dir);
+    copy_file(source, path);
+    return path;
+}
+
+static void load(tq_t *tq, const char *path) {
+    if(tq_init(tq, path, TQ_ACCESS_WRITE) != TQ_OK) fail("unable to load the test queue");
+}
+
+// Measurements -----------------------------------------------------------------------------------
+
+static void phase_add(phase_t *phase, double seconds) {
+    if(phase->count == phase->cap) {
+        phase->cap = phase->cap ? phase->cap * 2 : 64;
+        phase->samples = safe_realloc(phase->samples, phase->cap * sizeof(double));
+    }
+    phase->samples[phase->count++] = seconds;
+}
+
+static void phase_end(phase_t *phase) {
+    phase->peak_rss_kb = peak_rss_kb();
+}
+
+static int compare_samples(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+static double percentile(const phase_t *phase, double p) {
+    double exact = p * phase->count;
+    size_t rank = (size_t)exact;
+    if(rank < exact) ++rank;
+    return phase->samples[rank ? rank - 1 : 0];
+}
+
+// Picks up to [count] distinct pending IDs, spread over the todo list.
+static char (*sample_ids(tq_t *tq, size_t count, size_t *num_ids))[TQ_ID_MAX+1] {
+    size_t todo = tq_num_todo(tq);
+    if(count > todo) count = todo;
+    char (*ids)[TQ_ID_MAX+1] = safe_calloc(count ? count : 1, sizeof(*ids));
+    
+    size_t stride = count ? todo / count : 1, i = 0, n = 0;
+    for(tq_task_t *t = list_head(&tq->todo); t && n < count; t = list_next(&tq->todo, t), ++i) {
+        if(i % stride == 0) strcpy(ids[n++], t->id);
+    }
+    // Mark them done in a random order.
+    for(size_t j = n; j > 1; --j) {
+        size_t k = rng() % j;
+        char tmp[TQ_ID_MAX+1];
+        strcpy(tmp, ids[j - 1]);
+        strcpy(ids[j - 1], ids[k]);
+        strcpy(ids[k], tmp);
+    }
+    *num_ids = n;
+    return ids;
+}
+
+static void bench_init(const config_t *config, const char *path, phase_t *phase) {
+    for(size_t run = 0; run < config->runs; ++run) {
+        tq_t tq;
+        double start = now();
+        tq_status_t status = tq_init(&tq, path, TQ_ACCESS_READ);
+        double time = now() - start;
+        if(status != TQ_OK) fail("unable to load the test queue");
+        tq_fini(&tq);
+        phase_add(phase, time);
+    }
+    phase_end(phase);
+}
+
+typedef enum { ADD_FRONT, ADD_BACK, ADD_AT, ADD_AFTER, ADD_BEFORE, NUM_ADDS } add_kind_t;
+
+static void bench_changes(const config_t *config, const char *source, phase_t *adds, phase_t *done) {
+    char *desc = safe_malloc(config->desc_max + 1);
+    char *dir = fs_make_path(work_dir, "changes", NULL);
+    
+    for(size_t run = 0; run < config->runs; ++run) {
+        char *path = fresh_queue(source, dir);
+        tq_t tq;
+        load(&tq, path);
+        size_t num_ids;
+        char (*ids)[TQ_ID_MAX+1] = sample_ids(&tq, config->ops, &num_ids);
+    
+        for(int kind = 0; kind < NUM_ADDS; ++kind) {
+            for(size_t i = 0; i < config->ops; ++i) {
+                make_desc(desc, desc_length(config));
+                const char *node = num_ids ? ids[rng() % num_ids] : NULL;
+                size_t pos = rng() % (tq_num_todo(&tq) + 1);
+    
+                double start = now();
+                tq_task_t *task = NULL;
+                switch((add_kind_t)kind) {
+                case ADD_FRONT: task = tq_add_front(&tq, desc); break;
+                case ADD_BACK: task = tq_add_back(&tq, desc); break;
+                case ADD_AT: task = tq_add_at(&tq, desc, pos); break;
+                case ADD_AFTER: task = node ? tq_add_after(&tq, desc, node) : tq_add_front(&tq, desc); break;
+                case ADD_BEFORE: task = node ? tq_add_before(&tq, desc, node) : tq_add_back(&tq, desc); break;
+                case NUM_ADDS: break;
+                }
+                double time = now() - start;
+                if(!task) fail("unable to add a task");
+                phase_add(&adds[kind], time);
+            }
+        }
+    
+        for(size_t i = 0; i < num_ids; ++i) {
+            double start = now();
+            tq_task_t *task = tq_mark_done(&tq, ids[i]);
+            double time = now() - start;
+            if(!task) fail("unable to mark a task as done");
+            phase_add(done, time);
+        }
+    
+        tq_fini(&tq);
+        free(ids);
+        free(path);
+    }
+    for(int kind = 0; kind < NUM_ADDS; ++kind) phase_end(&adds[kind]);
+    phase_end(done);
+    
+    remove_tree(dir);
+    free(dir);
+    free(desc);
+}
+
+// Times persisting a batch of changes (one journal append), then folding them into the snapshot.
+static void bench_write(const config_t *config, const char *source, phase_t *write, phase_t *compact) {
+    char *desc = safe_malloc(config->desc_max + 1);
+    char *dir = fs_make_path(work_dir, "write", NULL);
+    
+    for(size_t run = 0; run < config->runs; ++run) {
+        char *path = fresh_queue(source, dir);
+        tq_t tq;
+        load(&tq, path);
+        size_t num_ids;
+        char (*ids)[TQ_ID_MAX+1] = sample_ids(&tq, config->ops / 2, &num_ids);
+        for(size_t i = 0; i < config->ops - num_ids; ++i) {
+            make_desc(desc, desc_length(config));
+            if(!tq_add_at(&tq, desc, rng() % (tq_num_todo(&tq) + 1))) fail("unable to add a task");
+        }
+        for(size_t i = 0; i < num_ids; ++i) tq_mark_done(&tq, ids[i]);
+    
+        double start = now();
+        bool ok = tq_write(&tq);
+        double time = now() - start;
+        if(!ok) fail("unable to write the test queue");
+        phase_add(write, time);
+    
+        start = now();
+        ok = tq_compact(&tq);
+        time = now() - start;
+        if(!ok) fail("unable to compact the test queue");
+        phase_add(compact, time);
+    
+        tq_fini(&tq);
+        free(ids);
+        free(path);
+    }
+    phase_end(write);
+    phase_end(compact);
+    
+    remove_tree(dir);
+    free(dir);
+    free(desc);
+}
+
+// Renders the queue the way tq list does, to /dev/null.
+static void bench_render(const config_t *config, const char *path, phase_t *phase) {
+    FILE *out = fopen("/dev/null", "wb");
+    if(!out) fail("unable to open /dev/null");
+    tq_t tq;
+    if(tq_init(&tq, path, TQ_ACCESS_READ) != TQ_OK) fail("unable to load the test queue");
+    
+    for(size_t run = 0; run < config->runs; ++run) {
+        double start = now();
+        render_t r;
+        render_init(&r, out);
+        render_header(&r, "Todo");
+        int width = render_width(tq_num_todo(&tq));
+        size_t pos = 0;
+        for(tq_task_t *t = list_head(&tq.todo); t != NULL; t = list_next(&tq.todo, t)) {
+            render_text(&r, " ", 1);
+            render_number(&r, ++pos, width);
+            render_text(&r, ". ", 2);
+            render_task(&r, t);
+        }
+        render_header(&r, "Done");
+        for(tq_task_t *t = list_head(&tq.done); t != NULL; t = list_next(&tq.done, t)) {
+            render_text(&r, " - ", 3);
+            render_task(&r, t);
+        }
+        bool ok = render_fini(&r);
+        double time = now() - start;
+        if(!ok) fail("unable to render the test queue");
+        phase_add(phase, time);
+    }
+    tq_fini(&tq);
+    fclose(out);
+    phase_end(phase);
+}
+
+// Looks the queue up from DB_DEPTH directories below it.
+static void bench_get_db_path(const config_t *config, const char *dir, phase_t *phase) {
+    char *current = safe_strdup(dir);
+    for(int i = 0; i < DB_DEPTH; ++i) {
+        char name[16];
+        snprintf(name, sizeof(name), "d%d", i);
+        char *child = fs_make_path(current, name, NULL);
+        if(mkdir(child, 0755) < 0 && errno != EEXIST) fail("unable to create a working directory");
+        free(current);
+        current = child;
+    }
+    
+    for(size_t i = 0; i < config->runs * config->ops; ++i) {
+        double start = now();
+        char *path = tq_get_db_path(current);
+        double time = now() - start;
+        if(!path) fail("unable to find the test queue");
+        free(path);
+        phase_add(phase, time);
+    }
+    phase_end(phase);
+    free(current);
+}
+
+// Reporting --------------------------------------------------------------------------------------
+
+static const char *dist_name(dist_t dist) {
+    return dist == DIST_SKEWED ? "skewed" : "uniform";
+}
+
+static void report_json(const config_t *config, size_t queue_size, phase_t *phases, size_t count) {
+    printf("{\n");
+    printf("  \"tasks\": %zu,\n", config->tasks);
+    printf("  \"done_ratio\": %g,\n", config->done_ratio);
+    printf("  \"desc_min\": %zu,\n", config->desc_min);
+    printf("  \"desc_max\": %zu,\n", config->desc_max);
+    printf("  \"dist\": \"%s\",\n", dist_name(config->dist));
+    printf("  \"format\": \"%s\",\n", config->format == TQ_FORMAT_BINARY ? "binary" : "text");
+    printf("  \"runs\": %zu,\n", config->runs);
+    printf("  \"ops\": %zu,\n", config->ops);
+    printf("  \"seed\": %llu,\n", (unsigned long long)config->seed);
+    printf("  \"queue_bytes\": %zu,\n", queue_size);
+    printf("  \"phases\": [\n");
+    for(size_t i = 0; i < count; ++i) {
+        const phase_t *p = &phases[i];
+        double total = 0;
+        for(size_t j = 0; j < p->count; ++j) total += p->samples[j];
+        printf("    {\"name\": \"%s\", \"ops\": %zu, \"tasks_per_op\": %zu, \"total_s\": %.6f, "
+               "\"ops_per_s\": %.1f, \"tasks_per_s\": %.1f, "
+               "\"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+               "\"max\": %.3f}, \"peak_rss_kb\": %ld}%s\n",
+               p->name, p->count, p->items, total,
+               p->count / total, p->count * p->items / total,
+               total / p->count * 1e6, percentile(p, 0.5) * 1e6, percentile(p, 0.9) * 1e6,
+               percentile(p, 0.99) * 1e6, p->samples[p->count - 1] * 1e6, p->peak_rss_kb,
+               i + 1 < count ? "," : "");
+    }
+    printf("  ],\n");
+    printf("  \"peak_rss_kb\": %ld\n", peak_rss_kb());
+    printf("}\n");
+}
+
+static void report_text(const config_t *config, size_t queue_size, phase_t *phases, size_t count) {
+    printf("%zu tasks (%.0f%% done), %s descriptions of %zu-%zu characters, %s, %.1f MB\n\n",
+           config->tasks, config->done_ratio * 100, dist_name(config->dist),
+           config->desc_min, config->desc_max,
+           config->format == TQ_FORMAT_BINARY ? "binary" : "text", queue_size / (1024.0 * 1024.0));
+    printf("%-16s %8s %14s %10s %10s %10s %10s %10s\n", "phase", "ops", "tasks/s",
+           "mean us", "p50 us", "p90 us", "p99 us", "peak MB");
+    for(size_t i = 0; i < count; ++i) {
+        const phase_t *p = &phases[i];
+        double total = 0;
+        for(size_t j = 0; j < p->count; ++j) total += p->samples[j];
+        printf("%-16s %8zu %14.0f %10.2f %10.2f %10.2f %10.2f %10.1f\n", p->name, p->count,
+               p->count * p->items / total, total / p->count * 1e6,
+               percentile(p, 0.5) * 1e6, percentile(p, 0.9) * 1e6, percentile(p, 0.99) * 1e6,
+               p->peak_rss_kb / 1024.0);
+    }
+}
+
+// Command line -----------------------------------------------------------------------------------
+
+static void usage(void) {
+    printf("usage: %s [options]\n\n", prog);
+    printf("  --tasks N         tasks in the generated queue (default 100000)\n");
+    printf("  --done-ratio R    fraction of them already done (default 0.2)\n");
+    printf("  --desc MIN:MAX    description lengths (default 16:80)\n");
+    printf("  --dist NAME       uniform or skewed description lengths (default uniform)\n");
+    printf("  --format NAME     text or binary queue (default text)\n");
+    printf("  --runs N          runs of each phase (default 5)\n");
+    printf("  --ops N           operations per run, for per-operation phases (default 1000)\n");
+    printf("  --seed N          seed of the generator\n");
+    printf("  --json            report in JSON\n");
+}
+
+static size_t parse_count(const char *option, const char *value) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if(errno || end == value || *end || value[0] == '-') {
+        fprintf(stderr, "%s: %s expects a number, not '%s'\n", prog, option, value);
+        exit(1);
+    }
+    return (size_t)n;
+}
+
+static void parse_args(config_t *config, int argc, const char **argv) {
+    for(int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if(!strcmp(arg, "--json")) {
+            config->json = true;
+            continue;
+        }
+        if(!strcmp(arg, "--help") || !strcmp(arg, "-h")) {
+            usage();
+            exit(0);
+        }
+        if(i + 1 >= argc) {
+            fprintf(stderr, "%s: unknown option '%s'\n", prog, arg);
+            exit(1);
+        }
+    
+        const char *value = argv[++i];
+        if(!strcmp(arg, "--tasks")) {
+            config->tasks = parse_count(arg, value);
+        } else if(!strcmp(arg, "--done-ratio")) {
+            char *end = NULL;
+            config->done_ratio = strtod(value, &end);
+            if(end == value || *end || config->done_ratio < 0 || config->done_ratio > 1) {
+                fprintf(stderr, "%s: --done-ratio expects a number between 0 and 1\n", prog);
+                exit(1);
+            }
+        } else if(!strcmp(arg, "--desc")) {
+            unsigned long lo, hi;
+            char extra;
+            if(sscanf(value, "%lu:%lu%c", &lo, &hi, &extra) != 2 || !lo || lo > hi) {
+                fprintf(stderr, "%s: --desc expects MIN:MAX, with 0 < MIN <= MAX\n", prog);
+                exit(1);
+            }
+            config->desc_min = lo;
+            config->desc_max = hi;
+        } else if(!strcmp(arg, "--dist")) {
+            if(!strcmp(value, "uniform")) config->dist = DIST_UNIFORM;
+            else if(!strcmp(value, "skewed")) config->dist = DIST_SKEWED;
+            else {
+                fprintf(stderr, "%s: unknown distribution '%s'\n", prog, value);
+                exit(1);
+            }
+        } else if(!strcmp(arg, "--format")) {
+            if(!tq_parse_format(value, &config->format)) {
+                fprintf(stderr, "%s: unknown queue format '%s'\n", prog, value);
+                exit(1);
+            }
+        } else if(!strcmp(arg, "--runs")) {
+            config->runs = parse_count(arg, value);
+        } else if(!strcmp(arg, "--ops")) {
+            config->ops = parse_count(arg, value);
+        } else if(!strcmp(arg, "--seed")) {
+            config->seed = parse_count(arg, value);
+        } else {
+            fprintf(stderr, "%s: unknown option '%s'\n", prog, arg);
+            exit(1);
+        }
+    }
+    if(!config->tasks || !config->runs || !config->ops) {
+        fprintf(stderr, "%s: --tasks, --runs and --ops must be at least 1\n", prog);
+        exit(1);
+    }
+}
+
+int main(int argc, const char **argv) {
+    config_t config = {
+        .tasks = 100000,
+        .done_ratio = 0.2,
+        .desc_min = 16,
+        .desc_max = 80,
+        .dist = DIST_UNIFORM,
+        .format = TQ_FORMAT_TEXT,
+        .runs = 5,
+        .ops = 1000,
+        .seed = 0x2545f4914f6cdd1dull,
+        .json = false,
+    };
+    parse_args(&config, argc, argv);
+    rng_state = config.seed ? config.seed : 1;
+    
+    char template[] = "/tmp/tq-bench.XXXXXX";
+    work_dir = mkdtemp(template);
+    if(!work_dir) fail("unable to create a working directory");
+    
+    char *queue_dir = fs_make_path(work_dir, "queue", NULL);
+    if(mkdir(queue_dir, 0755) < 0) fail("unable to create a working directory");
+    generate(&config, queue_dir);
+    char *path = queue_path(queue_dir);
+    struct stat st;
+    if(stat(path, &st) < 0) fail("unable to create the test queue");
+    
+    phase_t phases[] = {
+        {.name = "tq_init", .items = config.tasks},
+        {.name = "tq_add_front", .items = 1},
+        {.name = "tq_add_back", .items = 1},
+        {.name = "tq_add_at", .items = 1},
+        {.name = "tq_add_after", .items = 1},
+        {.name = "tq_add_before", .items = 1},
+        {.name = "tq_mark_done", .items = 1},
+        {.name = "tq_write", .items = config.ops},
+        {.name = "tq_compact", .items = config.tasks},
+        {.name = "list_render", .items = config.tasks},
+        {.name = "tq_get_db_path", .items = 1},
+    };
+    const size_t num_phases = sizeof(phases) / sizeof(phases[0]);
+    
+    bench_init(&config, path, &phases[0]);
+    bench_changes(&config, path, &phases[1], &phases[6]);
+    bench_write(&config, path, &phases[7], &phases[8]);
+    bench_render(&config, path, &phases[9]);
+    bench_get_db_path(&config, queue_dir, &phases[10]);
+    
+    for(size_t i = 0; i < num_phases; ++i) {
+        if(!phases[i].count) fail("a phase has no samples");
+        qsort(phases[i].samples, phases[i].count, sizeof(double), compare_samples);
+    }
+    if(config.json) {
+        report_json(&config, st.st_size, phases, num_phases);
+    } else {
+        report_text(&config, st.st_size, phases, num_phases);
+    }
+    
+    for(size_t i = 0; i < num_phases; ++i) free(phases[i].samples);
+    remove_tree(work_dir);
+    free(queue_dir);
+    free(path);
+    return 0;
+}
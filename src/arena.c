@@ -0,0 +1,115 @@
+/*===--------------------------------------------------------------------------------------------===
+ * arena.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "arena.h"
+#include "trace.h"
+#include <utils/helpers.h>
+#include <utils/assert.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ARENA_MIN_CHUNK (16 * 1024)
+#define ARENA_MAX_CHUNK (16 * 1024 * 1024)
+#define ARENA_ALIGN (alignof(max_align_t))
+
+struct arena_chunk_t {
+    arena_chunk_t   *next;
+    size_t          size;
+    size_t          used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+// Process-wide totals are only kept while tracing. Arenas of different queues can be used from
+// different threads, so they are atomic, which only costs anything while they are counted.
+static _Atomic size_t total_allocs = 0;
+static _Atomic size_t total_chunks = 0;
+
+static size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+void arena_init(arena_t *arena) {
+    ASSERT(arena);
+    memset(arena, 0, sizeof(*arena));
+    arena->next_size = ARENA_MIN_CHUNK;
+}
+
+void arena_fini(arena_t *arena) {
+    ASSERT(arena);
+    arena_chunk_t *chunk = arena->chunks;
+    while(chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+}
+
+static arena_chunk_t *chunk_new(arena_t *arena, size_t min_size) {
+    size_t size = arena->next_size > min_size ? arena->next_size : min_size;
+    
+    arena_chunk_t *chunk = safe_malloc(sizeof(*chunk) + size);
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    
+    arena->num_chunks += 1;
+    if(trace_format != TRACE_OFF) total_chunks += 1;
+    arena->bytes_reserved += size;
+    if(arena->next_size < ARENA_MAX_CHUNK) arena->next_size *= 2;
+    return chunk;
+}
+
+void arena_reserve(arena_t *arena, size_t count, size_t size) {
+    ASSERT(arena);
+    ASSERT(!count || align_up(size) <= SIZE_MAX / count);
+    size = count * align_up(size);
+    arena_chunk_t *chunk = arena->chunks;
+    if(chunk && chunk->size - chunk->used >= size) return;
+    chunk_new(arena, size);
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    ASSERT(arena);
+    size = align_up(size ? size : 1);
+    
+    arena_chunk_t *chunk = arena->chunks;
+    if(!chunk || chunk->size - chunk->used < size) chunk = chunk_new(arena, size);
+    
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->num_allocs += 1;
+    if(trace_format != TRACE_OFF) total_allocs += 1;
+    arena->bytes_used += size;
+    return ptr;
+}
+
+void *arena_calloc(arena_t *arena, size_t count, size_t size) {
+    ASSERT(!size || count <= SIZE_MAX / size);
+    void *ptr = arena_alloc(arena, count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+    ASSERT(str);
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_totals(size_t *allocs, size_t *chunks) {
+    ASSERT(allocs);
+    ASSERT(chunks);
+    *allocs = total_allocs;
+    *chunks = total_chunks;
+}
@@ -0,0 +1,52 @@
+/*===--------------------------------------------------------------------------------------------===
+ * arena.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_ARENA_H_
+#define _TQ_ARENA_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct arena_chunk_t arena_chunk_t;
+
+// A bump allocator: memory is handed out from large chunks and only ever released all at once,
+// when the arena itself is destroyed.
+typedef struct arena_t {
+    arena_chunk_t   *chunks;
+    size_t          next_size;
+    
+    size_t          num_allocs;     // allocations served by the arena
+    size_t          num_chunks;     // heap allocations made by the arena
+    size_t          bytes_used;
+    size_t          bytes_reserved;
+} arena_t;
+
+void arena_init(arena_t *arena);
+void arena_fini(arena_t *arena);
+
+// Makes sure the next [count] allocations of [size] bytes can be served without another heap
+// allocation. Useful when the final size is known (or can be bounded) ahead of time.
+void arena_reserve(arena_t *arena, size_t count, size_t size);
+
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t count, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+// Allocations served by every arena of the process while tracing, and the heap blocks they came
+// from (see trace.h).
+void arena_totals(size_t *allocs, size_t *chunks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_ARENA_H_ */
@@ -0,0 +1,160 @@
+/*===--------------------------------------------------------------------------------------------===
+ * binary.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "binary.h"
+#include <utils/assert.h>
+#include <utils/helpers.h>
+#include <string.h>
+
+_Static_assert(TQ_ID_MAX <= TQ_BIN_ID_LEN, "task IDs don't fit in binary records");
+_Static_assert(sizeof(tq_bin_header_t) % 8 == 0, "binary header must keep records aligned");
+_Static_assert(sizeof(tq_bin_record_t) % 8 == 0, "binary records must stay aligned");
+
+static uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+bool bin_is_binary(const char *data, size_t size) {
+    return data && size >= 4 && !memcmp(data, TQ_BIN_MAGIC, 4);
+}
+
+const tq_bin_header_t *bin_header(const char *data, size_t size) {
+    if(!bin_is_binary(data, size) || size < offsetof(tq_bin_header_t, num_segments)) return NULL;
+    const tq_bin_header_t *header = (const tq_bin_header_t *)data;
+    if(header->version < 1 || header->version > TQ_BIN_VERSION) return NULL;
+    if(header->version > 1 && size < sizeof(tq_bin_header_t)) return NULL;
+    
+    uint64_t count = (uint64_t)header->num_todo + header->num_done;
+    if(header->records_offset % 8 || header->index_offset % 4) return NULL;
+    if(header->records_offset > size || count > (size - header->records_offset) / sizeof(tq_bin_record_t)) return NULL;
+    if(header->heap_offset > size || header->heap_size > size - header->heap_offset) return NULL;
+    if(header->index_offset > size || count > (size - header->index_offset) / sizeof(uint32_t)) return NULL;
+    return header;
+}
+
+uint32_t bin_segments(const tq_bin_header_t *header) {
+    return header->version > 1 ? header->num_segments : 0;
+}
+
+const tq_bin_record_t *bin_records(const char *data) {
+    const tq_bin_header_t *header = (const tq_bin_header_t *)data;
+    return (const tq_bin_record_t *)(data + header->records_offset);
+}
+
+const char *bin_heap(const char *data) {
+    const tq_bin_header_t *header = (const tq_bin_header_t *)data;
+    return data + header->heap_offset;
+}
+
+const uint32_t *bin_index(const char *data) {
+    const tq_bin_header_t *header = (const tq_bin_header_t *)data;
+    return (const uint32_t *)(data + header->index_offset);
+}
+
+static int id_cmp(const char *a, const char *b) {
+    return memcmp(a, b, TQ_BIN_ID_LEN);
+}
+
+long bin_find(const char *data, const char *id, size_t len) {
+    if(len > TQ_BIN_ID_LEN) return -1;
+    char key[TQ_BIN_ID_LEN] = {0};
+    memcpy(key, id, len);
+    
+    const tq_bin_header_t *header = (const tq_bin_header_t *)data;
+    const tq_bin_record_t *records = bin_records(data);
+    const uint32_t *index = bin_index(data);
+    
+    size_t lo = 0, hi = (size_t)header->num_todo + header->num_done;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int r = id_cmp(records[index[mid]].id, key);
+        if(!r) return index[mid];
+        if(r < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+typedef struct {
+    char        id[TQ_BIN_ID_LEN];
+    uint32_t    record;
+} index_entry_t;
+
+static int index_cmp(const void *a, const void *b) {
+    return id_cmp(((const index_entry_t *)a)->id, ((const index_entry_t *)b)->id);
+}
+
+static bool write_padding(FILE *out, uint64_t *offset) {
+    static const char zeros[8] = {0};
+    uint64_t aligned = align8(*offset);
+    size_t count = aligned - *offset;
+    *offset = aligned;
+    return fwrite(zeros, 1, count, out) == count;
+}
+
+bool bin_write(const tq_t *tq, FILE *out) {
+    ASSERT(tq);
+    ASSERT(out);
+    
+    tq_bin_header_t header = {
+        .magic = TQ_BIN_MAGIC,
+        .version = TQ_BIN_VERSION,
+        .num_segments = tq->num_segments,
+    };
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t)) header.num_todo += 1;
+    for(tq_task_t *t = list_head(&tq->done); t; t = list_next(&tq->done, t)) header.num_done += 1;
+    
+    size_t count = (size_t)header.num_todo + header.num_done;
+    tq_bin_record_t *records = safe_calloc(count ? count : 1, sizeof(*records));
+    index_entry_t *entries = safe_calloc(count ? count : 1, sizeof(*entries));
+    
+    size_t n = 0;
+    uint64_t heap_size = 0;
+    const list_t *lists[] = {&tq->todo, &tq->done};
+    for(int i = 0; i < 2; ++i) {
+        for(tq_task_t *t = list_head(lists[i]); t; t = list_next(lists[i], t)) {
+            tq_bin_record_t *rec = &records[n];
+            memcpy(rec->id, t->id, strlen(t->id));
+            rec->desc_offset = heap_size;
+            rec->desc_len = t->desc_len;
+            rec->flags = t->done ? TQ_BIN_DONE : 0;
+            heap_size += t->desc_len;
+            memcpy(entries[n].id, rec->id, TQ_BIN_ID_LEN);
+            entries[n].record = n;
+            n += 1;
+        }
+    }
+    
+    qsort(entries, count, sizeof(*entries), index_cmp);
+    // Compacts the sorted entries into the record number array in place: index[i] never lands past
+    // entries[i], which is read before being overwritten.
+    uint32_t *index = (uint32_t *)entries;
+    for(size_t i = 0; i < count; ++i) index[i] = entries[i].record;
+    
+    header.records_offset = sizeof(header);
+    header.heap_offset = header.records_offset + count * sizeof(*records);
+    header.heap_size = heap_size;
+    header.index_offset = align8(header.heap_offset + heap_size);
+    
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(records, sizeof(*records), count, out) == count;
+    uint64_t offset = header.heap_offset;
+    for(int i = 0; ok && i < 2; ++i) {
+        for(tq_task_t *t = list_head(lists[i]); ok && t; t = list_next(lists[i], t)) {
+            ok = fwrite(t->desc, 1, t->desc_len, out) == t->desc_len;
+            offset += t->desc_len;
+        }
+    }
+    ok = ok && write_padding(out, &offset);
+    ok = ok && fwrite(index, sizeof(*index), count, out) == count;
+    
+    free(records);
+    free(entries);
+    return ok;
+}
@@ -0,0 +1,86 @@
+/*===--------------------------------------------------------------------------------------------===
+ * binary.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_BINARY_H_
+#define _TQ_BINARY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "tq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary queue layout. Everything is in host byte order, and sections are 8-byte aligned:
+ *
+ *      header
+ *      record table    num_todo + num_done fixed-size records, todo tasks first, in queue order
+ *      string heap     descriptions, not NUL-terminated
+ *      ID index        record numbers (uint32_t) sorted by task ID
+ *
+ * Loading a binary queue doesn't require parsing anything, and a task can be found by ID with a
+ * binary search through the index, straight from the mapping.
+ *
+ * Version 2 added the number of archive segments to the header. Version 1 queues are still read,
+ * as having none.
+ */
+
+#define TQ_BIN_MAGIC "TQB\x7f"
+#define TQ_BIN_VERSION (2)
+#define TQ_BIN_ID_LEN (8)
+
+#define TQ_BIN_DONE (1u << 0)
+
+typedef struct tq_bin_header_t {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    num_todo;
+    uint32_t    num_done;
+    uint64_t    records_offset;
+    uint64_t    heap_offset;
+    uint64_t    heap_size;
+    uint64_t    index_offset;
+    uint32_t    num_segments;   // from version 2
+    uint32_t    reserved;
+} tq_bin_header_t;
+
+typedef struct tq_bin_record_t {
+    char        id[TQ_BIN_ID_LEN];  // zero-padded
+    uint64_t    desc_offset;        // from the start of the string heap
+    uint32_t    desc_len;
+    uint32_t    flags;
+} tq_bin_record_t;
+
+// Returns whether [data] starts with the binary queue magic number.
+bool bin_is_binary(const char *data, size_t size);
+
+// Returns the header of a binary queue, or NULL if the sections don't fit in [size] bytes.
+const tq_bin_header_t *bin_header(const char *data, size_t size);
+
+// Returns how many archive segments the queue relies on.
+uint32_t bin_segments(const tq_bin_header_t *header);
+
+const tq_bin_record_t *bin_records(const char *data);
+const char *bin_heap(const char *data);
+const uint32_t *bin_index(const char *data);
+
+// Binary searches the ID index. Returns the record number of the task, or -1.
+long bin_find(const char *data, const char *id, size_t len);
+
+bool bin_write(const tq_t *tq, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_BINARY_H_ */
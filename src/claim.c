@@ -0,0 +1,259 @@
+/*===--------------------------------------------------------------------------------------------===
+ * claim.c - tasks taken by workers
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "tq.h"
+#include <utils/assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Claims are kept next to the queue (.tqlist.txt.claims), one per line:
+ *
+ *      <id>:<expiry, in seconds since the epoch>:<holder>
+ *
+ * The file is only read and replaced while the queue is locked for writing, which is what makes a
+ * claim atomic: two workers can't both see a task unclaimed, since the second one only loads the
+ * queue once the first has replaced the file and let go of the lock. Replacing it is a rename of a
+ * file synced to disk first, as the queue's snapshot is, so other processes see either every claim
+ * or none of a change, and a crash doesn't leave the file half written.
+ *
+ * Completing a task doesn't go through its claim. Claims on tasks that aren't pending anymore, and
+ * expired ones, are dropped instead whenever the claims are read or written, which keeps the file
+ * down to the tasks actually being worked on.
+ */
+
+static int64_t current_time(void) {
+    return (int64_t)time(NULL);
+}
+
+static char *claims_path(const char *queue_path) {
+    size_t len = strlen(queue_path);
+    char *path = safe_malloc(len + sizeof(TQ_CLAIMS_EXT));
+    memcpy(path, queue_path, len);
+    memcpy(path + len, TQ_CLAIMS_EXT, sizeof(TQ_CLAIMS_EXT));
+    return path;
+}
+
+static bool is_live(tq_t *tq, const tq_claim_t *claim, int64_t now) {
+    return claim->expiry > now && tq_find_todo(tq, claim->id);
+}
+
+static int compare_claims(const void *a, const void *b) {
+    return strcmp(((const tq_claim_t *)a)->id, ((const tq_claim_t *)b)->id);
+}
+
+// Claims are kept sorted by ID: a worker claiming a task walks past every task claimed before it.
+static void insert_claim(tq_claim_t **claims, size_t *count, size_t *cap, const tq_claim_t *claim) {
+    if(*count == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        *claims = safe_realloc(*claims, *cap * sizeof(**claims));
+    }
+    size_t pos = *count;
+    while(pos && compare_claims(&(*claims)[pos - 1], claim) > 0) --pos;
+    memmove(&(*claims)[pos + 1], &(*claims)[pos], (*count - pos) * sizeof(**claims));
+    (*claims)[pos] = *claim;
+    *count += 1;
+}
+
+static void add_claim(tq_t *tq, const tq_claim_t *claim) {
+    insert_claim(&tq->claims, &tq->num_claims, &tq->claims_cap, claim);
+}
+
+static bool parse_claim(char *line, tq_claim_t *claim) {
+    char *expiry = strchr(line, ':');
+    char *holder = expiry ? strchr(expiry + 1, ':') : NULL;
+    if(!holder) return false;
+    *expiry++ = '\0';
+    *holder++ = '\0';
+    
+    char *end = NULL;
+    errno = 0;
+    long long value = strtoll(expiry, &end, 10);
+    if(errno || end == expiry || *end) return false;
+    if(!*line || strlen(line) > TQ_ID_MAX || !*holder || strlen(holder) > TQ_HOLDER_MAX) return false;
+    
+    memset(claim, 0, sizeof(*claim));
+    strcpy(claim->id, line);
+    strcpy(claim->holder, holder);
+    claim->expiry = value;
+    return true;
+}
+
+// Reads the claims of the queue at [queue_path] that haven't expired, sorted by ID.
+static tq_status_t read_claims(const char *queue_path, tq_claim_t **claims, size_t *count,
+                               size_t *cap) {
+    char *path = claims_path(queue_path);
+    FILE *in = fopen(path, "rb");
+    free(path);
+    if(!in) return errno == ENOENT ? TQ_OK : TQ_ERROR_IO;
+    
+    int64_t now = current_time();
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    bool ok = true;
+    while(ok && (len = getline(&line, &line_cap, in)) >= 0) {
+        if(len && line[len - 1] == '\n') line[--len] = '\0';
+        tq_claim_t claim;
+        ok = parse_claim(line, &claim);
+        if(ok && claim.expiry > now) insert_claim(claims, count, cap, &claim);
+    }
+    ok = ok && !ferror(in);
+    free(line);
+    fclose(in);
+    return ok ? TQ_OK : TQ_ERROR_INVALID_DB;
+}
+
+static tq_status_t load_claims(tq_t *tq) {
+    if(tq->has_claims) return TQ_OK;
+    
+    tq->num_claims = 0;
+    tq_status_t err = read_claims(tq->path, &tq->claims, &tq->num_claims, &tq->claims_cap);
+    if(err != TQ_OK) {
+        tq->num_claims = 0;
+        return err;
+    }
+    
+    int64_t now = current_time();
+    size_t live = 0;
+    for(size_t i = 0; i < tq->num_claims; ++i) {
+        if(is_live(tq, &tq->claims[i], now)) tq->claims[live++] = tq->claims[i];
+    }
+    tq->num_claims = live;
+    tq->has_claims = true;
+    return TQ_OK;
+}
+
+tq_status_t tq_read_claims(const char *path, tq_claim_t **claims, size_t *count) {
+    ASSERT(path);
+    ASSERT(claims);
+    ASSERT(count);
+    *claims = NULL;
+    *count = 0;
+    size_t cap = 0;
+    tq_status_t err = read_claims(path, claims, count, &cap);
+    if(err != TQ_OK) {
+        free(*claims);
+        *claims = NULL;
+        *count = 0;
+    }
+    return err;
+}
+
+static bool save_claims(tq_t *tq) {
+    char *path = claims_path(tq->path);
+    size_t tmp_size = strlen(path) + 8;
+    char *tmp_path = safe_malloc(tmp_size);
+    snprintf(tmp_path, tmp_size, "%s.XXXXXX", path);
+    
+    int64_t now = current_time();
+    size_t live = 0;
+    for(size_t i = 0; i < tq->num_claims; ++i) {
+        if(is_live(tq, &tq->claims[i], now)) tq->claims[live++] = tq->claims[i];
+    }
+    tq->num_claims = live;
+    
+    bool ok;
+    if(!live) {
+        ok = unlink(path) == 0 || errno == ENOENT;
+    } else {
+        int fd = mkstemp(tmp_path);
+        FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        ok = out != NULL;
+        if(fd >= 0 && !out) close(fd);
+        for(size_t i = 0; ok && i < live; ++i) {
+            const tq_claim_t *claim = &tq->claims[i];
+            fprintf(out, "%s:%" PRId64 ":%s\n", claim->id, claim->expiry, claim->holder);
+        }
+        if(out) {
+            ok = fflush(out) == 0 && !ferror(out) && fchmod(fd, 0644) == 0 && fsync(fd) == 0;
+            ok = (fclose(out) == 0) && ok;
+            ok = ok && rename(tmp_path, path) == 0;
+        }
+        if(!ok && fd >= 0) unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+    return ok;
+}
+
+static tq_claim_t *find_claim(tq_t *tq, const char *id) {
+    tq_claim_t key;
+    snprintf(key.id, sizeof(key.id), "%s", id);
+    tq_claim_t *claim = tq->num_claims
+        ? bsearch(&key, tq->claims, tq->num_claims, sizeof(*tq->claims), compare_claims)
+        : NULL;
+    return claim && claim->expiry > current_time() ? claim : NULL;
+}
+
+const tq_claim_t *tq_find_claim(tq_t *tq, const char *id) {
+    ASSERT(tq);
+    ASSERT(id);
+    if(load_claims(tq) != TQ_OK || !tq_find_todo(tq, id)) return NULL;
+    return find_claim(tq, id);
+}
+
+tq_status_t tq_claim(tq_t *tq, const char *holder, unsigned lease, char id[TQ_ID_SIZE]) {
+    if(!tq || !holder || !*holder || strlen(holder) > TQ_HOLDER_MAX || strpbrk(holder, "\r\n")) {
+        return TQ_ERROR_INVALID_ARGUMENT;
+    }
+    if(!lease) return TQ_ERROR_INVALID_ARGUMENT;
+    if(!tq->writable) return TQ_ERROR_LOCK;
+    
+    tq_status_t err = load_claims(tq);
+    if(err != TQ_OK) return err;
+    
+    // Claimed tasks are at the front of the queue, as long as workers take tasks in order: only
+    // those are walked past.
+    tq_task_t *task = list_head(&tq->todo);
+    while(task && find_claim(tq, task->id)) task = list_next(&tq->todo, task);
+    if(!task) return TQ_ERROR_NOT_FOUND;
+    
+    tq_claim_t claim;
+    memset(&claim, 0, sizeof(claim));
+    memcpy(claim.id, task->id, TQ_ID_SIZE);
+    strcpy(claim.holder, holder);
+    claim.expiry = current_time() + lease;
+    add_claim(tq, &claim);
+    
+    if(!save_claims(tq)) {
+        // What's on disk is what counts: it's read again next time.
+        tq->num_claims = 0;
+        tq->has_claims = false;
+        return TQ_ERROR_IO;
+    }
+    if(id) memcpy(id, claim.id, TQ_ID_SIZE);
+    return TQ_OK;
+}
+
+tq_status_t tq_release(tq_t *tq, const char *id, const char *holder) {
+    if(!tq || !id) return TQ_ERROR_INVALID_ARGUMENT;
+    if(!tq->writable) return TQ_ERROR_LOCK;
+    
+    tq_status_t err = load_claims(tq);
+    if(err != TQ_OK) return err;
+    
+    tq_claim_t *claim = tq_find_todo(tq, id) ? find_claim(tq, id) : NULL;
+    if(!claim) return TQ_ERROR_NOT_FOUND;
+    if(holder && strcmp(claim->holder, holder)) return TQ_ERROR_CLAIMED;
+    
+    // Expiring the claim drops it from the file.
+    claim->expiry = 0;
+    if(!save_claims(tq)) {
+        tq->num_claims = 0;
+        tq->has_claims = false;
+        return TQ_ERROR_IO;
+    }
+    return TQ_OK;
+}
@@ -7,6 +7,8 @@
  * Licensed under the MIT License
  *===--------------------------------------------------------------------------------------------===
 */
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +16,8 @@
 #include <term/printing.h>
 #include <term/colors.h>
 #include "cli.h"
+#include "server.h"
+#include "trace.h"
 
 typedef struct {
     const char  *cmd;
@@ -26,20 +30,34 @@ static const subcmd_t cmds[] = {
     { "add",    "Add new tasks to a queue",     subcmd_add },
     { "list",   "Show tasks in a queue",        subcmd_list },
     { "done",   "Mark tasks as done",           subcmd_done },
+    { "claim",  "Take the next task nobody is working on", subcmd_claim },
+    { "release", "Give claimed tasks back",     subcmd_release },
+    { "find",   "Find tasks by their description", subcmd_find },
+    { "convert", "Change a queue's file format", subcmd_convert },
+    { "serve",  "Keep a queue loaded for other tq commands", subcmd_serve },
+    { "watch",  "Print changes to a queue as they are made", subcmd_watch },
     { NULL, NULL, NULL }
 };
 
 const char *tq_prog_name = "tq";
 
+// The subcommand line being run, forwarded as-is when a server owns the queue.
+static int current_argc = 0;
+static const char **current_argv = NULL;
+static bool current_reads_stdin = false;
+
 static const term_param_t params[] = {
     {0, TERM_ARG_VERSION, "version", TERM_ARG_OPTION, "print version number"},
+    {0, 's', "stats", TERM_ARG_OPTION,
+        "report where the command spends its time (--stats=json for JSON, like TQ_TRACE)"},
 };
+static const int num_params = 2;
 
 
 static void usage() {
     
     const char *uses[] = {
-        "<subcommand> ...",
+        "[--stats[=json]] <subcommand> ...",
         "[--help] [--version]"
     };
     term_print_usage(stdout, tq_prog_name, uses, 2);
@@ -56,7 +74,18 @@ static void usage() {
     }
     puts("");
     
-    term_print_help(stdout, params, 1);
+    // Discovery is cached (see discover.c), and the cache can't see everything.
+    term_set_bold(stdout, true);
+    printf("Environment\n");
+    term_style_reset(stdout);
+    printf("  %-14s the queue to use (a queue file, or a directory holding one), rather than\n"
+           "  %-14s the closest one up the directory tree\n\n", TQ_DB_ENV, "");
+    printf("  Queues found up the directory tree are remembered in $XDG_CACHE_HOME/tq/queues\n"
+           "  (~/.cache/tq/queues by default). A queue that appears closer to a directory by any\n"
+           "  other means than tq init (git checkout, cp, mv...) isn't seen from there until that\n"
+           "  file is removed: set %s, or remove the file, to use the new queue.\n\n", TQ_DB_ENV);
+    
+    term_print_help(stdout, params, num_params);
 }
 
 static _Noreturn void version() {
@@ -71,6 +100,24 @@ static const subcmd_t *find_command(const char *arg) {
     return NULL;
 }
 
+int run_subcommand(int argc, const char **argv) {
+    const subcmd_t *cmd = find_command(argv[0]);
+    if(!cmd) {
+        term_error(tq_prog_name, 0, "'%s' is not a tq command", argv[0]);
+        return 1;
+    }
+    
+    current_argc = argc;
+    current_argv = argv;
+    current_reads_stdin = false;
+    return cmd->run(argc, argv);
+}
+
+// Commands that fail mostly exit from wherever they fail: their trace is reported on the way out.
+static void trace_at_exit(void) {
+    trace_end(TRACE_NO_STATUS);
+}
+
 int main(int argc, const char **argv) {
     if(argc < 2) {
         usage();
@@ -79,9 +126,12 @@ int main(int argc, const char **argv) {
     
     const char **cmd_argv = NULL;
     int cmd_argc = 0;
+    trace_format_t trace = trace_parse_format(getenv(TQ_TRACE_ENV));
     
     for(int i = 1; i < argc; ++i) {
         const char *arg = argv[i];
+        if(!strcmp(arg, "--stats")) trace = TRACE_TEXT;
+        else if(!strncmp(arg, "--stats=", 8)) trace = trace_parse_format(arg + 8);
         if(arg[0] == '-') continue;
         cmd_argv = &argv[i];
         cmd_argc = argc - i;
@@ -90,16 +140,17 @@ int main(int argc, const char **argv) {
     
     
     if(cmd_argv != NULL) {
-        const subcmd_t *cmd = find_command(cmd_argv[0]);
-        if(cmd) return cmd->run(cmd_argc, cmd_argv);
-        
-        term_error(tq_prog_name, 1, "'%s' is not a tq command", cmd_argv[0]);
-        
+        trace_begin(trace, cmd_argv[0]);
+        if(trace != TRACE_OFF) atexit(trace_at_exit);
+        int status = run_subcommand(cmd_argc, cmd_argv);
+        trace_end(status);
+        trace_begin(TRACE_OFF, cmd_argv[0]);
+        return status;
     } else {
         term_arg_parser_t args;
         term_arg_parser_init(&args, argc, argv);
         
-        term_arg_result_t arg = term_arg_parse(&args, params, 1);
+        term_arg_result_t arg = term_arg_parse(&args, params, num_params);
         
         while(arg.name != TERM_ARG_DONE) {
             switch(arg.name) {
@@ -115,23 +166,136 @@ int main(int argc, const char **argv) {
                 term_error(tq_prog_name, 1, "%s", args.error);
                 break;
             }
-            arg = term_arg_parse(&args, params, 1);
+            arg = term_arg_parse(&args, params, num_params);
         }
     }
 }
 
-void get_tq(tq_t *tq) {
-    char *path = tq_get_db_path(fs_current_dir());
+bool check_tq(tq_status_t status, const char *path) {
+    switch(status) {
+    case TQ_OK: return true;
+    case TQ_ERROR_IO: term_error(tq_prog_name, 0, "unable to open task list at %s", path); break;
+    case TQ_ERROR_INVALID_DB: term_error(tq_prog_name, 0, "task list at %s corrupted", path); break;
+    case TQ_ERROR_LOCK: term_error(tq_prog_name, 0, "unable to lock task list at %s", path); break;
+    case TQ_ERROR_NOT_FOUND: term_error(tq_prog_name, 0, "no task queue at %s", path); break;
+    case TQ_ERROR_INVALID_ARGUMENT:
+    case TQ_ERROR_CLAIMED:
+        term_error(tq_prog_name, 0, "%s", tq_strerror(status));
+        break;
+    }
+    return false;
+}
+
+tq_t *open_tq(const char *path, tq_access_t access) {
+    tq_t *tq = NULL;
+    if(!check_tq(tq_open(path, access, &tq), path)) exit(EXIT_FAILURE);
+    return tq;
+}
+
+// If a server owns the queue at [path], runs the current command there and exits with its status.
+// The server traces the command as we would have, and its report replaces ours.
+static void forward_command(const char *path) {
+    int status = 0;
+    if(server_queue()) return;
+    if(!server_forward(path, current_argc, current_argv, current_reads_stdin, &status)) return;
+    trace_begin(TRACE_OFF, current_argv[0]);
+    exit(status);
+}
+
+static tq_t *local_tq = NULL;
+
+void reads_stdin(void) {
+    current_reads_stdin = true;
+}
+
+char *find_tq_path(void) {
+    char *path = tq_find_db(fs_current_dir());
+    if(path) return path;
+    
+    char *env_path = tq_env_db_path();
+    if(env_path) term_error(tq_prog_name, 1, "no task queue at %s", env_path);
+    term_error(tq_prog_name, 1, "no task queue in directory hierarchy");
+    return NULL;
+}
+
+tq_t *get_tq(tq_access_t access) {
+    tq_t *served = server_queue();
+    if(served) return served;
+    
+    char *path = find_tq_path();
+    forward_command(path);
+    local_tq = open_tq(path, access);
+    free(path);
+    return local_tq;
+}
+
+char *get_tq_path(void) {
+    if(server_queue()) return NULL;
+    
+    char *path = find_tq_path();
+    forward_command(path);
+    return path;
+}
+
+tq_t *new_tq(const char *path, tq_format_t format) {
+    if(server_queue()) {
+        tq_t *tq = server_reset();
+        tq->format = format;
+        if(tq_compact(tq)) return tq;
+        term_error(tq_prog_name, 0, "unable to write task list at %s", path);
+        return NULL;
+    }
     
-    if(!path) {
-        term_error(tq_prog_name, 1, "no task queue in directory hierarchy");
+    forward_command(path);
+    tq_status_t status = tq_create(path, format, &local_tq);
+    if(status != TQ_OK) {
+        term_error(tq_prog_name, 0, "unable to %s task list at %s",
+            status == TQ_ERROR_LOCK ? "lock" : "write", path);
+        return NULL;
+    }
+    return local_tq;
+}
+
+bool save_tq(tq_t *tq) {
+    if(tq == server_queue()) {
+        server_mark_dirty();
+        return true;
     }
     
-    switch(tq_init(tq, path)) {
-    case TQ_OK: break;
-    case TQ_ERROR_IO: term_error(tq_prog_name, 1, "unable to open task list at %s", path); break;
-    case TQ_ERROR_INVALID_DB: term_error(tq_prog_name, 1, "task list at %s corrupted", path); break;
+    tq_status_t status = tq_flush(tq);
+    if(status != TQ_OK) {
+        term_error(tq_prog_name, 0, "unable to write task list at %s: %s", tq->path, tq_strerror(status));
+        return false;
     }
+    return true;
+}
+
+void put_tq(tq_t *tq) {
+    if(tq == server_queue()) return;
+    tq_close(tq);
+    if(tq == local_tq) local_tq = NULL;
+}
+
+bool parse_size(const char *option, const char *value, size_t *size) {
+    char *end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if(errno || end == value || *end || value[0] == '-' || n > SIZE_MAX) {
+        term_error(tq_prog_name, 0, "--%s expects a number, not '%s'", option, value);
+        return false;
+    }
+    *size = (size_t)n;
+    return true;
+}
+
+int arg_error(const char *fmt, ...) {
+    char message[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    term_error(tq_prog_name, 0, "%s", message);
+    return -1;
 }
 
 
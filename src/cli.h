@@ -26,8 +26,50 @@ int subcmd_init(int argc, const char **argv);
 int subcmd_list(int argc, const char **argv);
 int subcmd_add(int argc, const char **argv);
 int subcmd_done(int argc, const char **argv);
+int subcmd_claim(int argc, const char **argv);
+int subcmd_release(int argc, const char **argv);
+int subcmd_find(int argc, const char **argv);
+int subcmd_convert(int argc, const char **argv);
+int subcmd_serve(int argc, const char **argv);
+int subcmd_watch(int argc, const char **argv);
 
-void get_tq(tq_t *tq);
+int run_subcommand(int argc, const char **argv);
+
+/*
+ * Subcommands can be run by a server on behalf of its clients (see server.h), so they must never
+ * exit the process: they report errors and return a non-zero status instead. Only commands that
+ * are never forwarded to a server (serve, watch) can exit, through open_tq() and find_tq_path().
+ */
+
+// Reports an error if [status] isn't TQ_OK, and returns whether it is.
+bool check_tq(tq_status_t status, const char *path);
+// Opens the queue at [path], exiting with an error message if that fails.
+tq_t *open_tq(const char *path, tq_access_t access);
+
+// Called by commands that read their standard input, before get_tq(): if the command is run by a
+// server, the input is read in full beforehand, so that the server doesn't wait on it.
+void reads_stdin(void);
+// Returns the queue for the current directory. If a server owns that queue, the current command is
+// run by the server instead, and this doesn't return.
+tq_t *get_tq(tq_access_t access);
+// Finds the queue the command applies to (see tq_find_db()), or exits with an error.
+char *find_tq_path(void);
+// Returns the path of the queue for the current directory, for commands that read it without
+// loading it, or NULL when running in a server: the server's queue is already loaded, use get_tq().
+// Like get_tq(), this doesn't return if a server owns the queue.
+char *get_tq_path(void);
+// Like get_tq(), but replaces the queue at [path] with an empty one, and returns it. Returns NULL
+// with an error message if the new queue couldn't be written.
+tq_t *new_tq(const char *path, tq_format_t format);
+// Persists changes made to a queue returned by get_tq() or new_tq().
+bool save_tq(tq_t *tq);
+void put_tq(tq_t *tq);
+
+// Parses the value of --[option] as a non-negative integer into [size]. Returns false with an error
+// message if it isn't one.
+bool parse_size(const char *option, const char *value, size_t *size);
+// Reports a problem with a subcommand's arguments, and returns -1 for the subcommand to return.
+int arg_error(const char *fmt, ...);
 
 void subcmd_use(
     const char *cmd, const char *use, const char *summary,
@@ -0,0 +1,229 @@
+/*===--------------------------------------------------------------------------------------------===
+ * discover.c - finding the queue that applies to a directory
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "tq.h"
+#include "trace.h"
+#include <utils/assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Walking up to the root costs a stat() per directory, which adds up in deep build trees on
+ * network file systems. Queues found that way are remembered in a small per-user cache, keyed by
+ * the directory the walk started from. Entries are checked with a single stat() of the queue they
+ * point to: the queue's inode can't be used, since every compaction replaces the file, and neither
+ * can the directory's mtime, which changes with every file created in it (build directories would
+ * never hit). What a stat() can't see is a queue created between a directory and the queue it was
+ * resolved to: tq init drops the cached entries under the directory it creates a queue in. Checking
+ * the directories in between would cost as much as walking up again, so queues that appear there
+ * any other way (a checkout, a copy) are missed until the cache is removed, as tq help says.
+ *
+ * The cache is a file of (directory, queue) pairs of NUL-terminated paths, most recent first. It's
+ * only a hint: anything wrong with it just means walking up the tree again.
+ */
+
+#define CACHE_MAX_ENTRIES (64)
+#define CACHE_MAX_SIZE (CACHE_MAX_ENTRIES * 2 * 4096)
+
+char *tq_get_db_path(const char *root) {
+    ASSERT(root);
+    
+    // One buffer for the whole walk: each step up just truncates the directory part.
+    size_t len = strlen(root);
+    char *path = safe_malloc(len + 1 + sizeof(TQ_DB_NAME));
+    memcpy(path, root, len);
+    
+    for(;;) {
+        size_t base = len;
+        if(!base || path[base - 1] != '/') path[base++] = '/';
+        memcpy(path + base, TQ_DB_NAME, sizeof(TQ_DB_NAME));
+        
+        struct stat st;
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode)) return path;
+        
+        // Move up to the parent directory, and stop once the root has been checked.
+        while(len && path[len - 1] == '/') --len;
+        while(len && path[len - 1] != '/') --len;
+        if(!len) break;
+        if(len > 1) --len;
+    }
+    free(path);
+    return NULL;
+}
+
+char *tq_env_db_path(void) {
+    const char *env = getenv(TQ_DB_ENV);
+    if(!env || !*env) return NULL;
+    
+    char *path = env[0] == '/' ? safe_strdup(env) : fs_make_path(fs_current_dir(), env, NULL);
+    struct stat st;
+    if(stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        char *file = fs_make_path(path, TQ_DB_NAME, NULL);
+        free(path);
+        path = file;
+    }
+    return path;
+}
+
+static char *cache_path(void) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if(xdg && xdg[0] == '/') return fs_make_path(xdg, "tq", "queues", NULL);
+    const char *home = getenv("HOME");
+    if(home && home[0] == '/') return fs_make_path(home, ".cache", "tq", "queues", NULL);
+    return NULL;
+}
+
+// Reads the whole cache. Returns NULL if there isn't one, or if it doesn't look like one.
+static char *cache_read(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    
+    struct stat st;
+    char *data = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= CACHE_MAX_SIZE) {
+        data = safe_malloc(st.st_size);
+        ssize_t r = read(fd, data, st.st_size);
+        if(r != st.st_size || data[r - 1] != '\0') {
+            free(data);
+            data = NULL;
+        }
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+// Walks the (directory, queue) pairs of [data]. Returns false at the end, or if the cache is torn.
+static bool cache_next(const char **cur, const char *end, const char **dir, const char **queue) {
+    if(*cur >= end) return false;
+    *dir = *cur;
+    *queue = memchr(*dir, '\0', end - *dir);
+    if(!*queue || ++*queue >= end) return false;
+    const char *next = memchr(*queue, '\0', end - *queue);
+    if(!next) return false;
+    *cur = next + 1;
+    return true;
+}
+
+static bool is_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    while(len > 1 && dir[len - 1] == '/') --len;
+    if(strncmp(path, dir, len)) return false;
+    return path[len] == '\0' || path[len] == '/' || (len == 1 && dir[0] == '/');
+}
+
+static void make_dirs(char *path) {
+    // Creates every directory leading to [path], the way mkdir -p would.
+    for(char *sep = strchr(path + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdir(path, 0700);
+        *sep = '/';
+    }
+}
+
+// Rewrites the cache, with [dir] resolving to [queue] first. Without a queue, every entry under
+// [dir] is dropped instead.
+static void cache_update(const char *dir, const char *queue) {
+    char *path = cache_path();
+    if(!path) return;
+    
+    size_t size = 0;
+    char *data = cache_read(path, &size);
+    if(!data && !queue) {
+        free(path);
+        return;
+    }
+    
+    size_t tmp_size = strlen(path) + 8;
+    char *tmp_path = safe_malloc(tmp_size);
+    snprintf(tmp_path, tmp_size, "%s.XXXXXX", path);
+    make_dirs(tmp_path);
+    int fd = mkstemp(tmp_path);
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    
+    if(out) {
+        int count = 0;
+        if(queue) {
+            fwrite(dir, 1, strlen(dir) + 1, out);
+            fwrite(queue, 1, strlen(queue) + 1, out);
+            count += 1;
+        }
+        
+        const char *cur = data, *entry_dir, *entry_queue;
+        while(data && count < CACHE_MAX_ENTRIES && cache_next(&cur, data + size, &entry_dir, &entry_queue)) {
+            if(queue ? !strcmp(entry_dir, dir) : is_within(entry_dir, dir)) continue;
+            fwrite(entry_dir, 1, entry_queue - entry_dir, out);
+            fwrite(entry_queue, 1, strlen(entry_queue) + 1, out);
+            count += 1;
+        }
+        
+        bool ok = fflush(out) == 0 && !ferror(out);
+        ok = (fclose(out) == 0) && ok;
+        if(!ok || rename(tmp_path, path) != 0) unlink(tmp_path);
+    } else if(fd >= 0) {
+        close(fd);
+        unlink(tmp_path);
+    }
+    
+    free(tmp_path);
+    free(data);
+    free(path);
+}
+
+static char *cache_lookup(const char *dir) {
+    char *path = cache_path();
+    if(!path) return NULL;
+    
+    size_t size = 0;
+    char *data = cache_read(path, &size);
+    free(path);
+    if(!data) return NULL;
+    
+    char *found = NULL;
+    const char *cur = data, *entry_dir, *entry_queue;
+    while(cache_next(&cur, data + size, &entry_dir, &entry_queue)) {
+        if(strcmp(entry_dir, dir)) continue;
+        
+        struct stat st;
+        if(stat(entry_queue, &st) == 0 && S_ISREG(st.st_mode)) found = safe_strdup(entry_queue);
+        break;
+    }
+    free(data);
+    return found;
+}
+
+static char *find_db(const char *dir) {
+    char *path = tq_env_db_path();
+    if(path) {
+        if(fs_file_exists(path)) return path;
+        free(path);
+        return NULL;
+    }
+    
+    if((path = cache_lookup(dir))) return path;
+    if((path = tq_get_db_path(dir))) cache_update(dir, path);
+    return path;
+}
+
+char *tq_find_db(const char *dir) {
+    ASSERT(dir);
+    trace_phase_t phase = trace_enter(TRACE_DISCOVER);
+    char *path = find_db(dir);
+    trace_enter(phase);
+    return path;
+}
+
+void tq_forget_dbs(const char *dir) {
+    ASSERT(dir);
+    cache_update(dir, NULL);
+}
@@ -0,0 +1,138 @@
+/*===--------------------------------------------------------------------------------------------===
+ * index.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "index.h"
+#include <utils/helpers.h>
+#include <utils/assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_MIN_CAPACITY (64)
+
+tq_key_t index_key(const char *id, size_t len) {
+    ASSERT(id);
+    ASSERT(len > 0 && len <= sizeof(tq_key_t));
+    tq_key_t key = 0;
+    memcpy(&key, id, len);
+    return key;
+}
+
+size_t index_hash(tq_key_t key, size_t capacity) {
+    ASSERT(capacity > 1 && !(capacity & (capacity - 1)));
+    // Fibonacci hashing: keep as many of the top bits as the table needs, which depend on every
+    // byte of the key. Lower bits don't: IDs that only differ in their last characters would
+    // collide.
+    return (size_t)((key * 0x9e3779b97f4a7c15ull) >> (64 - __builtin_ctzll(capacity)));
+}
+
+void index_init(tq_index_t *index) {
+    ASSERT(index);
+    memset(index, 0, sizeof(*index));
+}
+
+void index_fini(tq_index_t *index) {
+    ASSERT(index);
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+static void place(tq_index_slot_t *slots, size_t capacity, tq_key_t key, void *value) {
+    size_t mask = capacity - 1;
+    size_t i = index_hash(key, capacity);
+    while(slots[i].key) {
+        ASSERT(slots[i].key != key);
+        i = (i + 1) & mask;
+    }
+    slots[i].key = key;
+    slots[i].value = value;
+}
+
+static void rehash(tq_index_t *index, size_t capacity) {
+    tq_index_slot_t *slots = safe_calloc(capacity, sizeof(*slots));
+    for(size_t i = 0; i < index->capacity; ++i) {
+        if(!index->slots[i].key) continue;
+        place(slots, capacity, index->slots[i].key, index->slots[i].value);
+    }
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+}
+
+void index_reserve(tq_index_t *index, size_t count) {
+    ASSERT(index);
+    // Keep the load factor under 3/4, past that linear probing degrades quickly.
+    size_t capacity = index->capacity ? index->capacity : INDEX_MIN_CAPACITY;
+    while(count > capacity / 4 * 3) capacity *= 2;
+    if(capacity != index->capacity) rehash(index, capacity);
+}
+
+void *index_find(const tq_index_t *index, tq_key_t key) {
+    ASSERT(index);
+    if(!index->count) return NULL;
+    
+    size_t mask = index->capacity - 1;
+    size_t i = index_hash(key, index->capacity);
+    while(index->slots[i].key) {
+        if(index->slots[i].key == key) return index->slots[i].value;
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+void index_insert(tq_index_t *index, tq_key_t key, void *value) {
+    ASSERT(index);
+    ASSERT(key);
+    index_reserve(index, index->count + 1);
+    place(index->slots, index->capacity, key, value);
+    index->count += 1;
+}
+
+void index_remove(tq_index_t *index, tq_key_t key) {
+    ASSERT(index);
+    if(!index->count) return;
+    
+    size_t mask = index->capacity - 1;
+    size_t i = index_hash(key, index->capacity);
+    while(index->slots[i].key && index->slots[i].key != key) i = (i + 1) & mask;
+    if(!index->slots[i].key) return;
+    
+    // Entries further down the run move back into the hole, unless their own slot comes after it.
+    size_t hole = i;
+    for(size_t j = (i + 1) & mask; index->slots[j].key; j = (j + 1) & mask) {
+        size_t home = index_hash(index->slots[j].key, index->capacity);
+        bool stays = hole <= j ? hole < home && home <= j : hole < home || home <= j;
+        if(stays) continue;
+        index->slots[hole] = index->slots[j];
+        hole = j;
+    }
+    index->slots[hole].key = 0;
+    index->slots[hole].value = NULL;
+    index->count -= 1;
+}
+
+bool index_insert_shared(tq_index_t *index, tq_key_t key, void *value) {
+    ASSERT(index);
+    ASSERT(key);
+    ASSERT(index->capacity);
+    
+    // Slots are claimed by swapping their key in: whoever loses the race for a slot either finds
+    // its own key there (a duplicate) or moves on to the next one, like any other collision.
+    size_t mask = index->capacity - 1;
+    size_t i = index_hash(key, index->capacity);
+    for(;;) {
+        tq_key_t expected = 0;
+        if(__atomic_compare_exchange_n(&index->slots[i].key, &expected, key,
+                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            index->slots[i].value = value;
+            return true;
+        }
+        if(expected == key) return false;
+        i = (i + 1) & mask;
+    }
+}
@@ -0,0 +1,67 @@
+/*===--------------------------------------------------------------------------------------------===
+ * index.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_INDEX_H_
+#define _TQ_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Task IDs are short enough to be packed in a single integer, so they can be hashed and compared
+// without walking strings. Packing is only meant for equality: keys don't sort like their IDs.
+typedef uint64_t tq_key_t;
+
+typedef struct tq_index_slot_t {
+    tq_key_t    key;        // 0 for an empty slot: no ID packs to 0
+    void        *value;
+} tq_index_slot_t;
+
+// An open-addressing (linear probing) hash table from keys to pointers. Tasks are hardly ever
+// forgotten while a queue is open, so removing an entry is the slow path: the entries after it are
+// shifted back, rather than leaving a tombstone for every lookup to step over.
+typedef struct tq_index_t {
+    tq_index_slot_t *slots;
+    size_t          capacity;   // always a power of two, or 0
+    size_t          count;
+} tq_index_t;
+
+tq_key_t index_key(const char *id, size_t len);
+// Returns the slot [key] hashes to in a table of [capacity] slots, a power of two.
+size_t index_hash(tq_key_t key, size_t capacity);
+
+void index_init(tq_index_t *index);
+void index_fini(tq_index_t *index);
+
+// Makes sure [count] entries can be held in total without rehashing the table.
+void index_reserve(tq_index_t *index, size_t count);
+
+void *index_find(const tq_index_t *index, tq_key_t key);
+
+// Inserts an entry for [key], which must not be in the index yet.
+void index_insert(tq_index_t *index, tq_key_t key, void *value);
+
+// Removes the entry for [key], if there is one.
+void index_remove(tq_index_t *index, tq_key_t key);
+
+// Like index_insert(), but safe to call from several threads at once, as long as the index already
+// has room for everything they insert (see index_reserve()) and nobody looks anything up until
+// they're all done. [count] isn't updated: that's left to the caller, once everyone is done.
+// Returns false if [key] is already in the index.
+bool index_insert_shared(tq_index_t *index, tq_key_t key, void *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_INDEX_H_ */
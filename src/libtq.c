@@ -0,0 +1,181 @@
+/*===--------------------------------------------------------------------------------------------===
+ * libtq.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "libtq.h"
+#include "tq.h"
+#include <utils/helpers.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *tq_strerror(tq_status_t status) {
+    switch(status) {
+    case TQ_OK: return "success";
+    case TQ_ERROR_IO: return "unable to read or write the task queue";
+    case TQ_ERROR_INVALID_DB: return "task queue corrupted";
+    case TQ_ERROR_LOCK: return "unable to lock the task queue";
+    case TQ_ERROR_NOT_FOUND: return "not found";
+    case TQ_ERROR_INVALID_ARGUMENT: return "invalid argument";
+    case TQ_ERROR_CLAIMED: return "task claimed by someone else";
+    }
+    return "unknown error";
+}
+
+tq_status_t tq_locate(const char *dir, char **path) {
+    if(!dir || !path) return TQ_ERROR_INVALID_ARGUMENT;
+    *path = tq_find_db(dir);
+    return *path ? TQ_OK : TQ_ERROR_NOT_FOUND;
+}
+
+tq_status_t tq_open(const char *path, tq_access_t access, tq_t **tq) {
+    if(!path || !tq) return TQ_ERROR_INVALID_ARGUMENT;
+    *tq = NULL;
+    if(!fs_file_exists(path)) return TQ_ERROR_NOT_FOUND;
+    
+    tq_t *queue = safe_malloc(sizeof(*queue));
+    tq_status_t err = tq_init(queue, path, access);
+    if(err != TQ_OK) {
+        tq_fini(queue);
+        free(queue);
+        return err;
+    }
+    *tq = queue;
+    return TQ_OK;
+}
+
+tq_status_t tq_create(const char *path, tq_format_t format, tq_t **tq) {
+    if(!path || !tq) return TQ_ERROR_INVALID_ARGUMENT;
+    *tq = NULL;
+    
+    tq_t *queue = safe_malloc(sizeof(*queue));
+    tq_init_new(queue, path);
+    queue->format = format;
+    tq_status_t err = tq_lock(queue, TQ_ACCESS_WRITE);
+    if(err == TQ_OK && !tq_compact(queue)) err = TQ_ERROR_IO;
+    if(err != TQ_OK) {
+        tq_fini(queue);
+        free(queue);
+        return err;
+    }
+    
+    // Directories under the new queue may have been resolved to one further up the tree.
+    char *dir = fs_parent(path);
+    if(dir) tq_forget_dbs(strlen(dir) ? dir : ".");
+    free(dir);
+    *tq = queue;
+    return TQ_OK;
+}
+
+void tq_close(tq_t *tq) {
+    if(!tq) return;
+    tq_fini(tq);
+    free(tq);
+}
+
+tq_status_t tq_flush(tq_t *tq) {
+    if(!tq) return TQ_ERROR_INVALID_ARGUMENT;
+    if(!tq->writable && tq->num_pending) return TQ_ERROR_LOCK;
+    return tq_write(tq) ? TQ_OK : TQ_ERROR_IO;
+}
+
+typedef enum { INSERT_FRONT, INSERT_BACK, INSERT_AT, INSERT_AFTER, INSERT_BEFORE } insert_t;
+
+// Queue files are made of lines, and the whitespace around a description doesn't survive being
+// read back: descriptions are stored without it.
+static tq_status_t insert(tq_t *tq, const char *desc, insert_t where, size_t pos, const char *anchor,
+                          char id[TQ_ID_SIZE]) {
+    if(!tq || !desc || ((where == INSERT_AFTER || where == INSERT_BEFORE) && !anchor)) {
+        return TQ_ERROR_INVALID_ARGUMENT;
+    }
+    if(!tq->writable) return TQ_ERROR_LOCK;
+    if(strpbrk(desc, "\r\n")) return TQ_ERROR_INVALID_ARGUMENT;
+    
+    char *trimmed = NULL;
+    size_t len = strlen(desc);
+    if(len && (isspace((unsigned char)desc[0]) || isspace((unsigned char)desc[len - 1]))) {
+        trimmed = safe_strdup(desc);
+        str_trim_space(trimmed);
+        desc = trimmed;
+    }
+    if(!*desc) {
+        free(trimmed);
+        return TQ_ERROR_INVALID_ARGUMENT;
+    }
+    
+    tq_task_t *task = NULL;
+    switch(where) {
+    case INSERT_FRONT: task = tq_add_front(tq, desc); break;
+    case INSERT_BACK: task = tq_add_back(tq, desc); break;
+    case INSERT_AT: task = tq_add_at(tq, desc, pos); break;
+    case INSERT_AFTER: task = tq_add_after(tq, desc, anchor); break;
+    case INSERT_BEFORE: task = tq_add_before(tq, desc, anchor); break;
+    }
+    free(trimmed);
+    
+    if(!task) return TQ_ERROR_NOT_FOUND;
+    if(id) memcpy(id, task->id, TQ_ID_SIZE);
+    return TQ_OK;
+}
+
+tq_status_t tq_add(tq_t *tq, const char *desc, bool back, char id[TQ_ID_SIZE]) {
+    return insert(tq, desc, back ? INSERT_BACK : INSERT_FRONT, 0, NULL, id);
+}
+
+tq_status_t tq_insert_at(tq_t *tq, const char *desc, size_t pos, char id[TQ_ID_SIZE]) {
+    return insert(tq, desc, INSERT_AT, pos, NULL, id);
+}
+
+tq_status_t tq_insert_after(tq_t *tq, const char *desc, const char *anchor, char id[TQ_ID_SIZE]) {
+    return insert(tq, desc, INSERT_AFTER, 0, anchor, id);
+}
+
+tq_status_t tq_insert_before(tq_t *tq, const char *desc, const char *anchor, char id[TQ_ID_SIZE]) {
+    return insert(tq, desc, INSERT_BEFORE, 0, anchor, id);
+}
+
+tq_status_t tq_done(tq_t *tq, const char *id) {
+    if(!tq || !id) return TQ_ERROR_INVALID_ARGUMENT;
+    if(!tq->writable) return TQ_ERROR_LOCK;
+    return tq_mark_done(tq, id) ? TQ_OK : TQ_ERROR_NOT_FOUND;
+}
+
+size_t tq_count(tq_t *tq) {
+    return tq ? tq_num_todo(tq) : 0;
+}
+
+typedef struct {
+    tq_task_fn  visit;
+    void        *data;
+} iteration_t;
+
+static bool visit_task(const tq_task_t *task, size_t count, void *data) {
+    (void)count;
+    const iteration_t *it = data;
+    tq_task_info_t info = {
+        .id = task->id,
+        .desc = task->desc,
+        .desc_len = task->desc_len,
+        .done = task->done,
+    };
+    return it->visit(&info, it->data);
+}
+
+tq_status_t tq_iterate(tq_t *tq, bool done, tq_task_fn visit, void *data) {
+    if(!tq || !visit) return TQ_ERROR_INVALID_ARGUMENT;
+    iteration_t it = {.visit = visit, .data = data};
+    
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t)) {
+        if(!visit_task(t, 0, &it)) return TQ_OK;
+    }
+    if(!done) return TQ_OK;
+    for(tq_task_t *t = list_head(&tq->done); t; t = list_next(&tq->done, t)) {
+        if(!visit_task(t, 0, &it)) return TQ_OK;
+    }
+    return tq_visit_archive(tq, visit_task, &it);
+}
@@ -0,0 +1,128 @@
+/*===--------------------------------------------------------------------------------------------===
+ * libtq.h - the public interface of libtq
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_LIBTQ_H_
+#define _TQ_LIBTQ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libtq keeps task queues open in a process, to change them without running tq for every change.
+ * Queues are opaque: everything goes through the functions below, which report failures with a
+ * status code and never exit the process. Nothing is shared between queues, so different threads
+ * can use different queues at the same time; a single queue must not be used by two threads at
+ * once. Opening a queue for writing locks it, against other processes too, until it is closed.
+ *
+ * Changes are kept in memory until tq_flush(), which appends them to the queue's journal (and
+ * folds the journal back into the queue file once it grows large), so any number of changes can be
+ * made for the cost of a single write.
+ *
+ * This interface only grows: existing functions, types and values keep their meaning across
+ * versions, and TQ_API_VERSION goes up when something is added.
+ */
+
+#define TQ_API_VERSION (2)
+
+// Task IDs are NUL-terminated strings of at most TQ_ID_MAX characters.
+#define TQ_ID_MAX (8)
+#define TQ_ID_SIZE (TQ_ID_MAX + 1)
+
+// Claim holders are at most TQ_HOLDER_MAX characters.
+#define TQ_HOLDER_MAX (64)
+
+typedef struct tq_t tq_t;
+
+typedef enum tq_status_t {
+    TQ_OK = 0,
+    TQ_ERROR_IO,
+    TQ_ERROR_INVALID_DB,
+    TQ_ERROR_LOCK,
+    TQ_ERROR_NOT_FOUND,         // no queue where one was expected, or no pending task with an ID
+    TQ_ERROR_INVALID_ARGUMENT,
+    TQ_ERROR_CLAIMED,           // the task is claimed by another holder (since version 2)
+} tq_status_t;
+
+typedef enum tq_access_t {
+    TQ_ACCESS_READ,     // shared with other readers
+    TQ_ACCESS_WRITE,    // exclusive, held from loading the queue until it is closed
+} tq_access_t;
+
+typedef enum tq_format_t {
+    TQ_FORMAT_TEXT,
+    TQ_FORMAT_BINARY,
+} tq_format_t;
+
+// A task, as seen by tq_iterate(). Valid for the duration of the call only.
+typedef struct tq_task_info_t {
+    const char  *id;
+    const char  *desc;      // not NUL-terminated, always use desc_len
+    size_t      desc_len;
+    bool        done;
+} tq_task_info_t;
+
+// Called for each task by tq_iterate(). Returning false stops the iteration.
+typedef bool (*tq_task_fn)(const tq_task_info_t *task, void *data);
+
+// Returns a short description of [status], such as "task not found".
+const char *tq_strerror(tq_status_t status);
+
+// Finds the queue that applies to [dir], like tq does, and sets [*path] to a copy of its path that
+// the caller must free(). Returns TQ_ERROR_NOT_FOUND if there isn't one.
+tq_status_t tq_locate(const char *dir, char **path);
+
+// Opens the queue at [path], and sets [*tq] to it.
+tq_status_t tq_open(const char *path, tq_access_t access, tq_t **tq);
+// Creates an empty queue at [path], replacing any queue already there, and opens it for writing.
+tq_status_t tq_create(const char *path, tq_format_t format, tq_t **tq);
+// Closes a queue, releasing its lock. Changes that weren't flushed are dropped.
+void tq_close(tq_t *tq);
+
+// Persists every change made since the queue was opened or last flushed.
+tq_status_t tq_flush(tq_t *tq);
+
+// Adds a task at the front of the queue, or at its back if [back] is set. Descriptions can't be
+// empty, or hold line breaks. If [id] isn't NULL, the new task's ID is copied into it.
+tq_status_t tq_add(tq_t *tq, const char *desc, bool back, char id[TQ_ID_SIZE]);
+// Adds a task so that it ends up at [pos] in the pending tasks, 0 being the front. Anything past
+// the end adds it at the back.
+tq_status_t tq_insert_at(tq_t *tq, const char *desc, size_t pos, char id[TQ_ID_SIZE]);
+// Adds a task right after, or right before, the pending task [anchor].
+tq_status_t tq_insert_after(tq_t *tq, const char *desc, const char *anchor, char id[TQ_ID_SIZE]);
+tq_status_t tq_insert_before(tq_t *tq, const char *desc, const char *anchor, char id[TQ_ID_SIZE]);
+
+// Marks the pending task [id] as done.
+tq_status_t tq_done(tq_t *tq, const char *id);
+
+// Claims let several workers take tasks from the same queue without two of them getting the same
+// one. A claim lasts until its task is done, until it's released, or until its lease runs out,
+// and claims take effect right away: they don't wait for tq_flush(). Since version 2.
+//
+// Claims the first pending task that isn't claimed already for [holder], for [lease] seconds, and
+// copies its ID into [id]. Returns TQ_ERROR_NOT_FOUND if every pending task is claimed.
+tq_status_t tq_claim(tq_t *tq, const char *holder, unsigned lease, char id[TQ_ID_SIZE]);
+// Gives up the claim on the pending task [id]. With a [holder], only a claim it holds is given
+// up, and TQ_ERROR_CLAIMED is returned for one held by someone else.
+tq_status_t tq_release(tq_t *tq, const char *id, const char *holder);
+
+// Returns the number of pending tasks.
+size_t tq_count(tq_t *tq);
+// Visits the pending tasks in order, then, if [done] is set, the done ones, most recently
+// completed first (archived ones included).
+tq_status_t tq_iterate(tq_t *tq, bool done, tq_task_fn visit, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_LIBTQ_H_ */
@@ -0,0 +1,201 @@
+/*===--------------------------------------------------------------------------------------------===
+ * order.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "order.h"
+#include <utils/helpers.h>
+#include <utils/assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE(order, obj) ((order_node_t *)((char *)(obj) + (order)->offset))
+#define OBJ(order, node) ((void *)((char *)(node) - (order)->offset))
+
+static size_t size_of(const order_node_t *node) {
+    return node ? node->size : 0;
+}
+
+static void update(order_node_t *node) {
+    node->size = 1 + size_of(node->left) + size_of(node->right);
+}
+
+static uint32_t next_priority(order_t *order) {
+    // xorshift32: priorities only need to look random, not be unpredictable.
+    uint32_t x = order->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return order->seed = x;
+}
+
+static void replace_child(order_t *order, order_node_t *parent, order_node_t *old, order_node_t *node) {
+    if(!parent) {
+        order->root = node;
+    } else if(parent->left == old) {
+        parent->left = node;
+    } else {
+        parent->right = node;
+    }
+    if(node) node->parent = parent;
+}
+
+// Moves [node] one level up, above its parent. The size of the subtree doesn't change.
+static void rotate_up(order_t *order, order_node_t *node) {
+    order_node_t *parent = node->parent;
+    order_node_t *grandparent = parent->parent;
+    
+    if(parent->left == node) {
+        parent->left = node->right;
+        if(parent->left) parent->left->parent = parent;
+        node->right = parent;
+    } else {
+        parent->right = node->left;
+        if(parent->right) parent->right->parent = parent;
+        node->left = parent;
+    }
+    parent->parent = node;
+    replace_child(order, grandparent, parent, node);
+    update(parent);
+    update(node);
+}
+
+void order_create(order_t *order, size_t offset) {
+    ASSERT(order);
+    order->root = NULL;
+    order->offset = offset;
+    order->seed = 0x9e3779b9u;
+}
+
+size_t order_count(const order_t *order) {
+    ASSERT(order);
+    return size_of(order->root);
+}
+
+void order_build(order_t *order, list_t *list) {
+    ASSERT(order);
+    ASSERT(list);
+    ASSERT(!order->root);
+    
+    // The classic stack construction of a Cartesian tree: the stack holds the right spine of the
+    // tree built so far. A node is popped once something with a higher priority comes after it,
+    // and its subtree can't change after that, so that's when it gets its size.
+    order_node_t **spine = NULL;
+    size_t depth = 0, cap = 0;
+    
+    for(void *obj = list_head(list); obj; obj = list_next(list, obj)) {
+        order_node_t *node = NODE(order, obj);
+        memset(node, 0, sizeof(*node));
+        node->priority = next_priority(order);
+        
+        order_node_t *last = NULL;
+        while(depth && spine[depth-1]->priority < node->priority) {
+            last = spine[--depth];
+            update(last);
+        }
+        node->left = last;
+        if(last) last->parent = node;
+        if(depth) {
+            spine[depth-1]->right = node;
+            node->parent = spine[depth-1];
+        }
+        
+        if(depth == cap) {
+            cap = cap ? cap * 2 : 64;
+            spine = safe_realloc(spine, cap * sizeof(*spine));
+        }
+        spine[depth++] = node;
+    }
+    
+    while(depth) update(spine[--depth]);
+    order->root = cap ? spine[0] : NULL;
+    free(spine);
+}
+
+void *order_nth(const order_t *order, size_t pos) {
+    ASSERT(order);
+    order_node_t *node = order->root;
+    while(node) {
+        size_t left = size_of(node->left);
+        if(pos == left) return OBJ(order, node);
+        if(pos < left) {
+            node = node->left;
+        } else {
+            pos -= left + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+size_t order_position(const order_t *order, const void *obj) {
+    ASSERT(order);
+    ASSERT(obj);
+    const order_node_t *node = NODE(order, obj);
+    size_t pos = size_of(node->left);
+    for(; node->parent; node = node->parent) {
+        if(node->parent->right == node) pos += size_of(node->parent->left) + 1;
+    }
+    return pos;
+}
+
+void order_insert_at(order_t *order, void *obj, size_t pos) {
+    ASSERT(order);
+    ASSERT(obj);
+    ASSERT(pos <= order_count(order));
+    
+    order_node_t *node = NODE(order, obj);
+    memset(node, 0, sizeof(*node));
+    node->size = 1;
+    node->priority = next_priority(order);
+    
+    if(!order->root) {
+        order->root = node;
+        return;
+    }
+    
+    // Walk down to the leaf where the node belongs, counting it in every subtree on the way, then
+    // rotate it back up until priorities are in heap order again.
+    order_node_t *parent = order->root;
+    for(;;) {
+        parent->size += 1;
+        size_t left = size_of(parent->left);
+        if(pos <= left) {
+            if(!parent->left) {
+                parent->left = node;
+                break;
+            }
+            parent = parent->left;
+        } else {
+            pos -= left + 1;
+            if(!parent->right) {
+                parent->right = node;
+                break;
+            }
+            parent = parent->right;
+        }
+    }
+    node->parent = parent;
+    
+    while(node->parent && node->parent->priority < node->priority) rotate_up(order, node);
+}
+
+void order_remove(order_t *order, void *obj) {
+    ASSERT(order);
+    ASSERT(obj);
+    
+    // Rotate the node down until it has at most one child, then splice it out.
+    order_node_t *node = NODE(order, obj);
+    while(node->left && node->right) {
+        rotate_up(order, node->left->priority > node->right->priority ? node->left : node->right);
+    }
+    
+    order_node_t *parent = node->parent;
+    replace_child(order, parent, node, node->left ? node->left : node->right);
+    for(; parent; parent = parent->parent) parent->size -= 1;
+    memset(node, 0, sizeof(*node));
+}
@@ -0,0 +1,55 @@
+/*===--------------------------------------------------------------------------------------------===
+ * order.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_ORDER_H_
+#define _TQ_ORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utils/list.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct order_node_t {
+    struct order_node_t *left;
+    struct order_node_t *right;
+    struct order_node_t *parent;
+    size_t              size;       // nodes in this subtree, including this one
+    uint32_t            priority;
+} order_node_t;
+
+// An intrusive sequence that can find the object at a given position, and the position of a given
+// object, in O(log n). It's a treap keyed by position: nodes are ordered in-order, priorities are
+// random and kept in heap order, and each node counts the nodes under it. Like list_t, it's used
+// through the objects that embed its nodes.
+typedef struct order_t {
+    order_node_t    *root;
+    size_t          offset;     // of the order_node_t in the objects
+    uint32_t        seed;
+} order_t;
+
+void order_create(order_t *order, size_t offset);
+size_t order_count(const order_t *order);
+
+// Fills an empty order with the objects of [list], in the same order, in O(n).
+void order_build(order_t *order, list_t *list);
+
+void *order_nth(const order_t *order, size_t pos);
+size_t order_position(const order_t *order, const void *obj);
+
+void order_insert_at(order_t *order, void *obj, size_t pos);
+void order_remove(order_t *order, void *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_ORDER_H_ */
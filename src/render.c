@@ -0,0 +1,179 @@
+/*===--------------------------------------------------------------------------------------------===
+ * render.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "render.h"
+#include "trace.h"
+#include <utils/helpers.h>
+#include <utils/assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STYLE_BOLD "\033[1m"
+#define STYLE_YELLOW "\033[93m"
+#define STYLE_GREEN "\033[92m"
+#define STYLE_RESET "\033[0m"
+
+static int stdout_tty = -1;
+
+void render_set_stdout_tty(int tty) {
+    stdout_tty = tty;
+}
+
+void render_init(render_t *r, FILE *out) {
+    ASSERT(r);
+    ASSERT(out);
+    fflush(out);
+    r->fd = fileno(out);
+    r->styled = r->fd == STDOUT_FILENO && stdout_tty >= 0 ? stdout_tty : isatty(r->fd);
+    r->failed = false;
+    r->used = 0;
+    r->capacity = RENDER_BUFFER_SIZE;
+    r->buffer = safe_malloc(r->capacity);
+}
+
+void render_init_memory(render_t *r, bool styled) {
+    ASSERT(r);
+    r->fd = -1;
+    r->styled = styled;
+    r->failed = false;
+    r->used = 0;
+    r->capacity = 1024;
+    r->buffer = safe_malloc(r->capacity);
+}
+
+static void write_out(render_t *r, const char *data, size_t size) {
+    trace_phase_t phase = trace_enter(TRACE_OUTPUT);
+    while(size && !r->failed) {
+        ssize_t written = write(r->fd, data, size);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) {
+            r->failed = true;
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+    trace_enter(phase);
+}
+
+bool render_flush(render_t *r) {
+    ASSERT(r);
+    if(r->fd < 0) return true;
+    write_out(r, r->buffer, r->used);
+    r->used = 0;
+    return !r->failed;
+}
+
+bool render_fini(render_t *r) {
+    ASSERT(r);
+    bool ok = render_flush(r);
+    free(r->buffer);
+    r->buffer = NULL;
+    return ok;
+}
+
+void render_text(render_t *r, const char *text, size_t len) {
+    if(r->used + len > r->capacity && r->fd < 0) {
+        while(r->used + len > r->capacity) r->capacity *= 2;
+        r->buffer = safe_realloc(r->buffer, r->capacity);
+    } else if(r->used + len > r->capacity) {
+        render_flush(r);
+        // Whatever wouldn't fit in an empty buffer doesn't need to go through it.
+        if(len > RENDER_BUFFER_SIZE) {
+            write_out(r, text, len);
+            return;
+        }
+    }
+    memcpy(r->buffer + r->used, text, len);
+    r->used += len;
+}
+
+#define TEXT(r, str) render_text((r), (str), sizeof(str) - 1)
+#define STYLE(r, str) do { if((r)->styled) TEXT((r), str); } while(0)
+
+int render_width(size_t value) {
+    int width = 1;
+    while(value >= 10) {
+        value /= 10;
+        width += 1;
+    }
+    return width;
+}
+
+void render_number(render_t *r, size_t value, int width) {
+    char digits[32];
+    int len = 0;
+    do {
+        digits[sizeof(digits) - 1 - len++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    
+    while(width-- > len) TEXT(r, " ");
+    render_text(r, digits + sizeof(digits) - len, len);
+}
+
+void render_header(render_t *r, const char *title) {
+    ASSERT(title);
+    STYLE(r, STYLE_BOLD);
+    render_text(r, title, strlen(title));
+    TEXT(r, ":\n");
+    STYLE(r, STYLE_RESET);
+}
+
+static void render_task_text(render_t *r, const tq_task_t *task) {
+    ASSERT(task);
+    size_t id_len = strlen(task->id);
+    
+    TEXT(r, "[");
+    STYLE(r, STYLE_YELLOW);
+    render_text(r, task->id, id_len);
+    for(size_t i = id_len; i < TQ_ID_LEN; ++i) TEXT(r, " ");
+    STYLE(r, STYLE_RESET);
+    TEXT(r, "] ");
+    render_text(r, task->desc, task->desc_len);
+    
+    if(task->done) {
+        TEXT(r, " [");
+        STYLE(r, STYLE_GREEN);
+        TEXT(r, "✔");
+        STYLE(r, STYLE_RESET);
+        TEXT(r, "]");
+    }
+}
+
+void render_task(render_t *r, const tq_task_t *task) {
+    render_task_text(r, task);
+    TEXT(r, "\n");
+}
+
+// Writes how long [seconds] is in its largest unit, rounded up: a claim with any time left shows
+// some.
+static void render_duration(render_t *r, int64_t seconds) {
+    static const struct {
+        int64_t     size;
+        const char  *unit;
+    } units[] = {{86400, "d"}, {3600, "h"}, {60, "m"}, {1, "s"}};
+    size_t i = 0;
+    while(i < 3 && seconds < units[i].size) ++i;
+    render_number(r, (size_t)((seconds + units[i].size - 1) / units[i].size), 0);
+    render_text(r, units[i].unit, 1);
+}
+
+void render_claimed_task(render_t *r, const tq_task_t *task, const tq_claim_t *claim, int64_t now) {
+    ASSERT(claim);
+    render_task_text(r, task);
+    TEXT(r, " [claimed by ");
+    STYLE(r, STYLE_BOLD);
+    render_text(r, claim->holder, strlen(claim->holder));
+    STYLE(r, STYLE_RESET);
+    TEXT(r, ", ");
+    render_duration(r, claim->expiry > now ? claim->expiry - now : 0);
+    TEXT(r, " left]\n");
+}
@@ -0,0 +1,67 @@
+/*===--------------------------------------------------------------------------------------------===
+ * render.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_RENDER_H_
+#define _TQ_RENDER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "tq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RENDER_BUFFER_SIZE (64 * 1024)
+
+// Formats output into a large buffer that is written out with as few write() calls as possible,
+// rather than going through stdio for every field. Styling is only emitted when the output is a
+// terminal.
+typedef struct render_t {
+    int         fd;         // -1 when rendering to memory
+    bool        styled;
+    bool        failed;     // a write failed, everything after it is dropped
+    size_t      used;
+    size_t      capacity;
+    char        *buffer;
+} render_t;
+
+// Sets whether standard output is to be taken for a terminal, for a server whose standard output
+// is spooled for a client: 1 or 0 for what the client's is, -1 to ask isatty() again.
+void render_set_stdout_tty(int tty);
+
+// Starts rendering to [out]. Anything already buffered in [out] is flushed first, and nothing
+// should be written to [out] through stdio until render_fini().
+void render_init(render_t *r, FILE *out);
+// Starts rendering to memory: the buffer grows to hold everything, and nothing is written out.
+// The output is in [r->buffer], [r->used] bytes of it, until render_fini().
+void render_init_memory(render_t *r, bool styled);
+// Flushes what's left, and returns whether everything was written.
+bool render_fini(render_t *r);
+bool render_flush(render_t *r);
+
+void render_text(render_t *r, const char *text, size_t len);
+// Writes [value], right-aligned in a field of [width] characters.
+void render_number(render_t *r, size_t value, int width);
+void render_header(render_t *r, const char *title);
+// Writes a whole task line, newline included.
+void render_task(render_t *r, const tq_task_t *task);
+// Writes the line of a pending task that [claim] is on, with who holds it and for how much longer
+// than [now], in seconds since the epoch.
+void render_claimed_task(render_t *r, const tq_task_t *task, const tq_claim_t *claim, int64_t now);
+
+// How many characters [value] takes.
+int render_width(size_t value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_RENDER_H_ */
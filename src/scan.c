@@ -0,0 +1,173 @@
+/*===--------------------------------------------------------------------------------------------===
+ * scan.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "scan.h"
+#include <utils/assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef const char *(*line_fn_t)(const char *, const char *, const char **, int, int *);
+typedef size_t (*count_fn_t)(const char *, const char *, char);
+
+// The scalar versions lean on memchr(), which the C library vectorises in its own way. They also
+// finish off whatever is left at the end of the buffer for the vector versions, which never read
+// past [end].
+static const char *line_scalar(const char *cur, const char *end, const char **seps, int max, int *n) {
+    const char *eol = memchr(cur, '\n', end - cur);
+    if(!eol) eol = end;
+    while(*n < max && cur < eol && (cur = memchr(cur, ':', eol - cur))) {
+        seps[(*n)++] = cur++;
+    }
+    return eol;
+}
+
+static size_t count_scalar(const char *cur, const char *end, char c) {
+    size_t count = 0;
+    while(cur < end && (cur = memchr(cur, c, end - cur))) {
+        ++count;
+        ++cur;
+    }
+    return count;
+}
+
+#ifdef SCAN_X86
+
+// Both vector versions work the same way: compare a whole block against '\n' and ':' at once, and
+// turn the results into bit masks. Separators past the first newline of the block are masked off,
+// and once we have all the separators we were asked for, only newlines are looked for.
+
+__attribute__((target("sse2")))
+static const char *line_sse2(const char *cur, const char *end, const char **seps, int max, int *n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    
+    for(; end - cur >= 16; cur += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cur);
+        uint32_t lines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+        uint32_t colons = *n < max ? _mm_movemask_epi8(_mm_cmpeq_epi8(block, colon)) : 0;
+        if(lines) colons &= (lines & -lines) - 1;
+        
+        for(; colons && *n < max; colons &= colons - 1) seps[(*n)++] = cur + __builtin_ctz(colons);
+        if(lines) return cur + __builtin_ctz(lines);
+    }
+    return line_scalar(cur, end, seps, max, n);
+}
+
+__attribute__((target("sse2,popcnt")))
+static size_t count_sse2(const char *cur, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t count = 0;
+    for(; end - cur >= 16; cur += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cur);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    }
+    return count + count_scalar(cur, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char *line_avx2(const char *cur, const char *end, const char **seps, int max, int *n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i colon = _mm256_set1_epi8(':');
+    
+    for(; end - cur >= 32; cur += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cur);
+        uint32_t lines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+        uint32_t colons = *n < max ? _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, colon)) : 0;
+        if(lines) colons &= (lines & -lines) - 1;
+        
+        for(; colons && *n < max; colons &= colons - 1) seps[(*n)++] = cur + __builtin_ctz(colons);
+        if(lines) return cur + __builtin_ctz(lines);
+    }
+    return line_sse2(cur, end, seps, max, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const char *cur, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t count = 0;
+    for(; end - cur >= 32; cur += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cur);
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    }
+    return count + count_scalar(cur, end, c);
+}
+
+#endif /* SCAN_X86 */
+
+static scan_impl_t current = SCAN_SCALAR;
+static line_fn_t line_impl = NULL;
+static count_fn_t count_impl = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static bool supported(scan_impl_t impl) {
+    switch(impl) {
+    case SCAN_SCALAR: return true;
+#ifdef SCAN_X86
+    case SCAN_SSE2: return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+    case SCAN_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#else
+    default: return false;
+#endif
+    }
+    return false;
+}
+
+bool scan_select(scan_impl_t impl) {
+    if(!supported(impl)) return false;
+    current = impl;
+    switch(impl) {
+#ifdef SCAN_X86
+    case SCAN_AVX2: line_impl = line_avx2; count_impl = count_avx2; break;
+    case SCAN_SSE2: line_impl = line_sse2; count_impl = count_sse2; break;
+#endif
+    default: line_impl = line_scalar; count_impl = count_scalar; break;
+    }
+    return true;
+}
+
+// Queue lines are short (a few dozen bytes), and most of them fit in a handful of 16 byte blocks:
+// with 32 byte blocks, more time goes into loads that cross the end of the line than is saved, and
+// the AVX2 version measures slower than the SSE2 one. It stays available for scan_select().
+static void select_default(void) {
+    if(!line_impl && !scan_select(SCAN_SSE2)) scan_select(SCAN_SCALAR);
+}
+
+scan_impl_t scan_impl(void) {
+    pthread_once(&default_once, select_default);
+    return current;
+}
+
+const char *scan_impl_name(scan_impl_t impl) {
+    switch(impl) {
+    case SCAN_SCALAR: return "scalar";
+    case SCAN_SSE2: return "sse2";
+    case SCAN_AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+const char *scan_line(const char *cur, const char *end, const char **seps, int max, int *num_seps) {
+    ASSERT(cur <= end);
+    ASSERT(num_seps);
+    if(!line_impl) scan_impl();
+    *num_seps = 0;
+    return line_impl(cur, end, seps, max, num_seps);
+}
+
+size_t scan_count(const char *cur, const char *end, char c) {
+    ASSERT(cur <= end);
+    if(!count_impl) scan_impl();
+    return count_impl(cur, end, c);
+}
@@ -0,0 +1,45 @@
+/*===--------------------------------------------------------------------------------------------===
+ * scan.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_SCAN_H_
+#define _TQ_SCAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum scan_impl_t {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+} scan_impl_t;
+
+// Finds the end of the line that starts at [cur] (its '\n', or [end]), and the first [max] ':'
+// separators in it, in a single pass over the line. Separators are stored in [seps], and how
+// many were found in [*num_seps].
+const char *scan_line(const char *cur, const char *end, const char **seps, int max, int *num_seps);
+
+// Counts the occurrences of [c] in [cur, end).
+size_t scan_count(const char *cur, const char *end, char c);
+
+// The fastest implementation the CPU supports is picked on first use, or by the first call to
+// scan_impl(), which is safe from any thread. These let benchmarks compare them: scan_select()
+// fails if the CPU doesn't support [impl].
+scan_impl_t scan_impl(void);
+bool scan_select(scan_impl_t impl);
+const char *scan_impl_name(scan_impl_t impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_SCAN_H_ */
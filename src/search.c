@@ -0,0 +1,457 @@
+/*===--------------------------------------------------------------------------------------------===
+ * search.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "search.h"
+#include <utils/assert.h>
+#include <utils/helpers.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(sizeof(search_header_t) % 8 == 0, "search header must keep sections aligned");
+_Static_assert(sizeof(search_term_t) % 8 == 0, "search terms must stay aligned");
+
+#define TABLE_MIN_CAPACITY (1024)
+
+static uint64_t align8(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+static bool is_word_char(char c) {
+    unsigned char u = (unsigned char)c;
+    return u >= 0x80 || (u >= '0' && u <= '9') || (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z');
+}
+
+static char lower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Writes the term for [word] to [key], and returns its length.
+static size_t make_key(const char *word, size_t len, char *key) {
+    if(len > SEARCH_MAX_TERM) len = SEARCH_MAX_TERM;
+    for(size_t i = 0; i < len; ++i) key[i] = lower(word[i]);
+    return len;
+}
+
+bool search_next_word(const char **cur, const char *end, const char **word, size_t *len) {
+    const char *c = *cur;
+    while(c < end && !is_word_char(*c)) ++c;
+    if(c == end) {
+        *cur = end;
+        return false;
+    }
+    *word = c;
+    while(c < end && is_word_char(*c)) ++c;
+    *len = c - *word;
+    *cur = c;
+    return true;
+}
+
+size_t search_parse(const char *query, search_word_t **words) {
+    ASSERT(query);
+    ASSERT(words);
+    
+    const char *end = query + strlen(query);
+    size_t cap = 8, count = 0;
+    *words = safe_malloc(cap * sizeof(**words));
+    
+    const char *cur = query, *word;
+    size_t len;
+    while(search_next_word(&cur, end, &word, &len)) {
+        if(count == cap) {
+            cap *= 2;
+            *words = safe_realloc(*words, cap * sizeof(**words));
+        }
+        // Only a star right after the word makes it a prefix: "foo*" does, "foo *" doesn't.
+        (*words)[count++] = (search_word_t){.text = word, .len = len, .prefix = cur < end && *cur == '*'};
+    }
+    return count;
+}
+
+static bool word_is(const char *word, size_t len, const search_word_t *w) {
+    if(w->prefix ? len < w->len : len != w->len) return false;
+    for(size_t i = 0; i < w->len; ++i) {
+        if(lower(word[i]) != lower(w->text[i])) return false;
+    }
+    return true;
+}
+
+bool search_matches(const char *desc, size_t len, const search_word_t *words, size_t num_words) {
+    for(size_t i = 0; i < num_words; ++i) {
+        const char *cur = desc, *end = desc + len, *word;
+        size_t word_len;
+        bool found = false;
+        while(!found && search_next_word(&cur, end, &word, &word_len)) {
+            found = word_is(word, word_len, &words[i]);
+        }
+        if(!found) return false;
+    }
+    return true;
+}
+
+/*
+ * Building: each document's terms are numbered as they are first seen, and stored as a stream of
+ * term numbers. Writing then counts how many documents each term appears in to lay its postings
+ * out, and fills them in document order, so that every posting list comes out sorted.
+ */
+
+void search_builder_init(search_builder_t *b) {
+    ASSERT(b);
+    memset(b, 0, sizeof(*b));
+}
+
+void search_builder_fini(search_builder_t *b) {
+    ASSERT(b);
+    free(b->docs);
+    free(b->tokens);
+    free(b->doc_tokens);
+    free(b->terms);
+    free(b->table);
+    free(b->strings);
+    memset(b, 0, sizeof(*b));
+}
+
+static size_t key_hash(const char *key, size_t len) {
+    // FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < len; ++i) hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ull;
+    return (size_t)(hash ^ (hash >> 32));
+}
+
+static void table_grow(search_builder_t *b) {
+    size_t capacity = b->table_cap ? b->table_cap * 2 : TABLE_MIN_CAPACITY;
+    uint32_t *table = safe_calloc(capacity, sizeof(*table));
+    for(size_t i = 0; i < b->num_terms; ++i) {
+        const search_term_t *term = &b->terms[i];
+        size_t slot = key_hash(b->strings + term->text_offset, term->len) & (capacity - 1);
+        while(table[slot]) slot = (slot + 1) & (capacity - 1);
+        table[slot] = i + 1;
+    }
+    free(b->table);
+    b->table = table;
+    b->table_cap = capacity;
+}
+
+static uint32_t intern(search_builder_t *b, const char *key, size_t len) {
+    if((b->num_terms + 1) * 4 > b->table_cap * 3) table_grow(b);
+    
+    size_t mask = b->table_cap - 1;
+    size_t slot = key_hash(key, len) & mask;
+    for(; b->table[slot]; slot = (slot + 1) & mask) {
+        const search_term_t *term = &b->terms[b->table[slot] - 1];
+        if(term->len == len && !memcmp(b->strings + term->text_offset, key, len)) {
+            return b->table[slot] - 1;
+        }
+    }
+    
+    if(b->num_terms == b->terms_cap) {
+        b->terms_cap = b->terms_cap ? b->terms_cap * 2 : 1024;
+        b->terms = safe_realloc(b->terms, b->terms_cap * sizeof(*b->terms));
+    }
+    if(b->strings_size + len > b->strings_cap) {
+        b->strings_cap = b->strings_cap ? b->strings_cap * 2 : 16 * 1024;
+        b->strings = safe_realloc(b->strings, b->strings_cap);
+    }
+    memcpy(b->strings + b->strings_size, key, len);
+    b->terms[b->num_terms] = (search_term_t){.text_offset = b->strings_size, .len = len};
+    b->strings_size += len;
+    b->table[slot] = b->num_terms + 1;
+    return b->num_terms++;
+}
+
+void search_add(search_builder_t *b, uint64_t location, const char *desc, size_t len) {
+    ASSERT(b);
+    ASSERT(!b->num_docs || location > b->docs[b->num_docs - 1]);
+    
+    if(b->num_docs == b->docs_cap) {
+        b->docs_cap = b->docs_cap ? b->docs_cap * 2 : 1024;
+        b->docs = safe_realloc(b->docs, b->docs_cap * sizeof(*b->docs));
+        b->doc_tokens = safe_realloc(b->doc_tokens, (b->docs_cap + 1) * sizeof(*b->doc_tokens));
+    }
+    b->docs[b->num_docs] = location;
+    b->doc_tokens[b->num_docs] = b->num_tokens;
+    
+    const char *cur = desc, *end = desc + len, *word;
+    size_t word_len;
+    char key[SEARCH_MAX_TERM];
+    while(search_next_word(&cur, end, &word, &word_len)) {
+        if(b->num_tokens == b->tokens_cap) {
+            b->tokens_cap = b->tokens_cap ? b->tokens_cap * 2 : 4096;
+            b->tokens = safe_realloc(b->tokens, b->tokens_cap * sizeof(*b->tokens));
+        }
+        size_t key_len = make_key(word, word_len, key);
+        b->tokens[b->num_tokens++] = intern(b, key, key_len);
+    }
+    b->num_docs += 1;
+    b->doc_tokens[b->num_docs] = b->num_tokens;
+}
+
+static int key_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if(r) return r;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+typedef struct {
+    const char  *text;
+    uint32_t    len;
+    uint32_t    term;
+} sort_entry_t;
+
+static int entry_cmp(const void *a, const void *b) {
+    const sort_entry_t *ea = a, *eb = b;
+    return key_cmp(ea->text, ea->len, eb->text, eb->len);
+}
+
+static bool write_padding(FILE *out, uint64_t *offset) {
+    static const char zeros[8] = {0};
+    uint64_t aligned = align8(*offset);
+    size_t count = aligned - *offset;
+    *offset = aligned;
+    return fwrite(zeros, 1, count, out) == count;
+}
+
+bool search_write(const search_builder_t *b, uint64_t snapshot_id, uint64_t snapshot_size, FILE *out) {
+    ASSERT(b);
+    ASSERT(out);
+    
+    size_t num_terms = b->num_terms;
+    sort_entry_t *sorted = safe_calloc(num_terms ? num_terms : 1, sizeof(*sorted));
+    search_term_t *terms = safe_calloc(num_terms ? num_terms : 1, sizeof(*terms));
+    uint32_t *rank = safe_calloc(num_terms ? num_terms : 1, sizeof(*rank));
+    uint32_t *last_doc = safe_calloc(num_terms ? num_terms : 1, sizeof(*last_doc));
+    
+    for(size_t i = 0; i < num_terms; ++i) {
+        const search_term_t *term = &b->terms[i];
+        sorted[i] = (sort_entry_t){.text = b->strings + term->text_offset, .len = term->len, .term = i};
+    }
+    qsort(sorted, num_terms, sizeof(*sorted), entry_cmp);
+    
+    // Terms are written in sorted order, with their strings in the same order.
+    uint64_t text_offset = 0;
+    for(size_t i = 0; i < num_terms; ++i) {
+        rank[sorted[i].term] = i;
+        terms[i].text_offset = text_offset;
+        terms[i].len = sorted[i].len;
+        text_offset += sorted[i].len;
+    }
+    
+    // A term that appears several times in a document only gets one posting.
+    for(size_t i = 0; i < num_terms; ++i) last_doc[i] = UINT32_MAX;
+    for(size_t d = 0; d < b->num_docs; ++d) {
+        for(size_t t = b->doc_tokens[d]; t < b->doc_tokens[d + 1]; ++t) {
+            uint32_t r = rank[b->tokens[t]];
+            if(last_doc[r] == d) continue;
+            last_doc[r] = d;
+            terms[r].count += 1;
+        }
+    }
+    
+    uint64_t num_postings = 0;
+    for(size_t i = 0; i < num_terms; ++i) {
+        terms[i].postings = num_postings;
+        num_postings += terms[i].count;
+    }
+    uint32_t *postings = safe_calloc(num_postings ? num_postings : 1, sizeof(*postings));
+    uint64_t *fill = safe_calloc(num_terms ? num_terms : 1, sizeof(*fill));
+    for(size_t i = 0; i < num_terms; ++i) {
+        fill[i] = terms[i].postings;
+        last_doc[i] = UINT32_MAX;
+    }
+    for(size_t d = 0; d < b->num_docs; ++d) {
+        for(size_t t = b->doc_tokens[d]; t < b->doc_tokens[d + 1]; ++t) {
+            uint32_t r = rank[b->tokens[t]];
+            if(last_doc[r] == d) continue;
+            last_doc[r] = d;
+            postings[fill[r]++] = d;
+        }
+    }
+    
+    search_header_t header = {
+        .magic = TQ_SEARCH_MAGIC,
+        .version = TQ_SEARCH_VERSION,
+        .snapshot_id = snapshot_id,
+        .snapshot_size = snapshot_size,
+        .num_docs = b->num_docs,
+        .num_terms = num_terms,
+    };
+    header.docs_offset = sizeof(header);
+    header.terms_offset = header.docs_offset + b->num_docs * sizeof(uint64_t);
+    header.postings_offset = header.terms_offset + num_terms * sizeof(search_term_t);
+    header.strings_offset = align8(header.postings_offset + num_postings * sizeof(uint32_t));
+    header.strings_size = text_offset;
+    
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(b->docs, sizeof(*b->docs), b->num_docs, out) == b->num_docs;
+    ok = ok && fwrite(terms, sizeof(*terms), num_terms, out) == num_terms;
+    ok = ok && fwrite(postings, sizeof(*postings), num_postings, out) == num_postings;
+    uint64_t offset = header.postings_offset + num_postings * sizeof(uint32_t);
+    ok = ok && write_padding(out, &offset);
+    for(size_t i = 0; ok && i < num_terms; ++i) {
+        ok = fwrite(sorted[i].text, 1, sorted[i].len, out) == sorted[i].len;
+    }
+    
+    free(fill);
+    free(postings);
+    free(last_doc);
+    free(rank);
+    free(terms);
+    free(sorted);
+    return ok;
+}
+
+const search_header_t *search_header(const char *data, size_t size) {
+    if(!data || size < sizeof(search_header_t) || memcmp(data, TQ_SEARCH_MAGIC, 4)) return NULL;
+    const search_header_t *header = (const search_header_t *)data;
+    if(header->version != TQ_SEARCH_VERSION) return NULL;
+    
+    if(header->docs_offset % 8 || header->terms_offset % 8 || header->postings_offset % 4) return NULL;
+    if(header->docs_offset > size || header->num_docs > (size - header->docs_offset) / sizeof(uint64_t)) return NULL;
+    if(header->terms_offset > size || header->num_terms > (size - header->terms_offset) / sizeof(search_term_t)) return NULL;
+    if(header->strings_offset > size || header->strings_size > size - header->strings_offset) return NULL;
+    if(header->postings_offset > header->strings_offset) return NULL;
+    return header;
+}
+
+// Terms are only checked when a lookup reaches them, so that a query doesn't touch the whole index.
+static bool term_valid(const search_header_t *header, const search_term_t *term) {
+    uint64_t max_postings = (header->strings_offset - header->postings_offset) / sizeof(uint32_t);
+    return term->text_offset <= header->strings_size
+        && term->len <= header->strings_size - term->text_offset
+        && term->postings <= max_postings && term->count <= max_postings - term->postings;
+}
+
+// A set of documents, either straight from the index, or merged into an array of our own.
+typedef struct {
+    const uint32_t *docs;
+    size_t      count;
+    uint32_t    *owned;
+} doc_set_t;
+
+static int doc_cmp(const void *a, const void *b) {
+    uint32_t da = *(const uint32_t *)a, db = *(const uint32_t *)b;
+    return da < db ? -1 : da > db;
+}
+
+static int set_cmp(const void *a, const void *b) {
+    size_t ca = ((const doc_set_t *)a)->count, cb = ((const doc_set_t *)b)->count;
+    return ca < cb ? -1 : ca > cb;
+}
+
+static bool find_word(const char *data, const search_word_t *word, doc_set_t *set) {
+    const search_header_t *header = (const search_header_t *)data;
+    const search_term_t *terms = (const search_term_t *)(data + header->terms_offset);
+    const uint32_t *postings = (const uint32_t *)(data + header->postings_offset);
+    const char *strings = data + header->strings_offset;
+    
+    char key[SEARCH_MAX_TERM];
+    size_t key_len = make_key(word->text, word->len, key);
+    // Terms are cut short in the index, so long words are looked up by their first bytes. The same
+    // goes for a prefix: every term that starts with it sorts right at or after it.
+    bool prefix = word->prefix || word->len > SEARCH_MAX_TERM;
+    
+    *set = (doc_set_t){.docs = NULL, .count = 0, .owned = NULL};
+    size_t lo = 0, hi = header->num_terms;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(!term_valid(header, &terms[mid])) return false;
+        if(key_cmp(strings + terms[mid].text_offset, terms[mid].len, key, key_len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    size_t first = lo, last = lo;
+    while(last < header->num_terms) {
+        const search_term_t *term = &terms[last];
+        if(!term_valid(header, term)) return false;
+        if(term->len < key_len || memcmp(strings + term->text_offset, key, key_len)) break;
+        if(!prefix && term->len != key_len) break;
+        last += 1;
+    }
+    
+    if(last == first + 1) {
+        set->docs = postings + terms[first].postings;
+        set->count = terms[first].count;
+        return true;
+    }
+    
+    size_t count = 0;
+    for(size_t i = first; i < last; ++i) count += terms[i].count;
+    if(!count) return true;
+    set->owned = safe_malloc(count * sizeof(*set->owned));
+    for(size_t i = first, n = 0; i < last; n += terms[i].count, ++i) {
+        memcpy(set->owned + n, postings + terms[i].postings, terms[i].count * sizeof(uint32_t));
+    }
+    qsort(set->owned, count, sizeof(*set->owned), doc_cmp);
+    size_t unique = 0;
+    for(size_t i = 0; i < count; ++i) {
+        if(!unique || set->owned[unique - 1] != set->owned[i]) set->owned[unique++] = set->owned[i];
+    }
+    set->docs = set->owned;
+    set->count = unique;
+    return true;
+}
+
+// Returns the first position in [docs, docs+count) that is >= [doc], starting from [from].
+static size_t seek(const uint32_t *docs, size_t count, size_t from, uint32_t doc) {
+    // Gallop first: when intersecting a short list with a long one, matches are far apart.
+    size_t step = 1, lo = from, hi = from;
+    while(hi < count && docs[hi] < doc) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if(hi > count) hi = count;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(docs[mid] < doc) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+uint64_t *search_lookup(const char *data, const search_word_t *words, size_t num_words, size_t *count) {
+    ASSERT(data);
+    ASSERT(count);
+    
+    const search_header_t *header = (const search_header_t *)data;
+    const uint64_t *docs = (const uint64_t *)(data + header->docs_offset);
+    
+    doc_set_t *sets = safe_calloc(num_words ? num_words : 1, sizeof(*sets));
+    bool ok = true;
+    for(size_t i = 0; ok && i < num_words; ++i) ok = find_word(data, &words[i], &sets[i]);
+    if(!ok) {
+        for(size_t i = 0; i < num_words; ++i) free(sets[i].owned);
+        free(sets);
+        return NULL;
+    }
+    qsort(sets, num_words, sizeof(*sets), set_cmp);
+    
+    // Start from the rarest word, and only keep the documents every other word has.
+    size_t n = num_words ? sets[0].count : 0;
+    uint32_t *matches = safe_malloc((n ? n : 1) * sizeof(*matches));
+    if(n) memcpy(matches, sets[0].docs, n * sizeof(*matches));
+    for(size_t i = 1; i < num_words && n; ++i) {
+        size_t kept = 0, pos = 0;
+        for(size_t j = 0; j < n && pos < sets[i].count; ++j) {
+            pos = seek(sets[i].docs, sets[i].count, pos, matches[j]);
+            if(pos < sets[i].count && sets[i].docs[pos] == matches[j]) matches[kept++] = matches[j];
+        }
+        n = kept;
+    }
+    
+    uint64_t *locations = safe_malloc((n ? n : 1) * sizeof(*locations));
+    *count = 0;
+    for(size_t i = 0; i < n; ++i) {
+        if(matches[i] < header->num_docs) locations[(*count)++] = docs[matches[i]];
+    }
+    
+    free(matches);
+    for(size_t i = 0; i < num_words; ++i) free(sets[i].owned);
+    free(sets);
+    return locations;
+}
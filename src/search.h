@@ -0,0 +1,116 @@
+/*===--------------------------------------------------------------------------------------------===
+ * search.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_SEARCH_H_
+#define _TQ_SEARCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Search index layout. Like binary queues, everything is in host byte order, and sections are
+ * 8-byte aligned:
+ *
+ *      header
+ *      documents       where each task is in the snapshot (uint64_t), in snapshot order
+ *      terms           fixed-size records, sorted by term
+ *      postings        for each term, the documents (uint32_t) it appears in, in ascending order
+ *      strings         the terms, not NUL-terminated
+ *
+ * A term is a run of letters, digits and non-ASCII bytes, lowercased and cut to SEARCH_MAX_TERM
+ * bytes. The index only tells which tasks may match: callers check the task itself.
+ */
+
+#define TQ_SEARCH_MAGIC "TQS\x7f"
+#define TQ_SEARCH_VERSION (1)
+#define SEARCH_MAX_TERM (32)
+
+typedef struct search_header_t {
+    char        magic[4];
+    uint32_t    version;
+    uint64_t    snapshot_id;    // the snapshot the index was built from, like the journal's base
+    uint64_t    snapshot_size;
+    uint64_t    num_docs;
+    uint64_t    num_terms;
+    uint64_t    docs_offset;
+    uint64_t    terms_offset;
+    uint64_t    postings_offset;
+    uint64_t    strings_offset;
+    uint64_t    strings_size;
+} search_header_t;
+
+typedef struct search_term_t {
+    uint64_t    text_offset;        // from the start of the strings
+    uint64_t    postings;           // index of the first posting
+    uint32_t    len;
+    uint32_t    count;
+} search_term_t;
+
+// A word of a query. Prefix words match any term that starts with them.
+typedef struct search_word_t {
+    const char  *text;
+    size_t      len;
+    bool        prefix;
+} search_word_t;
+
+typedef struct search_builder_t {
+    uint64_t    *docs;
+    size_t      num_docs;
+    size_t      docs_cap;
+    
+    uint32_t    *tokens;        // term numbers, document after document
+    size_t      *doc_tokens;    // where each document's tokens start in [tokens]
+    size_t      num_tokens;
+    size_t      tokens_cap;
+    
+    search_term_t *terms;       // in the order they were first seen
+    size_t      num_terms;
+    size_t      terms_cap;
+    uint32_t    *table;         // open-addressed, term number + 1 (0 for an empty slot)
+    size_t      table_cap;
+    
+    char        *strings;
+    size_t      strings_size;
+    size_t      strings_cap;
+} search_builder_t;
+
+// Finds the next word of [*cur, end) and moves past it. Returns false once there are none left.
+bool search_next_word(const char **cur, const char *end, const char **word, size_t *len);
+
+// Splits a query into words. A word ending in '*' is a prefix. Returns the number of words, and
+// sets [*words] to an array the caller must free.
+size_t search_parse(const char *query, search_word_t **words);
+
+// Returns whether [desc] has every one of [words].
+bool search_matches(const char *desc, size_t len, const search_word_t *words, size_t num_words);
+
+void search_builder_init(search_builder_t *b);
+void search_builder_fini(search_builder_t *b);
+// Adds a document, found at [location] in the snapshot. Documents must be added in order.
+void search_add(search_builder_t *b, uint64_t location, const char *desc, size_t len);
+bool search_write(const search_builder_t *b, uint64_t snapshot_id, uint64_t snapshot_size, FILE *out);
+
+// Returns the header of a search index, or NULL if it isn't one or its sections don't fit.
+const search_header_t *search_header(const char *data, size_t size);
+
+// Returns the locations of the documents that may have every one of [words], in ascending order,
+// or NULL if the index is corrupted. The caller must free the array.
+uint64_t *search_lookup(const char *data, const search_word_t *words, size_t num_words, size_t *count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_SEARCH_H_ */
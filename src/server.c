@@ -0,0 +1,501 @@
+/*===--------------------------------------------------------------------------------------------===
+ * server.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "server.h"
+#include "cli.h"
+#include "render.h"
+#include "trace.h"
+#include <utils/assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SERVER_MAGIC (0x74717333u)
+#define SERVER_MAX_ARGS (1024)
+#define SERVER_MAX_ARGS_SIZE (1024 * 1024)
+
+// A client that takes longer than this to send its request is dropped.
+#define SERVER_REQUEST_TIMEOUT_S (5)
+
+// Changes are persisted once the server has been idle this long, or at the latest after
+// SERVER_MAX_DIRTY_MS when it never goes idle.
+#define SERVER_FLUSH_DELAY_MS (50)
+#define SERVER_MAX_DIRTY_MS (1000)
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    argc;
+    uint32_t    size;   // bytes of NUL-terminated strings following the header: cwd, then argv
+    uint32_t    trace;  // how the command is traced, a trace_format_t
+} request_t;
+
+static tq_t *served = NULL;
+static bool dirty = false;
+static uint64_t dirty_since = 0;
+static volatile sig_atomic_t stopping = 0;
+static struct sockaddr_un listening;
+
+tq_t *server_queue(void) {
+    return served;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void server_mark_dirty(void) {
+    if(!dirty) dirty_since = now_ms();
+    dirty = true;
+}
+
+static void flush(void) {
+    if(!dirty) return;
+    if(!tq_write(served)) {
+        term_error(tq_prog_name, 0, "unable to write task list at %s", served->path);
+        return;
+    }
+    dirty = false;
+}
+
+tq_t *server_reset(void) {
+    ASSERT(served);
+    tq_t *fresh = safe_malloc(sizeof(*fresh));
+    tq_init_new(fresh, served->path);
+    fresh->format = served->format;
+    fresh->lock_fd = served->lock_fd;
+    fresh->writable = served->writable;
+    served->lock_fd = -1;
+    
+    tq_fini(served);
+    free(served);
+    served = fresh;
+    dirty = false;
+    return served;
+}
+
+static bool socket_address(const char *db_path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s", db_path, TQ_SOCKET_EXT);
+    return len > 0 && (size_t)len < sizeof(addr->sun_path);
+}
+
+static bool send_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while(size) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size) {
+    char *bytes = data;
+    while(size) {
+        ssize_t got = recv(fd, bytes, size, 0);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+// Sends [size] bytes from [data], with [count] descriptors attached to them.
+static bool send_fds(int fd, const void *data, size_t size, const int *fds, size_t count, int flags) {
+    union {
+        struct cmsghdr  header;
+        char            buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    ASSERT(count <= 3);
+    
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = count ? control.buf : NULL,
+        .msg_controllen = count ? CMSG_SPACE(count * sizeof(int)) : 0,
+    };
+    if(count) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+    
+    ssize_t sent;
+    while((sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags)) < 0 && errno == EINTR) {}
+    return sent == (ssize_t)size;
+}
+
+// Receives up to [size] bytes into [data], and the [count] descriptors that come with them. The
+// descriptors are all -1 unless exactly [count] came. Returns how many bytes were received.
+static ssize_t recv_fds(int fd, void *data, size_t size, int *fds, size_t count) {
+    union {
+        struct cmsghdr  header;
+        char            buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    for(size_t i = 0; i < count; ++i) fds[i] = -1;
+    
+    ssize_t got;
+    while((got = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR) {}
+    
+    struct cmsghdr *cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < received; ++i) {
+            int one;
+            memcpy(&one, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(received == count) fds[i] = one;
+            else close(one);
+        }
+    }
+    return got;
+}
+
+static int connect_server(const char *db_path) {
+    struct sockaddr_un addr;
+    if(!socket_address(db_path, &addr)) return -1;
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool server_running(const char *db_path) {
+    int fd = connect_server(db_path);
+    if(fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+// Copies our standard input to a temporary file, and returns a descriptor to read it from.
+static int read_stdin(void) {
+    FILE *tmp = tmpfile();
+    if(!tmp) return -1;
+    
+    char buffer[64 * 1024];
+    bool ok = true;
+    ssize_t len;
+    while(ok && (len = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+        if(len < 0 && errno == EINTR) continue;
+        ok = len > 0 && fwrite(buffer, 1, len, tmp) == (size_t)len;
+    }
+    ok = ok && fflush(tmp) == 0;
+    int fd = ok ? dup(fileno(tmp)) : -1;
+    fclose(tmp);
+    if(fd >= 0 && lseek(fd, 0, SEEK_SET) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Writes out what the server spooled for one of our output streams. If that fails, e.g. because
+// whatever reads our output is gone, the rest is dropped, as it would have been without a server.
+static void copy_output(int from, int to) {
+    char buffer[64 * 1024];
+    ssize_t len;
+    while((len = read(from, buffer, sizeof(buffer))) != 0) {
+        if(len < 0 && errno == EINTR) continue;
+        if(len < 0) return;
+        for(ssize_t done = 0, written; done < len; done += written) {
+            while((written = write(to, buffer + done, len - done)) < 0 && errno == EINTR) {}
+            if(written <= 0) return;
+        }
+    }
+}
+
+bool server_forward(const char *db_path, int argc, const char **argv, bool spool_stdin, int *status) {
+    ASSERT(db_path);
+    ASSERT(status);
+    
+    char cwd[PATH_MAX];
+    if(!getcwd(cwd, sizeof(cwd))) return false;
+    
+    // The server would wait on a connection we haven't sent anything on yet: the input is read
+    // before connecting, once we know there is a server to send it to.
+    int in = STDIN_FILENO;
+    if(spool_stdin) {
+        if(!server_running(db_path)) return false;
+        in = read_stdin();
+        if(in < 0) {
+            term_error(tq_prog_name, 0, "unable to read standard input");
+            *status = 1;
+            return true;
+        }
+    }
+    
+    int fd = connect_server(db_path);
+    if(fd < 0) {
+        if(in != STDIN_FILENO) close(in);
+        return false;
+    }
+    
+    request_t req = {.magic = SERVER_MAGIC, .argc = argc, .size = strlen(cwd) + 1, .trace = trace_format};
+    for(int i = 0; i < argc; ++i) req.size += strlen(argv[i]) + 1;
+    
+    // The header carries our standard streams: the server reads our input directly, and only
+    // looks at our output streams to know whether they are terminals.
+    int fds[3] = {in, STDOUT_FILENO, STDERR_FILENO};
+    bool ok = send_fds(fd, &req, sizeof(req), fds, 3, 0);
+    ok = ok && send_all(fd, cwd, strlen(cwd) + 1);
+    for(int i = 0; ok && i < argc; ++i) ok = send_all(fd, argv[i], strlen(argv[i]) + 1);
+    
+    // The exit status comes with the command's output and error output, spooled by the server,
+    // and its trace report if we trace.
+    int32_t result = 1;
+    int out[3] = {-1, -1, -1};
+    size_t num_out = trace_format != TRACE_OFF ? 3 : 2;
+    ssize_t got = ok ? recv_fds(fd, &result, sizeof(result), out, num_out) : -1;
+    ok = got > 0 && out[0] >= 0 && recv_all(fd, (char *)&result + got, sizeof(result) - got);
+    close(fd);
+    if(in != STDIN_FILENO) close(in);
+    
+    if(ok) {
+        copy_output(out[0], STDOUT_FILENO);
+        copy_output(out[1], STDERR_FILENO);
+    }
+    if(ok && num_out == 3) {
+        FILE *report = trace_open_output();
+        fflush(report);
+        copy_output(out[2], fileno(report));
+        trace_close_output(report);
+    }
+    for(size_t i = 0; i < num_out; ++i) {
+        if(out[i] >= 0) close(out[i]);
+    }
+    
+    if(!ok) term_error(tq_prog_name, 0, "lost connection to the task queue server");
+    *status = ok ? result : 1;
+    return true;
+}
+
+static bool receive_request(int fd, request_t *req, int fds[3]) {
+    ssize_t got = recv_fds(fd, req, sizeof(*req), fds, 3);
+    bool have_fds = fds[0] >= 0;
+    
+    // The fds come with the header's first byte, so the rest of it may still be on its way.
+    bool ok = got > 0 && have_fds && recv_all(fd, (char *)req + got, sizeof(*req) - got);
+    ok = ok && req->magic == SERVER_MAGIC;
+    ok = ok && req->argc > 0 && req->argc <= SERVER_MAX_ARGS && req->size <= SERVER_MAX_ARGS_SIZE;
+    ok = ok && req->trace <= TRACE_JSON;
+    if(!ok && have_fds) {
+        for(int i = 0; i < 3; ++i) close(fds[i]);
+    }
+    return ok;
+}
+
+// Returns a descriptor to a new temporary file, to spool a command's output into.
+static int spool_file(void) {
+    FILE *tmp = tmpfile();
+    if(!tmp) return -1;
+    int fd = dup(fileno(tmp));
+    fclose(tmp);
+    return fd;
+}
+
+// Runs the request with the client's standard input, and its output spooled to [out]: what it
+// prints, its error messages, and the report on it if the client traces.
+static int run_request(const request_t *req, char *args, int fds[3], const int out[3]) {
+    const char *cwd = args;
+    const char **argv = safe_calloc(req->argc + 1, sizeof(*argv));
+    uint32_t argc = 0;
+    char *end = args + req->size;
+    for(char *arg = args + strlen(args) + 1; arg < end && argc < req->argc; arg += strlen(arg) + 1) {
+        argv[argc++] = arg;
+    }
+    
+    // Commands run from the client's directory, so that relative paths mean the same thing as
+    // they would have without a server.
+    int saved_cwd = open(".", O_RDONLY);
+    if(argc != req->argc || saved_cwd < 0 || chdir(cwd) < 0) {
+        if(saved_cwd >= 0) close(saved_cwd);
+        for(int i = 0; i < 3; ++i) close(fds[i]);
+        free(argv);
+        return 1;
+    }
+    
+    fflush(stdout);
+    fflush(stderr);
+    render_set_stdout_tty(isatty(fds[1]));
+    int streams[3] = {fds[0], out[0], out[1]};
+    int saved[3];
+    for(int i = 0; i < 3; ++i) {
+        saved[i] = dup(i);
+        dup2(streams[i], i);
+        close(fds[i]);
+    }
+    
+    // The command is traced as the client would have, rather than as we are.
+    trace_format_t own_trace = trace_format;
+    FILE *report = out[2] >= 0 ? fdopen(dup(out[2]), "w") : NULL;
+    trace_report_to(report);
+    trace_begin(report ? req->trace : TRACE_OFF, argv[0]);
+    int status = run_subcommand(argc, argv);
+    trace_end(status);
+    trace_report_to(NULL);
+    if(report) fclose(report);
+    trace_begin(own_trace, "serve");
+    
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdout);
+    clearerr(stderr);
+    for(int i = 0; i < 3; ++i) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    render_set_stdout_tty(-1);
+    if(fchdir(saved_cwd) < 0) term_error(tq_prog_name, 0, "unable to restore working directory");
+    close(saved_cwd);
+    free(argv);
+    return status;
+}
+
+static void handle_client(int fd) {
+    request_t req;
+    int fds[3];
+    if(!receive_request(fd, &req, fds)) return;
+    
+    // The command's output is spooled, and handed back to the client to write out: writing to
+    // the client's streams ourselves, a client that doesn't keep up would hold up every other one.
+    size_t num_out = req.trace != TRACE_OFF ? 3 : 2;
+    int out[3] = {-1, -1, -1};
+    bool spooled = true;
+    for(size_t i = 0; i < num_out; ++i) spooled = (out[i] = spool_file()) >= 0 && spooled;
+    
+    char *args = safe_malloc(req.size + 1);
+    args[req.size] = '\0';
+    int32_t status = 1;
+    if(spooled && recv_all(fd, args, req.size)) {
+        status = run_request(&req, args, fds, out);
+    } else {
+        for(int i = 0; i < 3; ++i) close(fds[i]);
+    }
+    free(args);
+    
+    // The client is waiting for this, the socket has room for it.
+    for(size_t i = 0; spooled && i < num_out; ++i) spooled = lseek(out[i], 0, SEEK_SET) == 0;
+    if(spooled) send_fds(fd, &status, sizeof(status), out, num_out, MSG_DONTWAIT);
+    for(size_t i = 0; i < num_out; ++i) {
+        if(out[i] >= 0) close(out[i]);
+    }
+}
+
+// Subcommands don't exit, but if anything still does while serving, what clients were told was
+// done still gets written, and no one is left trying to connect to a server that's gone.
+static void server_at_exit(void) {
+    if(!served) return;
+    flush();
+    unlink(listening.sun_path);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+int server_run(tq_t *tq) {
+    ASSERT(tq);
+    ASSERT(!served);
+    
+    struct sockaddr_un addr;
+    if(!socket_address(tq->path, &addr)) {
+        term_error(tq_prog_name, 0, "path too long for a server socket: %s", tq->path);
+        return -1;
+    }
+    
+    // A socket file left over by a server that died doesn't accept connections anymore.
+    if(server_running(tq->path)) {
+        term_error(tq_prog_name, 0, "a server is already running for %s", tq->path);
+        return -1;
+    }
+    unlink(addr.sun_path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        term_error(tq_prog_name, 0, "unable to listen on %s: %s", addr.sun_path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    
+    struct sigaction action = {.sa_handler = on_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    static bool registered = false;
+    if(!registered) registered = atexit(server_at_exit) == 0;
+    listening = addr;
+    served = tq;
+    stopping = 0;
+    
+    while(!stopping) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, dirty ? SERVER_FLUSH_DELAY_MS : -1);
+        if(ready < 0) {
+            if(errno == EINTR) continue;
+            term_error(tq_prog_name, 0, "server error: %s", strerror(errno));
+            break;
+        }
+        if(ready == 0) {
+            flush();
+            continue;
+        }
+        
+        int client = accept(fd, NULL, NULL);
+        if(client < 0) continue;
+        struct timeval timeout = {.tv_sec = SERVER_REQUEST_TIMEOUT_S, .tv_usec = 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        handle_client(client);
+        close(client);
+        
+        if(dirty && now_ms() - dirty_since >= SERVER_MAX_DIRTY_MS) flush();
+    }
+    
+    flush();
+    close(fd);
+    unlink(addr.sun_path);
+    
+    tq_close(served);
+    served = NULL;
+    return 0;
+}
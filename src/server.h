@@ -0,0 +1,56 @@
+/*===--------------------------------------------------------------------------------------------===
+ * server.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_SERVER_H_
+#define _TQ_SERVER_H_
+
+#include <stdbool.h>
+#include "tq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * tq serve keeps a queue loaded and runs subcommands against it on behalf of other tq processes,
+ * which connect to a Unix socket next to the queue (.tqlist.txt.sock). A client sends its
+ * command line and hands its standard input over to the server, which runs the subcommand
+ * in-process with it. The command's output is spooled to temporary files, handed back to the client
+ * with the exit status: the client writes it out itself, so that one slow to read its output never
+ * holds the server up.
+ */
+
+#define TQ_SOCKET_EXT ".sock"
+
+// Runs the command on the server that owns the queue at [db_path], if there is one. Returns false
+// if no server is running, otherwise true with the command's exit status in [status]. Clients are
+// served one at a time: with [spool_stdin], our standard input is read in full before connecting,
+// and the server gets a copy of it, so that it never waits on whatever writes to it.
+bool server_forward(const char *db_path, int argc, const char **argv, bool spool_stdin, int *status);
+
+// Returns whether a server is accepting connections for the queue at [db_path].
+bool server_running(const char *db_path);
+
+// Serves [tq], which must have been loaded with write access, until interrupted.
+int server_run(tq_t *tq);
+
+// The queue being served, or NULL if this process isn't a server.
+tq_t *server_queue(void);
+
+// Records that the served queue changed. It gets persisted shortly after.
+void server_mark_dirty(void);
+
+// Replaces the served queue with an empty one, keeping its lock.
+tq_t *server_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_SERVER_H_ */
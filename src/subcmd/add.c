@@ -8,85 +8,222 @@
  *===--------------------------------------------------------------------------------------------===
 */
 #include "../cli.h"
+#include <unistd.h>
 
 static const term_param_t params[] = {
     {'a', 0, "after", TERM_ARG_VALUE, "add the task after an existing one"},
     {'b', 0, "before", TERM_ARG_VALUE, "add the task before an existing one"},
     {0, 'l', "last", TERM_ARG_OPTION, "add the task at the end of the queue"},
+    {0, 'p', "at", TERM_ARG_VALUE, "add the task at a position in the queue, 1 being the front"},
+    {0, 's', "stdin", TERM_ARG_OPTION, "add one task per line of standard input"},
+    {0, 'f', "from-file", TERM_ARG_VALUE, "add one task per line of a file"},
 };
-static const int num_params = 3;
+static const int num_params = 6;
 
-char *my_cat(char *exist, const char *add) {
-    if(!exist) return safe_strdup(add);
-    
-    size_t size = strlen(exist) + strlen(add) + 2;
-    char *concat = safe_calloc(size, 1);
-    snprintf(concat, size, "%s %s", exist, add);
-    free(exist);
-    return concat;
+static const char *use =
+    "add [--last | --at <pos> | --a <id> | --b <id>] (<task> | --stdin | --from-file <path>)";
+
+typedef struct {
+    bool        last;
+    size_t      at;         // 1-based, 0 if unused
+    const char  *after;
+    const char  *before;
+} placement_t;
+
+// Joins the words of a description given on the command line, in a single allocation.
+static char *join_words(const char **words, int count) {
+    size_t size = 1;
+    for(int i = 0; i < count; ++i) size += strlen(words[i]) + 1;
+    
+    char *desc = safe_calloc(size, 1);
+    char *cur = desc;
+    for(int i = 0; i < count; ++i) {
+        if(i) *(cur++) = ' ';
+        size_t len = strlen(words[i]);
+        memcpy(cur, words[i], len);
+        cur += len;
+    }
+    return desc;
+}
+
+// Adds a task, and sets [id] to its ID. [prev] is the ID of the task added before it in the same
+// batch, or NULL.
+static bool add_task(tq_t *tq, const char *desc, const placement_t *where, const char *prev, char *id) {
+    // Tasks added in a batch keep their order: after the first one, each goes right after the
+    // previous one, unless they are all appended or all inserted before the same task.
+    tq_status_t status;
+    if(prev && !where->last && !where->before) {
+        status = tq_insert_after(tq, desc, prev, id);
+    } else if(where->last) {
+        status = tq_add(tq, desc, true, id);
+    } else if(where->at) {
+        status = tq_insert_at(tq, desc, where->at - 1, id);
+    } else if(where->after) {
+        status = tq_insert_after(tq, desc, where->after, id);
+    } else if(where->before) {
+        status = tq_insert_before(tq, desc, where->before, id);
+    } else {
+        status = tq_add(tq, desc, false, id);
+    }
+    
+    if(status == TQ_ERROR_NOT_FOUND) {
+        term_error(tq_prog_name, 0, "no pending task with ID '%s'", where->after ? where->after : where->before);
+    } else if(status != TQ_OK) {
+        term_error(tq_prog_name, 0, "unable to add '%s': %s", desc, tq_strerror(status));
+    }
+    return status == TQ_OK;
+}
+
+// Adds a task for each non-empty line of [in]. Lines are read one at a time, so the input itself
+// is never held in memory, and everything is persisted with a single write at the end.
+static int add_batch(const char *source, FILE *in, const placement_t *where) {
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    size_t num_pending = tq->num_pending;
+    
+    char *line = NULL;
+    size_t cap = 0;
+    size_t count = 0;
+    char prev[TQ_ID_SIZE];
+    bool ok = true;
+    
+    while(getline(&line, &cap, in) >= 0) {
+        str_trim_space(line);
+        if(!strlen(line)) continue;
+        
+        if(!add_task(tq, line, where, count ? prev : NULL, prev)) {
+            ok = false;
+            break;
+        }
+        count += 1;
+    }
+    free(line);
+    
+    if(ok && ferror(in)) {
+        term_error(tq_prog_name, 0, "unable to read tasks from %s", source);
+        ok = false;
+    }
+    
+    // A batch is added as a whole or not at all. A server keeps its queue loaded after the command,
+    // and would write a partial batch along with the next command's changes: take it back.
+    if(!ok) tq_undo_adds(tq, num_pending);
+    if(ok) ok = save_tq(tq);
+    if(ok) printf("added %zu task%s\n", count, count == 1 ? "" : "s");
+    put_tq(tq);
+    return ok ? 0 : -1;
 }
 
 int subcmd_add(int argc, const char **argv) {
     
-    bool last = false;
-    const char *after = NULL;
-    const char *before = NULL;
+    placement_t where = {.last = false, .at = 0, .after = NULL, .before = NULL};
+    bool from_stdin = false;
+    const char *from_file = NULL;
     
     term_arg_parser_t args;
     term_arg_parser_init(&args, argc, argv);
     
     term_arg_result_t arg = term_arg_parse(&args, params, num_params);
     
-    char *desc = NULL;
+    const char **words = safe_calloc(argc, sizeof(*words));
+    int num_words = 0;
     
     while(arg.name != TERM_ARG_DONE) {
         switch(arg.name) {
         case TERM_ARG_HELP:
-            subcmd_use("add", "add [--last | --a <id> | --b <id>] <task>", 
-                "add a new task to a queue", params, num_params);
+            subcmd_use("add", use, "add new tasks to a queue", params, num_params);
+            free(words);
             return 0;
         case TERM_ARG_ERROR:
-            term_error(tq_prog_name, 1, "%s", args.error);
-            return 1;
+            term_error(tq_prog_name, 0, "%s", args.error);
+            free(words);
+            return -1;
         case 'l':
-            if(after || before) {
-                term_error(tq_prog_name, 1, "--last cannot be used with --after or --before");
+            if(where.after || where.before || where.at) {
+                free(words);
+                return arg_error("--last cannot be used with --at, --after or --before");
+            }
+            where.last = true;
+            break;
+        case 'p':
+            if(where.last || where.after || where.before) {
+                free(words);
+                return arg_error("--at cannot be used with --last, --after or --before");
+            }
+            if(!parse_size("at", arg.value, &where.at)) {
+                free(words);
+                return -1;
+            }
+            if(!where.at) {
+                free(words);
+                return arg_error("queue positions start at 1");
             }
-            last = true;
             break;
             
         case 'a':
-            if(last || before) {
-                term_error(tq_prog_name, 1, "--after cannot be used with --last or --before");
+            if(where.last || where.before || where.at) {
+                free(words);
+                return arg_error("--after cannot be used with --last, --at or --before");
             }
-            after = arg.value;
+            where.after = arg.value;
             break;
         case 'b':
-            if(last || after) {
-                term_error(tq_prog_name, 1, "--before cannot be used with --last or --after");
+            if(where.last || where.after || where.at) {
+                free(words);
+                return arg_error("--before cannot be used with --last, --at or --after");
+            }
+            where.before = arg.value;
+            break;
+            
+        case 's':
+            if(from_file) {
+                free(words);
+                return arg_error("--stdin cannot be used with --from-file");
             }
-            before = arg.value;
+            from_stdin = true;
+            break;
+        case 'f':
+            if(from_stdin) {
+                free(words);
+                return arg_error("--from-file cannot be used with --stdin");
+            }
+            from_file = arg.value;
             break;
             
         case TERM_ARG_POSITIONAL:
-            desc = my_cat(desc, arg.value);
+            words[num_words++] = arg.value;
             break;
         }
         arg = term_arg_parse(&args, params, num_params);
     }
     
-    if(!desc) {
+    if(from_stdin || from_file) {
+        free(words);
+        if(from_stdin) reads_stdin();
+        if(num_words) {
+            term_error(tq_prog_name, 0, "a task description cannot be used with --stdin or --from-file");
+            return -1;
+        }
+        
+        // Read through a handle of our own rather than stdin: when a server runs this command, its
+        // standard input only belongs to us for the duration of the command.
+        FILE *in = from_file ? fopen(from_file, "rb") : fdopen(dup(STDIN_FILENO), "rb");
+        if(!in) {
+            term_error(tq_prog_name, 0, "unable to open %s", from_file ? from_file : "standard input");
+            return -1;
+        }
+        int result = add_batch(from_file ? from_file : "standard input", in, &where);
+        fclose(in);
+        return result;
+    }
+    
+    if(!num_words) {
+        free(words);
         term_error(tq_prog_name, 0, "no task description");
-        subcmd_use("add", "add [--last | --a <id> | --b <id>] <task>", 
-            "add a new task to a queue", params, num_params);
+        subcmd_use("add", use, "add new tasks to a queue", params, num_params);
         return -1;
     }
     
-    char *path = tq_get_db_path(fs_current_dir());
-    if(!path) return -1;
-    
-    tq_t tq;
-    get_tq(&tq);
+    char *desc = join_words(words, num_words);
+    free(words);
     
     str_trim_space(desc);
     if(!strlen(desc)) {
@@ -95,26 +232,13 @@ int subcmd_add(int argc, const char **argv) {
         return -1;
     }
     
-    tq_task_t *task = NULL;
-    if(last) {
-        task = tq_add_back(&tq, desc);
-    } else if(after) {
-        if(!(task = tq_add_after(&tq, desc, after))) {
-            term_error(tq_prog_name, 0, "no pending task with ID '%s'", after);
-        }
-    } else if(before) {
-        if(!(task = tq_add_before(&tq, desc, before))) {
-            term_error(tq_prog_name, 0, "no pending task with ID '%s'", before);
-        }
-    } else {
-        task = tq_add_front(&tq, desc);
-    }
-    if(task) tq_print_task(task, stdout);
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    char id[TQ_ID_SIZE];
+    bool ok = add_task(tq, desc, &where, NULL, id);
+    if(ok) tq_print_task(tq_find_todo(tq, id), stdout);
     
     free(desc);
-    tq_write(&tq);
-    tq_fini(&tq);
-    return 0;
+    save_tq(tq);
+    put_tq(tq);
+    return ok ? 0 : -1;
 }
-
-
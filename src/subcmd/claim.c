@@ -0,0 +1,90 @@
+/*===--------------------------------------------------------------------------------------------===
+ * claim.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../render.h"
+#include <limits.h>
+
+#define DEFAULT_LEASE (5 * 60)
+
+static const term_param_t params[] = {
+    {'l', 0, "lease", TERM_ARG_VALUE, "give the task back after N seconds, unless done (default 300)"},
+    {'i', 0, "id", TERM_ARG_OPTION, "only print the ID of the task"},
+};
+static const int num_params = 2;
+
+static const char *use = "claim <holder> [--lease <seconds>] [--id]";
+
+int subcmd_claim(int argc, const char **argv) {
+    const char *holder = NULL;
+    size_t lease = DEFAULT_LEASE;
+    bool id_only = false;
+    
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("claim", use, "take the first pending task nobody is working on", params, num_params);
+            return 0;
+            
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 0, "%s", args.error);
+            return -1;
+            
+        case 'l':
+            if(!parse_size("lease", arg.value, &lease)) return -1;
+            break;
+        case 'i':
+            id_only = true;
+            break;
+            
+        case TERM_ARG_POSITIONAL:
+            if(holder) return arg_error("only one holder can claim a task");
+            holder = arg.value;
+            break;
+        }
+        arg = term_arg_parse(&args, params, num_params);
+    }
+    
+    if(!holder) {
+        term_error(tq_prog_name, 0, "no holder");
+        subcmd_use("claim", use, "take the first pending task nobody is working on", params, num_params);
+        return -1;
+    }
+    if(!lease || lease > UINT_MAX) return arg_error("invalid lease: %zu seconds", lease);
+    
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    char id[TQ_ID_SIZE];
+    tq_status_t status = tq_claim(tq, holder, (unsigned)lease, id);
+    if(status != TQ_OK) {
+        if(status == TQ_ERROR_NOT_FOUND) {
+            term_error(tq_prog_name, 0, "no pending task left to claim");
+        } else {
+            term_error(tq_prog_name, 0, "unable to claim a task: %s", tq_strerror(status));
+        }
+        put_tq(tq);
+        return -1;
+    }
+    
+    render_t out;
+    render_init(&out, stdout);
+    if(id_only) {
+        render_text(&out, id, strlen(id));
+        render_text(&out, "\n", 1);
+    } else {
+        render_task(&out, tq_find_todo(tq, id));
+    }
+    bool ok = render_fini(&out);
+    put_tq(tq);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,62 @@
+/*===--------------------------------------------------------------------------------------------===
+ * convert.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../tq.h"
+
+static const term_param_t params[] = {
+    {0, 'F', "format", TERM_ARG_VALUE, "format to convert the queue to, text or binary" },
+};
+static const int num_params = 1;
+
+int subcmd_convert(int argc, const char **argv) {
+    const char *format_name = NULL;
+    
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("convert", "convert --format=<text|binary>",
+                "convert a task queue to another file format", params, num_params);
+            return 0;
+            
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 0, "%s", args.error);
+            return -1;
+            
+        case 'F':
+            format_name = arg.value;
+            break;
+        }
+        arg = term_arg_parse(&args, params, num_params);
+    }
+    
+    tq_format_t format;
+    if(!format_name) {
+        term_error(tq_prog_name, 0, "no format given");
+        subcmd_use("convert", "convert --format=<text|binary>",
+            "convert a task queue to another file format", params, num_params);
+        return -1;
+    }
+    if(!tq_parse_format(format_name, &format)) {
+        term_error(tq_prog_name, 0, "unknown queue format '%s'", format_name);
+        return -1;
+    }
+    
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    tq->format = format;
+    bool ok = tq_compact(tq);
+    if(!ok) term_error(tq_prog_name, 0, "unable to write task list at %s", tq->path);
+    put_tq(tq);
+    return ok ? 0 : -1;
+}
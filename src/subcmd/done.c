@@ -8,55 +8,191 @@
  *===--------------------------------------------------------------------------------------------===
 */
 #include "../cli.h"
+#include "../render.h"
+#include <fnmatch.h>
+#include <unistd.h>
+
+static const term_param_t params[] = {
+    {0, 's', "stdin", TERM_ARG_OPTION, "read task IDs from standard input, separated by spaces or lines"},
+    {'p', 0, "prefix", TERM_ARG_VALUE, "mark every pending task whose ID starts with a prefix"},
+    {'m', 0, "match", TERM_ARG_VALUE, "mark every pending task whose description matches a pattern"},
+};
+static const int num_params = 3;
+
+static const char *use = "done [<task id>...] [--stdin] [--prefix <id prefix>] [--match <pattern>]";
+
+// The tasks to mark as done. Nothing is changed until every ID, prefix and pattern has been
+// resolved, so a batch with a mistake in it isn't applied halfway.
+typedef struct {
+    tq_task_t   **tasks;
+    size_t      count;
+    size_t      cap;
+    bool        failed;
+} selection_t;
+
+static void select_task(selection_t *sel, tq_task_t *task) {
+    if(sel->count == sel->cap) {
+        sel->cap = sel->cap ? sel->cap * 2 : 64;
+        sel->tasks = safe_realloc(sel->tasks, sel->cap * sizeof(*sel->tasks));
+    }
+    sel->tasks[sel->count++] = task;
+}
+
+static void select_id(selection_t *sel, tq_t *tq, const char *id) {
+    tq_task_t *task = tq_find_todo(tq, id);
+    if(task) {
+        select_task(sel, task);
+    } else {
+        term_error(tq_prog_name, 0, "no pending task with ID '%s'", id);
+        sel->failed = true;
+    }
+}
+
+static void select_prefix(selection_t *sel, tq_t *tq, const char *prefix) {
+    tq_task_t *const *tasks;
+    size_t count = tq_todo_with_prefix(tq, prefix, &tasks);
+    if(!count) {
+        term_error(tq_prog_name, 0, "no pending task ID starts with '%s'", prefix);
+        sel->failed = true;
+    }
+    for(size_t i = 0; i < count; ++i) select_task(sel, tasks[i]);
+}
+
+static void select_pattern(selection_t *sel, tq_t *tq, const char *pattern) {
+    // Descriptions aren't NUL-terminated, fnmatch() needs a copy of each.
+    char *desc = NULL;
+    size_t cap = 0, found = 0;
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t)) {
+        if(t->desc_len + 1 > cap) {
+            cap = t->desc_len + 1 > 2 * cap ? t->desc_len + 1 : 2 * cap;
+            desc = safe_realloc(desc, cap);
+        }
+        memcpy(desc, t->desc, t->desc_len);
+        desc[t->desc_len] = '\0';
+        if(fnmatch(pattern, desc, 0)) continue;
+        select_task(sel, t);
+        found += 1;
+    }
+    free(desc);
+    
+    if(!found) {
+        term_error(tq_prog_name, 0, "no pending task matches '%s'", pattern);
+        sel->failed = true;
+    }
+}
+
+static void select_stdin(selection_t *sel, tq_t *tq) {
+    // Read through a handle of our own rather than stdin: when a server runs this command, its
+    // standard input only belongs to us for the duration of the command.
+    FILE *in = fdopen(dup(STDIN_FILENO), "rb");
+    if(!in) {
+        term_error(tq_prog_name, 0, "unable to open standard input");
+        sel->failed = true;
+        return;
+    }
+    
+    char *line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, in) >= 0) {
+        for(char *id = strtok(line, " \t\r\n"); id; id = strtok(NULL, " \t\r\n")) {
+            select_id(sel, tq, id);
+        }
+    }
+    if(ferror(in)) {
+        term_error(tq_prog_name, 0, "unable to read task IDs from standard input");
+        sel->failed = true;
+    }
+    free(line);
+    fclose(in);
+}
 
 int subcmd_done(int argc, const char **argv) {
-    const char *id = NULL;
+    bool from_stdin = false;
     
     term_arg_parser_t args;
     term_arg_parser_init(&args, argc, argv);
     
-    term_arg_result_t arg = term_arg_parse(&args, NULL, 0);
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    // IDs, prefixes and patterns, in the order they were given.
+    const char **ids = safe_calloc(argc, sizeof(*ids));
+    const char **prefixes = safe_calloc(argc, sizeof(*prefixes));
+    const char **patterns = safe_calloc(argc, sizeof(*patterns));
+    int num_ids = 0, num_prefixes = 0, num_patterns = 0;
     
     while(arg.name != TERM_ARG_DONE) {
         switch(arg.name) {
         case TERM_ARG_HELP:
-            subcmd_use("done", "done <task id>", "mark a task as done", NULL, 0);
+            subcmd_use("done", use, "mark tasks as done", params, num_params);
+            free(ids);
+            free(prefixes);
+            free(patterns);
             return 0;
             
         case TERM_ARG_ERROR:
-            term_error(tq_prog_name, 1, "%s", args.error);
+            term_error(tq_prog_name, 0, "%s", args.error);
+            free(ids);
+            free(prefixes);
+            free(patterns);
             return -1;
             
+        case 's':
+            from_stdin = true;
+            break;
+        case 'p':
+            prefixes[num_prefixes++] = arg.value;
+            break;
+        case 'm':
+            patterns[num_patterns++] = arg.value;
+            break;
+            
         case TERM_ARG_POSITIONAL:
-            if(!id) {
-                id = arg.value;
-            } else {
-                term_error(tq_prog_name, 0, "too many parameters");
-                subcmd_use("done", "done <task id>", "mark a task as done", NULL, 0);
-                return -1;
-            }
+            ids[num_ids++] = arg.value;
             break;
         }
-        arg = term_arg_parse(&args, NULL, 0);
+        arg = term_arg_parse(&args, params, num_params);
     }
     
-    if(!id) {
+    if(!num_ids && !num_prefixes && !num_patterns && !from_stdin) {
+        free(ids);
+        free(prefixes);
+        free(patterns);
         term_error(tq_prog_name, 0, "no task id");
-        subcmd_use("done", "done <task id>", "mark a task as done", NULL, 0);
+        subcmd_use("done", use, "mark tasks as done", params, num_params);
         return -1;
     }
     
-    tq_t tq;
-    get_tq(&tq);
-    tq_task_t *task = tq_mark_done(&tq, id);
-    if(task) {
-        tq_print_task(task, stdout);
-        tq_write(&tq);
-    } else {
-        term_error(tq_prog_name, 0, "no pending task with ID '%s'", id);
+    if(from_stdin) reads_stdin();
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    selection_t sel = {.tasks = NULL, .count = 0, .cap = 0, .failed = false};
+    for(int i = 0; i < num_ids; ++i) select_id(&sel, tq, ids[i]);
+    if(from_stdin) select_stdin(&sel, tq);
+    for(int i = 0; i < num_prefixes; ++i) select_prefix(&sel, tq, prefixes[i]);
+    for(int i = 0; i < num_patterns; ++i) select_pattern(&sel, tq, patterns[i]);
+    free(ids);
+    free(prefixes);
+    free(patterns);
+    
+    if(sel.failed) {
+        term_error(tq_prog_name, 0, "no task marked as done");
+        free(sel.tasks);
+        put_tq(tq);
+        return -1;
     }
     
-    tq_fini(&tq);
+    // A task selected more than once is only marked (and shown) the first time, and the whole
+    // batch is persisted with a single write.
+    render_t out;
+    render_init(&out, stdout);
+    for(size_t i = 0; i < sel.count; ++i) {
+        if(sel.tasks[i]->done) continue;
+        tq_done(tq, sel.tasks[i]->id);
+        render_task(&out, sel.tasks[i]);
+    }
+    bool ok = render_fini(&out);
+    free(sel.tasks);
     
-    return 0;
+    ok = save_tq(tq) && ok;
+    put_tq(tq);
+    return ok ? 0 : -1;
 }
@@ -0,0 +1,151 @@
+/*===--------------------------------------------------------------------------------------------===
+ * find.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../tq.h"
+#include "../render.h"
+#include "../search.h"
+
+static const term_param_t params[] = {
+    {'d', 0, "done", TERM_ARG_OPTION, "search tasks already marked as done too" },
+};
+static const int num_params = 1;
+
+static const char *use = "find [--done] <word> [<prefix>*...]";
+
+typedef struct {
+    render_t    out;
+    size_t      count;
+    bool        in_done;
+} results_t;
+
+static bool print_match(const tq_task_t *task, size_t count, void *data) {
+    (void)count;
+    results_t *results = data;
+    if(task->done && !results->in_done) {
+        render_header(&results->out, "Done");
+        results->in_done = true;
+    }
+    render_text(&results->out, " - ", 3);
+    render_task(&results->out, task);
+    results->count += 1;
+    return true;
+}
+
+typedef struct {
+    results_t   *results;
+    search_word_t *words;
+    size_t      num_words;
+} filter_t;
+
+static bool print_if_match(const tq_task_t *task, size_t count, void *data) {
+    filter_t *filter = data;
+    if(!search_matches(task->desc, task->desc_len, filter->words, filter->num_words)) return true;
+    return print_match(task, count, filter->results);
+}
+
+// A server has every pending description in memory already, there's no index to go through.
+static tq_status_t find_loaded(tq_t *tq, const char *query, bool show_done, results_t *results) {
+    filter_t filter = {.results = results};
+    filter.num_words = search_parse(query, &filter.words);
+    
+    const list_t *lists[] = {&tq->todo, &tq->done};
+    for(int i = 0; i < (show_done ? 2 : 1); ++i) {
+        for(tq_task_t *t = list_head(lists[i]); t; t = list_next(lists[i], t)) {
+            print_if_match(t, 0, &filter);
+        }
+    }
+    tq_status_t status = show_done ? tq_visit_archive(tq, print_if_match, &filter) : TQ_OK;
+    free(filter.words);
+    return status;
+}
+
+int subcmd_find(int argc, const char **argv) {
+    bool show_done = false;
+    
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    const char **words = safe_calloc(argc, sizeof(*words));
+    int num_words = 0;
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("find", use, "find tasks by the words in their description", params, num_params);
+            free(words);
+            return 0;
+            
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 0, "%s", args.error);
+            free(words);
+            return -1;
+            
+        case 'd':
+            show_done = true;
+            break;
+            
+        case TERM_ARG_POSITIONAL:
+            words[num_words++] = arg.value;
+            break;
+        }
+        arg = term_arg_parse(&args, params, num_params);
+    }
+    
+    size_t size = 1;
+    for(int i = 0; i < num_words; ++i) size += strlen(words[i]) + 1;
+    char *query = safe_calloc(size, 1);
+    for(int i = 0; i < num_words; ++i) {
+        if(i) strcat(query, " ");
+        strcat(query, words[i]);
+    }
+    free(words);
+    
+    search_word_t *parsed = NULL;
+    size_t num_parsed = search_parse(query, &parsed);
+    free(parsed);
+    if(!num_parsed) {
+        free(query);
+        term_error(tq_prog_name, 0, "nothing to search for");
+        subcmd_use("find", use, "find tasks by the words in their description", params, num_params);
+        return -1;
+    }
+    
+    results_t results = {.count = 0, .in_done = false};
+    char *path = get_tq_path();
+    render_init(&results.out, stdout);
+    render_header(&results.out, "Todo");
+    if(path) {
+        tq_status_t status = tq_find(path, query, show_done, print_match, &results);
+        if(status != TQ_OK) {
+            render_fini(&results.out);
+            check_tq(status, path);
+            free(path);
+            free(query);
+            return -1;
+        }
+        free(path);
+    } else {
+        tq_t *tq = get_tq(TQ_ACCESS_READ);
+        if(find_loaded(tq, query, show_done, &results) != TQ_OK) {
+            render_fini(&results.out);
+            term_error(tq_prog_name, 0, "unable to read archived tasks of %s", tq->path);
+            put_tq(tq);
+            free(query);
+            return -1;
+        }
+        put_tq(tq);
+    }
+    free(query);
+    
+    if(show_done && !results.in_done) render_header(&results.out, "Done");
+    return render_fini(&results.out) ? 0 : -1;
+}
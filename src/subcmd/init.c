@@ -16,12 +16,14 @@
 static const term_param_t params[] = {
     {'f', 0, "force", TERM_ARG_OPTION, "override existing task queue" },
     {'q', 0, "quiet", TERM_ARG_OPTION, "execute without printing messages" },
+    {0, 'F', "format", TERM_ARG_VALUE, "queue file format, text (default) or binary" },
 };
-static const int num_params = 2;
+static const int num_params = 3;
 
 int subcmd_init(int argc, const char **argv) {
     bool force = false;
     bool quiet = false;
+    tq_format_t format = TQ_FORMAT_TEXT;
     
     term_arg_parser_t args;
     term_arg_parser_init(&args, argc, argv);
@@ -31,13 +33,13 @@ int subcmd_init(int argc, const char **argv) {
     while(arg.name != TERM_ARG_DONE) {
         switch(arg.name) {
         case TERM_ARG_HELP:
-            subcmd_use("init", "init [--force] [--quiet]", 
+            subcmd_use("init", "init [--force] [--quiet] [--format=<text|binary>]", 
                 "create a new task queue or reinitialize an existing one", params, num_params);
             return 0;
             
         case TERM_ARG_ERROR:
-            term_error(tq_prog_name, -1, "%s", args.error);
-            return 1;
+            term_error(tq_prog_name, 0, "%s", args.error);
+            return -1;
             
         case 'f':
             force = true;
@@ -45,32 +47,51 @@ int subcmd_init(int argc, const char **argv) {
         case 'q':
             quiet = true;
             break;
+        case 'F':
+            if(!tq_parse_format(arg.value, &format)) {
+                return arg_error("unknown queue format '%s'", arg.value);
+            }
+            break;
         }
         arg = term_arg_parse(&args, params, num_params);
     }
     
-    char *path = fs_make_path(fs_current_dir(), TQ_DB_NAME, NULL);
+    // TQ_DB names the queue to create, if set: otherwise it goes in the current directory.
+    char *path = tq_env_db_path();
+    if(!path) path = fs_make_path(fs_current_dir(), TQ_DB_NAME, NULL);
+    
+    char *dir = safe_strdup(path);
+    char *sep = strrchr(dir, '/');
+    if(sep) *(sep == dir ? sep + 1 : sep) = '\0';
     
     bool exists = fs_file_exists(path);
     if(exists && !force) {
         term_error(tq_prog_name, 0,
             "a task queue alread exists at %s.\n"
             "  Use --force to re-initialize it.", path);
+        free(dir);
+        free(path);
+        return -1;
+    }
+    
+    tq_t *tq = new_tq(path, format);
+    if(!tq) {
+        free(dir);
         free(path);
         return -1;
     }
+    put_tq(tq);
     
-    tq_t tq;
-    tq_init_new(&tq, path);
-    tq_write(&tq);
-    tq_fini(&tq);
+    // Directories under this one may have been resolved to a queue further up the tree.
+    tq_forget_dbs(dir);
     
     if(!quiet && exists) {
-        printf("reinitialised empty task queue in '%s'\n", fs_current_dir());
+        printf("reinitialised empty task queue in '%s'\n", dir);
     } else if(!quiet) {
-        printf("initialised empty task queue in '%s'\n", fs_current_dir());
+        printf("initialised empty task queue in '%s'\n", dir);
     }
     
+    free(dir);
     free(path);
     
     return 0;
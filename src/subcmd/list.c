@@ -9,35 +9,255 @@
 */
 #include "../cli.h"
 #include "../tq.h"
-#include <term/colors.h>
+#include "../render.h"
+#include "../server.h"
+#include "../tree.h"
+#include <stdint.h>
+#include <time.h>
 
 static const term_param_t params[] = {
     {'d', 0, "done", TERM_ARG_OPTION, "show tasks already marked as done" },
+    {0, 'o', "offset", TERM_ARG_VALUE, "skip the first N pending tasks" },
+    {0, 'n', "limit", TERM_ARG_VALUE, "show at most N pending tasks" },
+    {'r', 0, "recursive", TERM_ARG_OPTION, "list every queue under DIR (the current directory)" },
+    {'s', 0, "summary", TERM_ARG_OPTION, "only count the tasks of every queue under DIR" },
 };
-static const int num_params = 1;
-
-static void print_list(const tq_t *tq, bool show_done) {
-    term_set_bold(stdout, true);
-    printf("Todo:\n");
-    term_style_reset(stdout);
-    for(tq_task_t *task = list_head(&tq->todo); task; task = list_next(&tq->todo, task)) {
-        printf(" - ");
-        tq_print_task(task, stdout);
+static const int num_params = 5;
+
+static const char *use = "list [--done] [--offset N] [--limit N] [--recursive|--summary [DIR]]";
+
+typedef struct {
+    render_t *out;
+    size_t  offset;
+    size_t  limit;
+    size_t  pos;        // of the next pending task
+    int     width;      // of the positions shown, once known
+    bool    in_done;
+    bool    summary;    // only count tasks
+    size_t  todo;
+    size_t  done;
+    tq_claim_t *claims; // on the queue's tasks, sorted by ID
+    size_t  num_claims;
+    int64_t now;
+} listing_t;
+
+static int compare_claims(const void *a, const void *b) {
+    return strcmp(((const tq_claim_t *)a)->id, ((const tq_claim_t *)b)->id);
+}
+
+static const tq_claim_t *find_claim(const listing_t *list, const tq_task_t *task) {
+    if(!list->num_claims) return NULL;
+    tq_claim_t key;
+    memcpy(key.id, task->id, sizeof(key.id));
+    const tq_claim_t *claim = bsearch(&key, list->claims, list->num_claims, sizeof(*list->claims),
+        compare_claims);
+    return claim && claim->expiry > list->now ? claim : NULL;
+}
+
+// Claimed tasks are shown with who holds them, so they are read along with the queue.
+static tq_status_t read_claims(listing_t *list, const char *path) {
+    list->now = (int64_t)time(NULL);
+    return tq_read_claims(path, &list->claims, &list->num_claims);
+}
+
+static bool print_task(const tq_task_t *task, size_t count, void *data) {
+    listing_t *list = data;
+    if(task->done) {
+        list->done += 1;
+        if(!list->in_done) render_header(list->out, "Done");
+        list->in_done = true;
+        render_text(list->out, " - ", 3);
+        render_task(list->out, task);
+        return true;
+    }
+    
+    list->todo = count;
+    size_t pos = list->pos++;
+    if(pos < list->offset) return true;
+    if(pos - list->offset >= list->limit) return false;
+    
+    // Positions are aligned on the last one that will be shown.
+    if(!list->width) {
+        size_t last = count - list->offset > list->limit ? list->offset + list->limit : count;
+        list->width = render_width(last);
+    }
+    render_text(list->out, " ", 1);
+    render_number(list->out, pos + 1, list->width);
+    render_text(list->out, ". ", 2);
+    const tq_claim_t *claim = find_claim(list, task);
+    if(claim) render_claimed_task(list->out, task, claim, list->now);
+    else render_task(list->out, task);
+    return true;
+}
+
+// A server already has the queue in memory, and can jump straight to the first task shown.
+static tq_status_t print_loaded(tq_t *tq, listing_t *list, bool show_done) {
+    size_t count = tq_num_todo(tq);
+    tq_task_t *task = list->offset ? tq_todo_at(tq, list->offset) : list_head(&tq->todo);
+    list->pos = list->offset;
+    while(task && print_task(task, count, list)) task = list_next(&tq->todo, task);
+    
+    if(!show_done) return TQ_OK;
+    for(task = list_head(&tq->done); task; task = list_next(&tq->done, task)) {
+        print_task(task, 0, list);
+    }
+    return tq_visit_archive(tq, print_task, list);
+}
+
+typedef struct {
+    char    *dir;
+    size_t  todo;
+    size_t  done;
+} summary_t;
+
+typedef struct {
+    listing_t   options;    // what each queue is listed with
+    bool        show_done;
+    render_t    *out;
+    size_t      num_queues;
+    bool        failed;
+    summary_t   *rows;
+    size_t      num_rows;
+    size_t      capacity;
+} tree_listing_t;
+
+// Runs on the threads of the walk, so only reads the queue and renders it to memory.
+static void read_listing(tree_queue_t *queue, void *data) {
+    const tree_listing_t *tree = data;
+    
+    // A server keeps its queue locked for as long as it runs: reading it would wait until then.
+    if(server_running(queue->path)) {
+        queue->status = TQ_ERROR_LOCK;
+        return;
     }
     
-    if(!show_done) return;
+    if(tree->options.summary) {
+        queue->status = tq_count_tasks(queue->path, tree->show_done, &queue->todo, &queue->done);
+        return;
+    }
     
-    term_set_bold(stdout, true);
-    printf("Done:\n");
-    term_style_reset(stdout);
-    for(tq_task_t *task = list_head(&tq->done); task; task = list_next(&tq->done, task)) {
-        printf(" - ");
-        tq_print_task(task, stdout);
+    listing_t list = tree->options;
+    list.out = &queue->out;
+    render_header(list.out, queue->dir);
+    queue->status = read_claims(&list, queue->path);
+    if(queue->status == TQ_OK) {
+        queue->status = tq_stream(queue->path, tree->show_done, print_task, &list);
     }
+    queue->todo = list.todo;
+    queue->done = list.done;
+    free(list.claims);
+}
+
+static bool print_listing(const tree_queue_t *queue, void *data) {
+    tree_listing_t *tree = data;
+    size_t index = tree->num_queues++;
+    if(queue->status != TQ_OK) {
+        render_flush(tree->out);
+        if(queue->status == TQ_ERROR_LOCK && server_running(queue->path)) {
+            term_error(tq_prog_name, 0, "%s is loaded by tq serve, run tq list from there", queue->dir);
+        } else {
+            term_error(tq_prog_name, 0, "%s: %s", queue->path, tq_strerror(queue->status));
+        }
+        tree->failed = true;
+        return true;
+    }
+    
+    if(tree->options.summary) {
+        if(tree->num_rows == tree->capacity) {
+            tree->capacity = tree->capacity ? tree->capacity * 2 : 64;
+            tree->rows = safe_realloc(tree->rows, tree->capacity * sizeof(*tree->rows));
+        }
+        tree->rows[tree->num_rows++] = (summary_t){
+            .dir = safe_strdup(queue->dir),
+            .todo = queue->todo,
+            .done = queue->done
+        };
+        return true;
+    }
+    
+    if(index) render_text(tree->out, "\n", 1);
+    render_text(tree->out, queue->out.buffer, queue->out.used);
+    return true;
+}
+
+static void print_counts(const tree_listing_t *tree, size_t todo, size_t done, int todo_width,
+                         int done_width) {
+    render_text(tree->out, " ", 1);
+    render_number(tree->out, todo, todo_width);
+    render_text(tree->out, " pending", 8);
+    if(tree->show_done) {
+        render_text(tree->out, ", ", 2);
+        render_number(tree->out, done, done_width);
+        render_text(tree->out, " done", 5);
+    }
+    render_text(tree->out, "  ", 2);
+}
+
+// Summaries only need a few counts per queue, which are all known before anything is printed: they
+// are aligned on the totals.
+static void print_summary(const tree_listing_t *tree) {
+    size_t todo = 0, done = 0, count = tree->num_rows;
+    for(size_t i = 0; i < count; ++i) {
+        todo += tree->rows[i].todo;
+        done += tree->rows[i].done;
+    }
+    int todo_width = render_width(todo);
+    int done_width = render_width(done);
+    
+    render_header(tree->out, "Queues");
+    for(size_t i = 0; i < count; ++i) {
+        const summary_t *row = &tree->rows[i];
+        print_counts(tree, row->todo, row->done, todo_width, done_width);
+        render_text(tree->out, row->dir, strlen(row->dir));
+        render_text(tree->out, "\n", 1);
+    }
+    
+    char total[64];
+    int len = snprintf(total, sizeof(total), "total, %zu queue%s\n", count, count == 1 ? "" : "s");
+    print_counts(tree, todo, done, todo_width, done_width);
+    render_text(tree->out, total, len);
+}
+
+static int list_tree(const char *root, const listing_t *options, bool show_done) {
+    render_t out;
+    render_init(&out, stdout);
+    tree_listing_t tree = {
+        .options = *options,
+        .show_done = show_done,
+        .out = &out,
+        .num_queues = 0,
+        .failed = false,
+        .rows = NULL,
+        .num_rows = 0,
+        .capacity = 0,
+    };
+    
+    size_t unreadable = 0;
+    tq_status_t status = tree_walk(root, out.styled, read_listing, print_listing, &tree, &unreadable);
+    if(status == TQ_OK && options->summary) print_summary(&tree);
+    bool ok = render_fini(&out) && status == TQ_OK && !tree.failed;
+    
+    if(status != TQ_OK) {
+        term_error(tq_prog_name, 0, "unable to read %s", root);
+    } else if(!tree.num_queues) {
+        term_error(tq_prog_name, 0, "no task queue under %s", root);
+        ok = false;
+    }
+    if(unreadable) {
+        term_error(tq_prog_name, 0, "%zu director%s under %s couldn't be read", unreadable,
+            unreadable == 1 ? "y" : "ies", root);
+    }
+    
+    for(size_t i = 0; i < tree.num_rows; ++i) free(tree.rows[i].dir);
+    free(tree.rows);
+    return ok ? 0 : -1;
 }
 
 int subcmd_list(int argc, const char **argv) {
     bool show_done = false;
+    bool recursive = false;
+    const char *root = NULL;
+    listing_t list = {.offset = 0, .limit = SIZE_MAX, .pos = 0, .width = 0, .in_done = false};
     
     term_arg_parser_t args;
     term_arg_parser_init(&args, argc, argv);
@@ -47,24 +267,79 @@ int subcmd_list(int argc, const char **argv) {
     while(arg.name != TERM_ARG_DONE) {
         switch(arg.name) {
         case TERM_ARG_HELP:
-            subcmd_use("list", "list [--done]", 
-                "list tasks in a queue", params, num_params);
+            subcmd_use("list", use, "list tasks in a queue", params, num_params);
             return 0;
             
         case TERM_ARG_ERROR:
-            term_error(tq_prog_name, 1, "%s", args.error);
-            return 1;
+            term_error(tq_prog_name, 0, "%s", args.error);
+            return -1;
             
         case 'd':
             show_done = true;
             break;
+        case 'o':
+            if(!parse_size("offset", arg.value, &list.offset)) return -1;
+            break;
+        case 'n':
+            if(!parse_size("limit", arg.value, &list.limit)) return -1;
+            break;
+        case 's':
+            list.summary = true;
+            recursive = true;
+            break;
+        case 'r':
+            recursive = true;
+            break;
+            
+        case TERM_ARG_POSITIONAL:
+            if(root) return arg_error("only one directory can be listed");
+            root = arg.value;
+            break;
         }
         arg = term_arg_parse(&args, params, num_params);
     }
     
-    tq_t tq;
-    get_tq(&tq);
-    print_list(&tq, show_done);
-    tq_fini(&tq);
-    return TQ_OK ? 0 : -1;
+    if(root && !recursive) return arg_error("a directory can only be listed with --recursive");
+    if(recursive) return list_tree(root ? root : ".", &list, show_done);
+    
+    // Listing is the most common command by far: unless a server has the queue loaded already,
+    // it's streamed straight from the files, without loading it.
+    char *path = get_tq_path();
+    render_t out;
+    list.out = &out;
+    render_init(&out, stdout);
+    render_header(&out, "Todo");
+    if(path) {
+        tq_status_t status = read_claims(&list, path);
+        if(status == TQ_OK) status = tq_stream(path, show_done, print_task, &list);
+        free(list.claims);
+        if(status != TQ_OK) {
+            render_fini(&out);
+            check_tq(status, path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    } else {
+        tq_t *tq = get_tq(TQ_ACCESS_READ);
+        tq_status_t status = read_claims(&list, tq->path);
+        if(status != TQ_OK) {
+            render_fini(&out);
+            check_tq(status, tq->path);
+            put_tq(tq);
+            return -1;
+        }
+        status = print_loaded(tq, &list, show_done);
+        free(list.claims);
+        if(status != TQ_OK) {
+            render_fini(&out);
+            term_error(tq_prog_name, 0, "unable to read archived tasks of %s", tq->path);
+            put_tq(tq);
+            return -1;
+        }
+        put_tq(tq);
+    }
+    
+    if(show_done && !list.in_done) render_header(&out, "Done");
+    return render_fini(&out) ? 0 : -1;
 }
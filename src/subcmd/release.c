@@ -0,0 +1,92 @@
+/*===--------------------------------------------------------------------------------------------===
+ * release.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../render.h"
+
+static const term_param_t params[] = {
+    {0, 'H', "holder", TERM_ARG_VALUE, "only give tasks back if they are claimed by this holder"},
+};
+static const int num_params = 1;
+
+static const char *use = "release <task id>... [--holder <holder>]";
+
+int subcmd_release(int argc, const char **argv) {
+    const char *holder = NULL;
+    
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    const char **ids = safe_calloc(argc, sizeof(*ids));
+    int num_ids = 0;
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("release", use, "give claimed tasks back to the queue", params, num_params);
+            free(ids);
+            return 0;
+            
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 0, "%s", args.error);
+            free(ids);
+            return -1;
+            
+        case 'H':
+            holder = arg.value;
+            break;
+            
+        case TERM_ARG_POSITIONAL:
+            ids[num_ids++] = arg.value;
+            break;
+        }
+        arg = term_arg_parse(&args, params, num_params);
+    }
+    
+    if(!num_ids) {
+        free(ids);
+        term_error(tq_prog_name, 0, "no task id");
+        subcmd_use("release", use, "give claimed tasks back to the queue", params, num_params);
+        return -1;
+    }
+    
+    tq_t *tq = get_tq(TQ_ACCESS_WRITE);
+    render_t out;
+    render_init(&out, stdout);
+    bool ok = true;
+    for(int i = 0; i < num_ids; ++i) {
+        const tq_claim_t *claim = tq_find_claim(tq, ids[i]);
+        tq_status_t status = tq_release(tq, ids[i], holder);
+        switch(status) {
+        case TQ_OK:
+            render_task(&out, tq_find_todo(tq, ids[i]));
+            continue;
+        case TQ_ERROR_NOT_FOUND:
+            render_flush(&out);
+            term_error(tq_prog_name, 0, "no claimed task with ID '%s'", ids[i]);
+            break;
+        case TQ_ERROR_CLAIMED:
+            render_flush(&out);
+            term_error(tq_prog_name, 0, "task '%s' is claimed by %s", ids[i], claim->holder);
+            break;
+        default:
+            render_flush(&out);
+            term_error(tq_prog_name, 0, "unable to release '%s': %s", ids[i], tq_strerror(status));
+            break;
+        }
+        ok = false;
+    }
+    free(ids);
+    
+    ok = render_fini(&out) && ok;
+    put_tq(tq);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,51 @@
+/*===--------------------------------------------------------------------------------------------===
+ * serve.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../server.h"
+
+int subcmd_serve(int argc, const char **argv) {
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, NULL, 0);
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("serve", "serve", "keep a task queue loaded and serve other tq commands",
+                NULL, 0);
+            puts("The queue stays locked for as long as the server runs. tq commands are run by the\n"
+                 "server, one at a time, but other programs opening the queue with libtq wait until\n"
+                 "it stops.");
+            return 0;
+            
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 1, "%s", args.error);
+            return -1;
+            
+        case TERM_ARG_POSITIONAL:
+            term_error(tq_prog_name, 0, "too many parameters");
+            subcmd_use("serve", "serve", "keep a task queue loaded and serve other tq commands",
+                NULL, 0);
+            return -1;
+        }
+        arg = term_arg_parse(&args, NULL, 0);
+    }
+    
+    char *path = find_tq_path();
+    if(server_running(path)) {
+        term_error(tq_prog_name, 1, "a server is already running for %s", path);
+    }
+    
+    tq_t *tq = open_tq(path, TQ_ACCESS_WRITE);
+    free(path);
+    
+    return server_run(tq);
+}
@@ -0,0 +1,400 @@
+/*===--------------------------------------------------------------------------------------------===
+ * watch.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "../cli.h"
+#include "../tq.h"
+#include "../render.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// How often the queue is checked for changes where inotify isn't available.
+#define WATCH_POLL_MS (200)
+
+static const term_param_t params[] = {
+    {'i', 0, "initial", TERM_ARG_OPTION, "start by printing every pending task as added"},
+};
+static const int num_params = 1;
+
+static const char *use = "watch [--initial]";
+
+/*
+ * tq watch prints the changes made to the queue, one per line, as other processes make them:
+ *
+ *      added <id> <position> <description>
+ *      done <id>
+ *      moved <id> <position>
+ *      removed <id>
+ *
+ * Changes are printed in batches, whenever the queue is written. Positions are 1-based, and are
+ * where tasks are once the whole batch is applied: a batch can be applied to a copy of the queue by
+ * taking out every task it mentions, then putting added and moved tasks back, in the order they
+ * are printed, which is by position.
+ *
+ * The queue stays loaded between batches, and only what was appended to its journal is read. When
+ * the queue is compacted (or replaced), it's loaded again, and compared with the copy we had to
+ * find what changed. Tasks are never reordered by tq itself, so only that can report moved tasks,
+ * and removed ones, which are gone from the queue without having been done.
+ */
+
+typedef struct {
+    const tq_task_t *task;
+    size_t          pos;
+} placed_t;
+
+typedef struct {
+    char            *path;
+    const char      *name;          // of the queue's file, and of its journal, in their directory
+    char            *journal_name;
+    tq_t            *tq;
+    render_t        out;
+    
+    placed_t        *placed;    // added and moved tasks of the current batch
+    size_t          num_placed;
+    size_t          placed_cap;
+} watch_t;
+
+static void print_id(watch_t *w, const char *event, const tq_task_t *task) {
+    render_text(&w->out, event, strlen(event));
+    render_text(&w->out, " ", 1);
+    render_text(&w->out, task->id, strlen(task->id));
+}
+
+static void place(watch_t *w, const tq_task_t *task, size_t pos) {
+    if(w->num_placed == w->placed_cap) {
+        w->placed_cap = w->placed_cap ? w->placed_cap * 2 : 64;
+        w->placed = safe_realloc(w->placed, w->placed_cap * sizeof(*w->placed));
+    }
+    w->placed[w->num_placed++] = (placed_t){.task = task, .pos = pos};
+}
+
+static int compare_placed(const void *a, const void *b) {
+    const placed_t *x = a;
+    const placed_t *y = b;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+// Prints the added and moved tasks of the batch, and sends the batch out.
+static bool end_batch(watch_t *w, tq_t *old) {
+    qsort(w->placed, w->num_placed, sizeof(*w->placed), compare_placed);
+    for(size_t i = 0; i < w->num_placed; ++i) {
+        const tq_task_t *task = w->placed[i].task;
+        bool moved = old && tq_find_todo(old, task->id);
+        print_id(w, moved ? "moved" : "added", task);
+        render_text(&w->out, " ", 1);
+        render_number(&w->out, w->placed[i].pos + 1, 0);
+        if(!moved) {
+            render_text(&w->out, " ", 1);
+            render_text(&w->out, task->desc, task->desc_len);
+        }
+        render_text(&w->out, "\n", 1);
+    }
+    w->num_placed = 0;
+    return render_flush(&w->out);
+}
+
+static void follow_change(tq_t *tq, const tq_task_t *task, void *data) {
+    (void)tq;
+    watch_t *w = data;
+    if(task->done) {
+        print_id(w, "done", task);
+        render_text(&w->out, "\n", 1);
+    } else {
+        place(w, task, 0);
+    }
+}
+
+static bool print_initial(watch_t *w) {
+    size_t pos = 0;
+    for(tq_task_t *t = list_head(&w->tq->todo); t; t = list_next(&w->tq->todo, t)) {
+        place(w, t, pos++);
+    }
+    return end_batch(w, NULL);
+}
+
+static int compare_ids(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+typedef struct {
+    watch_t         *w;
+    const char      **missing;      // IDs pending before, but not anymore, sorted
+    bool            *found;         // for each of them, whether it was done
+    size_t          num_missing;
+    size_t          num_found;
+} missing_t;
+
+static bool find_missing(const tq_task_t *task, size_t count, void *data) {
+    (void)count;
+    missing_t *m = data;
+    const char *id = task->id;
+    const char **found = bsearch(&id, m->missing, m->num_missing, sizeof(*m->missing), compare_ids);
+    if(found && !m->found[found - m->missing]) {
+        print_id(m->w, "done", task);
+        render_text(&m->w->out, "\n", 1);
+        m->found[found - m->missing] = true;
+        m->num_found += 1;
+    }
+    return m->num_found < m->num_missing;
+}
+
+// Moved tasks are the ones outside of the longest run of tasks that kept their relative order,
+// which is the fewest moves that account for the new order: the longest increasing subsequence of
+// the old positions, taken in the new order. [seq] is overwritten.
+static void find_moved(watch_t *w, const tq_task_t **tasks, size_t *seq, size_t count) {
+    size_t *tails = safe_malloc((count ? count : 1) * sizeof(size_t));
+    size_t *prev = safe_malloc((count ? count : 1) * sizeof(size_t));
+    size_t length = 0;
+    for(size_t i = 0; i < count; ++i) {
+        size_t lo = 0, hi = length;
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if(seq[tails[mid]] < seq[i]) lo = mid + 1;
+            else hi = mid;
+        }
+        prev[i] = lo ? tails[lo - 1] : SIZE_MAX;
+        tails[lo] = i;
+        if(lo == length) length += 1;
+    }
+    
+    // Marks the ones that stay, then places the others.
+    size_t kept = length ? tails[length - 1] : SIZE_MAX;
+    while(kept != SIZE_MAX) {
+        size_t next = prev[kept];
+        seq[kept] = SIZE_MAX;
+        kept = next;
+    }
+    free(prev);
+    free(tails);
+    
+    for(size_t i = 0; i < count; ++i) {
+        if(seq[i] != SIZE_MAX) place(w, tasks[i], tq_todo_position(w->tq, tasks[i]));
+    }
+}
+
+// Prints what changed between [old] and the queue we just loaded.
+static bool compare_queues(watch_t *w, tq_t *old, uint32_t old_segments) {
+    tq_t *tq = w->tq;
+    
+    missing_t m = {.w = w};
+    m.missing = safe_malloc((tq_num_todo(old) + 1) * sizeof(*m.missing));
+    for(tq_task_t *t = list_head(&old->todo); t; t = list_next(&old->todo, t)) {
+        if(!tq_find_todo(tq, t->id)) m.missing[m.num_missing++] = t->id;
+    }
+    qsort(m.missing, m.num_missing, sizeof(*m.missing), compare_ids);
+    m.found = safe_calloc(m.num_missing + 1, sizeof(*m.found));
+    
+    // Tasks done since the last compaction are in the done list, the ones before that in the
+    // segments it added to the archive.
+    for(tq_task_t *t = list_head(&tq->done); t && m.num_found < m.num_missing; t = list_next(&tq->done, t)) {
+        find_missing(t, 0, &m);
+    }
+    if(m.num_found < m.num_missing && tq->num_segments > old_segments
+       && tq_visit_archive(tq, find_missing, &m) != TQ_OK) {
+        render_flush(&w->out);
+        term_error(tq_prog_name, 0, "unable to read archived tasks of %s", tq->path);
+    }
+    for(size_t i = 0; i < m.num_missing; ++i) {
+        if(m.found[i]) continue;
+        render_text(&w->out, "removed ", 8);
+        render_text(&w->out, m.missing[i], strlen(m.missing[i]));
+        render_text(&w->out, "\n", 1);
+    }
+    free(m.found);
+    free(m.missing);
+    
+    size_t count = tq_num_todo(tq);
+    const tq_task_t **kept = safe_malloc((count + 1) * sizeof(*kept));
+    size_t *seq = safe_malloc((count + 1) * sizeof(*seq));
+    size_t num_kept = 0;
+    size_t pos = 0;
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t), ++pos) {
+        tq_task_t *before = tq_find_todo(old, t->id);
+        if(!before) {
+            place(w, t, pos);
+            continue;
+        }
+        kept[num_kept] = t;
+        seq[num_kept++] = tq_todo_position(old, before);
+    }
+    find_moved(w, kept, seq, num_kept);
+    free(seq);
+    free(kept);
+    
+    return end_batch(w, old);
+}
+
+// Tasks added by the journal are only placed once it has all been replayed. Some of them may have
+// been done already, and were printed as such.
+static void place_followed(watch_t *w) {
+    size_t count = 0;
+    for(size_t i = 0; i < w->num_placed; ++i) {
+        const tq_task_t *task = w->placed[i].task;
+        if(task->done) continue;
+        w->placed[count++] = (placed_t){.task = task, .pos = tq_todo_position(w->tq, task)};
+    }
+    w->num_placed = count;
+}
+
+// Loads the queue at [path], or returns NULL after saying why it can't. A server keeps the queue
+// locked for as long as it runs, so we don't wait for the lock.
+static tq_t *load_queue(const char *path) {
+    if(!fs_file_exists(path)) {
+        check_tq(TQ_ERROR_NOT_FOUND, path);
+        return NULL;
+    }
+    tq_t *tq = safe_malloc(sizeof(*tq));
+    if(check_tq(tq_init_following(tq, path), path)) return tq;
+    tq_close(tq);
+    return NULL;
+}
+
+// Prints the changes made since the last refresh. Returns false if the watch can't go on.
+static bool refresh(watch_t *w) {
+    // Changes replayed before following failed are in the queue we compare with when loading it
+    // again, so they make up a batch of their own.
+    bool followed = tq_follow(w->tq, follow_change, w);
+    place_followed(w);
+    if(!end_batch(w, NULL)) return false;
+    if(followed) return true;
+    
+    tq_t *old = w->tq;
+    w->tq = load_queue(w->path);
+    if(!w->tq) {
+        w->tq = old;
+        return false;
+    }
+    bool ok = compare_queues(w, old, old->num_segments);
+    tq_close(old);
+    return ok;
+}
+
+#ifdef __linux__
+static bool is_queue_file(const watch_t *w, const char *name) {
+    return !strcmp(name, w->name) || !strcmp(name, w->journal_name);
+}
+
+// Sleeps until the queue or its journal is written to, moved or removed. Returns false if the
+// queue's directory is gone.
+static bool wait_for_change(const watch_t *w, int fd) {
+    // Aligned for the events in it.
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if(len < 0 && errno == EINTR) continue;
+        if(len <= 0) return false;
+    
+        // Everything that happened since we last looked comes in one read, and one refresh
+        // catches up with all of it.
+        bool changed = false;
+        for(char *cur = buffer; cur < buffer + len;) {
+            const struct inotify_event *event = (const struct inotify_event *)cur;
+            if(event->mask & IN_IGNORED) return false;
+            if(event->mask & IN_Q_OVERFLOW) changed = true;
+            if(event->len && is_queue_file(w, event->name)) changed = true;
+            cur += sizeof(struct inotify_event) + event->len;
+        }
+        if(changed) return true;
+    }
+}
+
+static int start_watching(const char *path) {
+    char *dir = fs_parent(path);
+    int fd = inotify_init1(IN_CLOEXEC);
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM;
+    if(fd >= 0 && inotify_add_watch(fd, dir && *dir ? dir : ".", mask) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    free(dir);
+    return fd;
+}
+#endif
+
+static void wait_poll(void) {
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = WATCH_POLL_MS * 1000000L};
+    while(nanosleep(&delay, &delay) < 0 && errno == EINTR) {}
+}
+
+int subcmd_watch(int argc, const char **argv) {
+    bool initial = false;
+    
+    term_arg_parser_t args;
+    term_arg_parser_init(&args, argc, argv);
+    
+    term_arg_result_t arg = term_arg_parse(&args, params, num_params);
+    
+    while(arg.name != TERM_ARG_DONE) {
+        switch(arg.name) {
+        case TERM_ARG_HELP:
+            subcmd_use("watch", use, "print changes to the queue as they are made", params, num_params);
+            return 0;
+    
+        case TERM_ARG_ERROR:
+            term_error(tq_prog_name, 1, "%s", args.error);
+            return -1;
+    
+        case 'i':
+            initial = true;
+            break;
+    
+        case TERM_ARG_POSITIONAL:
+            term_error(tq_prog_name, 0, "too many parameters");
+            subcmd_use("watch", use, "print changes to the queue as they are made", params, num_params);
+            return -1;
+        }
+        arg = term_arg_parse(&args, params, num_params);
+    }
+    
+    // Not forwarded to a server: it would be stuck running this for as long as we watch.
+    watch_t w;
+    memset(&w, 0, sizeof(w));
+    w.path = find_tq_path();
+    // TQ_DB can name a queue file that isn't called TQ_DB_NAME.
+    const char *sep = strrchr(w.path, '/');
+    w.name = sep ? sep + 1 : w.path;
+    size_t size = strlen(w.name) + strlen(TQ_JOURNAL_EXT) + 1;
+    w.journal_name = safe_calloc(size, 1);
+    snprintf(w.journal_name, size, "%s%s", w.name, TQ_JOURNAL_EXT);
+    
+    // Watching starts before loading, so that nothing written in between is missed.
+    int fd = -1;
+#ifdef __linux__
+    fd = start_watching(w.path);
+#endif
+    
+    w.tq = load_queue(w.path);
+    render_init(&w.out, stdout);
+    
+    bool ok = w.tq && (!initial || print_initial(&w));
+    while(ok) {
+#ifdef __linux__
+        if(fd >= 0 && !wait_for_change(&w, fd)) {
+            term_error(tq_prog_name, 0, "unable to watch %s anymore", w.path);
+            ok = false;
+            break;
+        }
+#endif
+        if(fd < 0) wait_poll();
+        ok = refresh(&w);
+    }
+    
+    if(fd >= 0) close(fd);
+    render_fini(&w.out);
+    tq_close(w.tq);
+    free(w.placed);
+    free(w.journal_name);
+    free(w.path);
+    return ok ? 0 : -1;
+}
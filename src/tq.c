@@ -7,196 +7,2347 @@
  * Licensed under the MIT License
  *===--------------------------------------------------------------------------------------------===
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // copy_file_range()
+#endif
 #include "tq.h"
+#include "binary.h"
+#include "render.h"
+#include "scan.h"
+#include "search.h"
+#include "trace.h"
 #include <utils/assert.h>
-#include <term/printing.h>
-#include <term/colors.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef TQ_HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define PARSER_DEBUG
 
-char *tq_get_db_path(const char *root) {
-    char *db_path = fs_make_path(root, TQ_DB_NAME, NULL);
-    if(fs_file_exists(db_path)) return db_path;
-    free(db_path);
+bool tq_parse_format(const char *name, tq_format_t *format) {
+    if(!strcmp(name, "text")) {
+        *format = TQ_FORMAT_TEXT;
+    } else if(!strcmp(name, "binary")) {
+        *format = TQ_FORMAT_BINARY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+void tq_init_new(tq_t *tq, const char *path) {
+    ASSERT(tq != NULL);
+    ASSERT(path != NULL);
+    
+    memset(tq, 0, sizeof(*tq));
+    // Queues can be opened from several threads at once, the parser has to be picked beforehand.
+    scan_impl();
+    
+    tq->path = safe_strdup(path);
+    tq->lock_fd = -1;
+    tq->map_fd = -1;
+    arena_init(&tq->arena);
+    list_create(&tq->todo, sizeof(tq_task_t), offsetof(tq_task_t, list_node));
+    list_create(&tq->done, sizeof(tq_task_t), offsetof(tq_task_t, list_node));
+    index_init(&tq->tasks);
+    order_create(&tq->positions, offsetof(tq_task_t, order_node));
+}
+
+
+#ifdef DEBUG_PARSER
+#define FAIL(e) \
+    do { \
+        fprintf(stderr, "error at line %u: %s\n", linenum, (e)); \
+        err = TQ_ERROR_INVALID_DB; \
+        goto errout; \
+    } while(0)
+#else
+#define FAIL(e) \
+    do { \
+        err = TQ_ERROR_INVALID_DB; \
+        goto errout; \
+    } while(0)
+#endif
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Tasks are checked for what the text format can hold whichever format they come from, so that a
+// queue can always be converted: IDs are fields between colons, descriptions the rest of a line.
+static bool valid_id(const char *id, size_t len) {
+    if(len < 1 || len > TQ_ID_MAX) return false;
+    for(size_t i = 0; i < len; ++i) {
+        unsigned char c = id[i];
+        if(c == ':' || c == ' ' || c < 0x20 || c == 0x7f) return false;
+    }
+    return true;
+}
+
+static bool valid_desc(const char *desc, size_t len) {
+    return len > 0 && !memchr(desc, '\n', len);
+}
+
+static const char *map_file(int fd, size_t *size) {
+    struct stat st;
+    *size = 0;
+    if(fstat(fd, &st) < 0 || st.st_size == 0) return NULL;
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) return NULL;
+    *size = st.st_size;
+    trace_mapped(*size);
+    return map;
+}
+
+static char *sibling_path(const tq_t *tq, const char *ext) {
+    size_t size = strlen(tq->path) + strlen(ext) + 1;
+    char *path = safe_calloc(size, 1);
+    snprintf(path, size, "%s%s", tq->path, ext);
+    return path;
+}
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while(size) {
+        ssize_t written = write(fd, data, size);
+        if(written < 0) return false;
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Splits the next ':'-separated field off the front of [*cur, end).
+static bool next_field(const char **cur, const char *end, const char **field, size_t *len) {
+    const char *sep = memchr(*cur, ':', end - *cur);
+    if(!sep) return false;
+    *field = *cur;
+    *len = sep - *cur;
+    *cur = sep + 1;
+    return true;
+}
+
+static bool field_is(const char *field, size_t len, const char *str) {
+    return len == strlen(str) && !memcmp(field, str, len);
+}
+
+static tq_task_t *find_task(const tq_t *tq, const char *id, size_t len) {
+    if(len < 1 || len > TQ_ID_MAX) return NULL;
+    tq_task_t *task = index_find(&tq->tasks, index_key(id, len));
+    if(task || !tq->loaded) return task;
+    
+    long rec = bin_find(tq->map, id, len);
+    return rec >= 0 ? &tq->loaded[rec] : NULL;
+}
+
+// Creates a task whose description is a view of [desc, desc+len) and adds it to the ID index.
+// The caller is responsible for placing it in the todo or done list.
+static tq_task_t *task_create(tq_t *tq, const char *id, size_t id_len,
+                              const char *desc, size_t desc_len) {
+    tq_task_t *task = arena_calloc(&tq->arena, 1, sizeof(*task));
+    memcpy(task->id, id, id_len);
+    task->desc = desc;
+    task->desc_len = desc_len;
+    task->done = false;
+    index_insert(&tq->tasks, index_key(id, id_len), task);
+    return task;
+}
+
+// Fills [task] in from the [i]th record of a binary snapshot, if that record is valid.
+static bool read_record(const char *map, const tq_bin_header_t *header, size_t i, tq_task_t *task) {
+    const tq_bin_record_t *rec = &bin_records(map)[i];
+    size_t id_len = strnlen(rec->id, TQ_BIN_ID_LEN);
+    bool done = rec->flags & TQ_BIN_DONE;
+    
+    if(!valid_id(rec->id, id_len)) return false;
+    if(rec->desc_offset > header->heap_size
+        || rec->desc_len > header->heap_size - rec->desc_offset) return false;
+    if(!valid_desc(bin_heap(map) + rec->desc_offset, rec->desc_len)) return false;
+    if(done != (i >= header->num_todo)) return false;
+    
+    memcpy(task->id, rec->id, id_len);
+    task->id[id_len] = '\0';
+    task->desc = bin_heap(map) + rec->desc_offset;
+    task->desc_len = rec->desc_len;
+    task->done = done;
+    return true;
+}
+
+// Tasks loaded from a binary queue aren't added to the ID index: find_task() looks them up through
+// the file's own sorted index instead, so loading is just filling in task structs.
+static tq_status_t load_binary(tq_t *tq) {
+    const tq_bin_header_t *header = bin_header(tq->map, tq->map_size);
+    if(!header) return TQ_ERROR_INVALID_DB;
+    
+    size_t count = (size_t)header->num_todo + header->num_done;
+    const tq_bin_record_t *records = bin_records(tq->map);
+    const uint32_t *index = bin_index(tq->map);
+    
+    tq->format = TQ_FORMAT_BINARY;
+    tq->loaded = arena_calloc(&tq->arena, count ? count : 1, sizeof(tq_task_t));
+    
+    for(size_t i = 0; i < count; ++i) {
+        if(index[i] >= count) return TQ_ERROR_INVALID_DB;
+        if(i && strncmp(records[index[i-1]].id, records[index[i]].id, TQ_BIN_ID_LEN) >= 0) {
+            return TQ_ERROR_INVALID_DB;
+        }
+        
+        tq_task_t *task = &tq->loaded[i];
+        if(!read_record(tq->map, header, i, task)) return TQ_ERROR_INVALID_DB;
+        list_insert_tail(task->done ? &tq->done : &tq->todo, task);
+    }
+    return TQ_OK;
+}
+
+// A line of a text snapshot, as views into the mapping.
+typedef struct {
+    const char  *id;
+    size_t      id_len;     // 0 for a blank line
+    const char  *desc;
+    size_t      desc_len;
+    bool        done;
+} line_t;
+
+// Parses the line at [*cur] and moves past it. Returns NULL if it's valid (or blank), and what's
+// wrong with it otherwise.
+static const char *next_line(const char **cur, const char *end, line_t *out) {
+    // The line and its separators are found in a single pass, a block at a time.
+    const char *seps[2];
+    int num_seps;
+    const char *line = *cur;
+    const char *line_end = scan_line(line, end, seps, 2, &num_seps);
+    *cur = line_end < end ? line_end + 1 : end;
+    out->id_len = 0;
+    
+    while(line < line_end && is_space(*line)) ++line;
+    while(line_end > line && is_space(line_end[-1])) --line_end;
+    if(line == line_end) return NULL;
+    if(num_seps < 2) return "not enough components";
+    
+    const char *status = line;
+    size_t status_len = seps[0] - line;
+    out->id = seps[0] + 1;
+    out->id_len = seps[1] - out->id;
+    out->desc = seps[1] + 1;
+    out->desc_len = line_end - out->desc;
+    
+    if(!valid_id(out->id, out->id_len)) return "invalid task ID";
+    if(!out->desc_len) return "invalid task description";
+    
+    if(status_len == 4 && !memcmp(status, "todo", 4)) {
+        out->done = false;
+    } else if(status_len == 4 && !memcmp(status, "done", 4)) {
+        out->done = true;
+    } else {
+        return "invalid task status";
+    }
+    return NULL;
+}
+
+#define ARCHIVE_PREFIX "archived:"
+#define COUNTS_PREFIX "tasks:"
+
+// What the first lines of a text snapshot say about it. Snapshots written by tq say how many
+// segments they rely on (see the archive section below), if any, and how many tasks they hold, so
+// that streaming doesn't have to count them first. Snapshots written by hand may say neither.
+typedef struct {
+    uint32_t    num_segments;
+    bool        has_counts;
+    size_t      num_todo;
+    size_t      num_done;
+} text_header_t;
+
+// Parses the number at [*cur] and moves past [sep], which follows it. A '\n' separator is the end
+// of the line, and is left for the caller.
+static bool header_number(const char **cur, const char *end, char sep, uint64_t max, uint64_t *value) {
+    const char *p = *cur;
+    uint64_t n = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p) {
+        unsigned digit = *p - '0';
+        if(n > (max - digit) / 10) return false;
+        n = n * 10 + digit;
+    }
+    if(p == *cur) return false;
+    if(sep == '\n' ? p < end && *p != '\n' && *p != '\r' : p == end || *p != sep) return false;
+    *cur = sep == '\n' ? p : p + 1;
+    *value = n;
+    return true;
+}
+
+// Returns where the header line at [cur] starting with [prefix] goes on, or NULL if it's not one.
+static const char *header_line(const char *cur, const char *end, const char *prefix) {
+    size_t len = strlen(prefix);
+    if(!cur || (size_t)(end - cur) < len || memcmp(cur, prefix, len)) return NULL;
+    return cur + len;
+}
+
+static const char *next_header(const char *cur, const char *end) {
+    const char *eol = memchr(cur, '\n', end - cur);
+    return eol ? eol + 1 : end;
+}
+
+// Returns where the tasks of a text snapshot start, past its header lines, and fills [header] in.
+static const char *text_body(const char *map, size_t size, text_header_t *header) {
+    text_header_t parsed = {.num_segments = 0, .has_counts = false};
+    const char *cur = map;
+    const char *end = map + size;
+    uint64_t segments, todo, done;
+    
+    const char *p = header_line(cur, end, ARCHIVE_PREFIX);
+    if(p && header_number(&p, end, '\n', UINT32_MAX, &segments)) {
+        parsed.num_segments = segments;
+        cur = next_header(p, end);
+    }
+    p = header_line(cur, end, COUNTS_PREFIX);
+    if(p && header_number(&p, end, ':', SIZE_MAX, &todo)
+        && header_number(&p, end, '\n', SIZE_MAX, &done)) {
+        parsed.has_counts = true;
+        parsed.num_todo = todo;
+        parsed.num_done = done;
+        cur = next_header(p, end);
+    }
+    
+    if(header) *header = parsed;
+    return cur;
+}
+
+/*
+ * Large text snapshots are parsed by several threads. The file is cut into chunks at line
+ * boundaries, and each thread fills in the tasks of its chunk and adds them to the ID index, which
+ * is sized up front so it never has to grow while they work. The lists are linked afterwards, in
+ * file order. If anything is wrong with the file, the queue is parsed again on a single thread, so
+ * errors are reported exactly the same way (the first invalid line, or the second occurrence of a
+ * duplicate ID).
+ */
+
+typedef struct {
+    tq_t        *tq;
+    const char  *start;
+    const char  *end;
+    tq_task_t   *tasks;     // room for every line of the chunk
+    size_t      count;      // tasks parsed
+    size_t      num_done;   // done tasks among them
+    bool        failed;
+} chunk_t;
+
+static void *parse_chunk(void *data) {
+    chunk_t *chunk = data;
+    const char *cur = chunk->start;
+    
+    while(cur < chunk->end) {
+        line_t line;
+        if(next_line(&cur, chunk->end, &line)) {
+            chunk->failed = true;
+            return NULL;
+        }
+        if(!line.id_len) continue;
+        
+        tq_task_t *task = &chunk->tasks[chunk->count];
+        memset(task, 0, sizeof(*task));
+        memcpy(task->id, line.id, line.id_len);
+        task->desc = line.desc;
+        task->desc_len = line.desc_len;
+        task->done = line.done;
+        chunk->num_done += line.done;
+        if(!index_insert_shared(&chunk->tq->tasks, index_key(line.id, line.id_len), task)) {
+            chunk->failed = true;
+            return NULL;
+        }
+        chunk->count += 1;
+    }
+    return NULL;
+}
+
+static int parse_threads(size_t size) {
+    if(size < TQ_PARALLEL_MIN_SIZE) return 1;
+    
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("TQ_THREADS");
+    if(env && *env) threads = strtol(env, NULL, 10);
+    
+    // Chunks that are too small cost more to hand out than they save.
+    if(threads > (long)(size / TQ_PARALLEL_MIN_CHUNK)) threads = size / TQ_PARALLEL_MIN_CHUNK;
+    if(threads > TQ_MAX_THREADS) threads = TQ_MAX_THREADS;
+    return threads > 1 ? (int)threads : 1;
+}
+
+// Returns false if the file needs a sequential parse: the queue is then left empty.
+static bool load_parallel(tq_t *tq, int num_threads) {
+    const char *end = tq->map + tq->map_size;
+    chunk_t chunks[TQ_MAX_THREADS];
+    size_t chunk_lines[TQ_MAX_THREADS];
+    pthread_t threads[TQ_MAX_THREADS];
+    bool started[TQ_MAX_THREADS] = {false};
+    
+    size_t max_tasks = 0;
+    text_header_t header;
+    const char *cur = text_body(tq->map, tq->map_size, &header);
+    for(int i = 0; i < num_threads; ++i) {
+        const char *split = tq->map + tq->map_size * (i + 1) / num_threads;
+        const char *nl = split > cur && split < end ? memchr(split, '\n', end - split) : NULL;
+        const char *chunk_end = i == num_threads - 1 || !nl ? end : nl + 1;
+        if(split <= cur) chunk_end = cur;
+        
+        chunks[i] = (chunk_t){.tq = tq, .start = cur, .end = chunk_end, .count = 0, .num_done = 0,
+            .failed = false};
+        chunk_lines[i] = 1 + scan_count(cur, chunk_end, '\n');
+        max_tasks += chunk_lines[i];
+        cur = chunk_end;
+    }
+    
+    tq_task_t *tasks = arena_alloc(&tq->arena, max_tasks * sizeof(tq_task_t));
+    index_reserve(&tq->tasks, max_tasks);
+    scan_impl();
+    
+    for(int i = 0; i < num_threads; ++i) {
+        chunks[i].tasks = tasks;
+        tasks += chunk_lines[i];
+    }
+    for(int i = 1; i < num_threads; ++i) {
+        // If we can't get a thread, the chunk is parsed on this one.
+        started[i] = pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]) == 0;
+        if(!started[i]) parse_chunk(&chunks[i]);
+    }
+    parse_chunk(&chunks[0]);
+    
+    bool ok = true;
+    size_t count = 0, num_done = 0;
+    for(int i = 0; i < num_threads; ++i) {
+        if(started[i]) pthread_join(threads[i], NULL);
+        ok = ok && !chunks[i].failed;
+        count += chunks[i].count;
+        num_done += chunks[i].num_done;
+    }
+    if(header.has_counts && (count - num_done != header.num_todo || num_done != header.num_done)) {
+        ok = false;
+    }
+    if(!ok) {
+        index_fini(&tq->tasks);
+        index_init(&tq->tasks);
+        return false;
+    }
+    
+    tq->tasks.count += count;
+    for(int i = 0; i < num_threads; ++i) {
+        for(size_t j = 0; j < chunks[i].count; ++j) {
+            tq_task_t *task = &chunks[i].tasks[j];
+            list_insert_tail(task->done ? &tq->done : &tq->todo, task);
+        }
+    }
+    return true;
+}
+
+static tq_status_t load_snapshot(tq_t *tq) {
+    if(bin_is_binary(tq->map, tq->map_size)) return load_binary(tq);
+    
+    int num_threads = parse_threads(tq->map_size);
+    if(num_threads > 1 && load_parallel(tq, num_threads)) return TQ_OK;
+    
+    text_header_t header;
+    const char *cur = text_body(tq->map, tq->map_size, &header);
+    const char *end = tq->map + tq->map_size;
+    
+    // Every line is at most one task, so this is enough to load the whole queue from a single
+    // arena chunk.
+    size_t max_tasks = 1 + scan_count(cur, end, '\n');
+    arena_reserve(&tq->arena, max_tasks, sizeof(tq_task_t));
+    index_reserve(&tq->tasks, max_tasks);
+    
+    // Descriptions are kept as views into the mapping: loading the queue only costs one task
+    // struct per line, and nothing gets copied unless a task is created or changed.
+    unsigned linenum = 0;
+    size_t num_todo = 0, num_done = 0;
+    tq_status_t err = TQ_OK;
+    
+    while(cur < end) {
+        ++linenum;
+        line_t line;
+        const char *error = next_line(&cur, end, &line);
+        if(error) FAIL(error);
+        if(!line.id_len) continue;
+        if(find_task(tq, line.id, line.id_len)) FAIL("duplicate task ID");
+        
+        tq_task_t *task = task_create(tq, line.id, line.id_len, line.desc, line.desc_len);
+        task->done = line.done;
+        if(line.done) {
+            list_insert_tail(&tq->done, task);
+            num_done += 1;
+        } else {
+            list_insert_tail(&tq->todo, task);
+            num_todo += 1;
+        }
+    }
+    
+    // Streaming trusts the counts, so a snapshot that was edited without fixing them is rejected.
+    if(header.has_counts && (num_todo != header.num_todo || num_done != header.num_done)) {
+        FAIL("task counts don't match the header");
+    }
+    return TQ_OK;
+errout:
+    return err;
+}
+
+/*
+ * The journal holds the changes made since the snapshot (.tqlist.txt) was last rewritten, so that
+ * adding or completing a task only costs a small append. It is a text file as well:
+ *
+ *      base:<snapshot inode>:<snapshot size>
+ *      front:<id>:<description>
+ *      back:<id>:<description>
+ *      after:<other id>:<id>:<description>
+ *      before:<other id>:<id>:<description>
+ *      done:<id>
+ *
+ * Records are replayed in order on top of the snapshot. The base line ties the journal to the one
+ * snapshot it was written against: if we crash after a compaction replaced the snapshot but before
+ * the journal was removed, the stale journal gets ignored instead of being applied twice.
+ */
+
+typedef enum {
+    PLACE_FRONT,
+    PLACE_BACK,
+    PLACE_AFTER,
+    PLACE_BEFORE,
+} place_t;
+
+static const char *const place_ops[] = {"front", "back", "after", "before"};
+
+static void place_task(tq_t *tq, tq_task_t *task, place_t place, tq_task_t *other) {
+    tq->has_by_id = false;
+    if(tq->has_positions) {
+        size_t pos = 0;
+        switch(place) {
+        case PLACE_FRONT: pos = 0; break;
+        case PLACE_BACK: pos = order_count(&tq->positions); break;
+        case PLACE_AFTER: pos = order_position(&tq->positions, other) + 1; break;
+        case PLACE_BEFORE: pos = order_position(&tq->positions, other); break;
+        }
+        order_insert_at(&tq->positions, task, pos);
+    }
+    
+    switch(place) {
+    case PLACE_FRONT: list_insert_head(&tq->todo, task); break;
+    case PLACE_BACK: list_insert_tail(&tq->todo, task); break;
+    case PLACE_AFTER: list_insert_after(&tq->todo, other, task); break;
+    case PLACE_BEFORE: list_insert_before(&tq->todo, other, task); break;
+    }
+}
+
+static void complete_task(tq_t *tq, tq_task_t *task) {
+    tq->has_by_id = false;
+    if(tq->has_positions) order_remove(&tq->positions, task);
+    list_remove(&tq->todo, task);
+    task->done = true;
+    list_insert_head(&tq->done, task);
+}
+
+// Changes are only turned into journal records when they get written. Until then, all we keep is
+// which tasks they apply to: a batch of new tasks doesn't hold a second copy of every description.
+#define OP_DONE (PLACE_BEFORE + 1)
+
+struct tq_op_t {
+    int         kind;   // a place_t, or OP_DONE
+    tq_task_t   *task;
+    tq_task_t   *other;
+};
+
+// How much a change adds to the journal, which tells tq_write() when to compact.
+static size_t op_size(const tq_op_t *op) {
+    if(op->kind == OP_DONE) return strlen("done:\n") + strlen(op->task->id);
+    size_t size = strlen(place_ops[op->kind]) + strlen(op->task->id) + op->task->desc_len + 3;
+    return op->other ? size + strlen(op->other->id) + 1 : size;
+}
+
+static void record_op(tq_t *tq, int kind, tq_task_t *task, tq_task_t *other) {
+    if(tq->num_pending == tq->pending_cap) {
+        tq->pending_cap = tq->pending_cap ? tq->pending_cap * 2 : 16;
+        tq->pending = safe_realloc(tq->pending, tq->pending_cap * sizeof(*tq->pending));
+    }
+    tq->pending[tq->num_pending] = (tq_op_t){.kind = kind, .task = task, .other = other};
+    tq->pending_size += op_size(&tq->pending[tq->num_pending]);
+    tq->num_pending += 1;
+}
+
+void tq_undo_adds(tq_t *tq, size_t num_pending) {
+    ASSERT(tq);
+    ASSERT(num_pending <= tq->num_pending);
+    
+    // Undone last to first, so that no task goes before the ones it was placed next to.
+    while(tq->num_pending > num_pending) {
+        const tq_op_t *op = &tq->pending[--tq->num_pending];
+        ASSERT(op->kind != OP_DONE);
+        tq_task_t *task = op->task;
+        tq->pending_size -= op_size(op);
+        tq->has_by_id = false;
+        if(tq->has_positions) order_remove(&tq->positions, task);
+        list_remove(&tq->todo, task);
+        index_remove(&tq->tasks, index_key(task->id, strlen(task->id)));
+    }
+}
+
+static void write_op(const tq_op_t *op, FILE *out) {
+    const tq_task_t *task = op->task;
+    if(op->kind == OP_DONE) {
+        fprintf(out, "done:%s\n", task->id);
+    } else if(op->other) {
+        fprintf(out, "%s:%s:%s:%.*s\n",
+            place_ops[op->kind], op->other->id, task->id, (int)task->desc_len, task->desc);
+    } else {
+        fprintf(out, "%s:%s:%.*s\n",
+            place_ops[op->kind], task->id, (int)task->desc_len, task->desc);
+    }
+}
+
+// Returns the task the record added or completed, or NULL if it isn't valid.
+static tq_task_t *replay_record(tq_t *tq, const char *rec, const char *end) {
+    const char *op, *id;
+    size_t op_len, id_len;
+    if(!next_field(&rec, end, &op, &op_len)) return NULL;
+    
+    if(field_is(op, op_len, "done")) {
+        tq_task_t *task = find_task(tq, rec, end - rec);
+        if(!task || task->done) return NULL;
+        complete_task(tq, task);
+        return task;
+    }
+    
+    place_t place = PLACE_FRONT;
+    while(place <= PLACE_BEFORE && !field_is(op, op_len, place_ops[place])) ++place;
+    if(place > PLACE_BEFORE) return NULL;
+    
+    tq_task_t *other = NULL;
+    if(place == PLACE_AFTER || place == PLACE_BEFORE) {
+        const char *other_id;
+        size_t other_len;
+        if(!next_field(&rec, end, &other_id, &other_len)) return NULL;
+        other = find_task(tq, other_id, other_len);
+        if(!other || other->done) return NULL;
+    }
+    
+    if(!next_field(&rec, end, &id, &id_len)) return NULL;
+    if(id_len > TQ_ID_MAX || id_len < 1 || rec == end) return NULL;
+    
+    if(find_task(tq, id, id_len)) return NULL;
+    tq_task_t *task = task_create(tq, id, id_len, rec, end - rec);
+    place_task(tq, task, place, other);
+    return task;
+}
+
+// Maps the journal and returns its first record, or NULL if there is no journal that applies to
+// the current snapshot.
+static const char *open_journal(tq_t *tq) {
+    char *path = sibling_path(tq, TQ_JOURNAL_EXT);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0) return NULL;
+    tq->journal_map = map_file(fd, &tq->journal_map_size);
+    close(fd);
+    
+    const char *cur = tq->journal_map;
+    const char *end = tq->journal_map + tq->journal_map_size;
+    const char *eol = cur ? memchr(cur, '\n', end - cur) : NULL;
+    if(!eol) return NULL;
+    
+    char base[64];
+    snprintf(base, sizeof(base), "base:%llu:%zu",
+        (unsigned long long)tq->snapshot_id, tq->snapshot_size);
+    if(!field_is(cur, eol - cur, base)) return NULL;
+    return eol + 1;
+}
+
+static tq_status_t load_journal(tq_t *tq) {
+    const char *cur = open_journal(tq);
+    if(!cur) return TQ_OK;
+    const char *end = tq->journal_map + tq->journal_map_size;
+    
+    // A record that doesn't end in a newline was torn by a crash mid-append. We don't replay it,
+    // and the next append truncates it away.
+    const char *eol;
+    while(cur < end && (eol = memchr(cur, '\n', end - cur))) {
+        if(!replay_record(tq, cur, eol)) return TQ_ERROR_INVALID_DB;
+        cur = eol + 1;
+    }
+    tq->journal_size = cur - tq->journal_map;
+    return TQ_OK;
+}
+
+// Takes the lock like tq_lock(), unless [wait] is false and somebody else holds it: the queue is
+// then left unlocked.
+static tq_status_t lock_queue(tq_t *tq, tq_access_t access, bool wait) {
+    ASSERT(tq);
+    ASSERT(tq->lock_fd < 0);
+    
+    // The snapshot itself gets replaced on every compaction, so locking it would only lock one
+    // version of the queue. Everyone locks a sibling file that never moves instead.
+    char *path = sibling_path(tq, TQ_LOCK_EXT);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0 && access == TQ_ACCESS_READ) fd = open(path, O_RDONLY);
+    free(path);
+    
+    if(fd < 0) {
+        // Readers can still go ahead on a read-only file system, they just don't get protected
+        // from concurrent writers (which couldn't write there anyway).
+        return access == TQ_ACCESS_READ ? TQ_OK : TQ_ERROR_LOCK;
+    }
+    
+    int op = (access == TQ_ACCESS_WRITE ? LOCK_EX : LOCK_SH) | (wait ? 0 : LOCK_NB);
+    int r;
+    while((r = flock(fd, op)) < 0 && errno == EINTR) {}
+    if(r < 0) {
+        bool busy = !wait && errno == EWOULDBLOCK;
+        close(fd);
+        return busy ? TQ_OK : TQ_ERROR_LOCK;
+    }
+    tq->lock_fd = fd;
+    tq->writable = access == TQ_ACCESS_WRITE;
+    return TQ_OK;
+}
+
+// Maps the snapshot, if there is one. Its identity is what ties the journal to it.
+static tq_status_t map_snapshot(tq_t *tq) {
+    if(!fs_file_exists(tq->path)) return TQ_OK;
+    
+    int fd = open(tq->path, O_RDONLY);
+    if(fd < 0) return TQ_ERROR_IO;
+    
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return TQ_ERROR_IO;
+    }
+    tq->has_snapshot = true;
+    tq->snapshot_id = st.st_ino;
+    tq->snapshot_size = st.st_size;
+    tq->map = map_file(fd, &tq->map_size);
+    tq->map_fd = fd;
+    
+    if(bin_is_binary(tq->map, tq->map_size)) {
+        const tq_bin_header_t *header = bin_header(tq->map, tq->map_size);
+        if(header) tq->num_segments = bin_segments(header);
+    } else {
+        text_header_t header;
+        text_body(tq->map, tq->map_size, &header);
+        tq->num_segments = header.num_segments;
+    }
+    return TQ_OK;
+}
+
+tq_status_t tq_lock(tq_t *tq, tq_access_t access) {
+    return lock_queue(tq, access, true);
+}
+
+static tq_status_t load_queue(tq_t *tq) {
+    tq_status_t err = map_snapshot(tq);
+    if(err != TQ_OK || !tq->has_snapshot) return err;
+    err = load_snapshot(tq);
+    if(err != TQ_OK) return err;
+    return load_journal(tq);
+}
+
+tq_status_t tq_init(tq_t *tq, const char *path, tq_access_t access) {
+    tq_init_new(tq, path);
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_status_t err = tq_lock(tq, access);
+    if(err == TQ_OK) err = load_queue(tq);
+    trace_enter(phase);
+    return err;
+}
+
+tq_status_t tq_init_following(tq_t *tq, const char *path) {
+    tq_init_new(tq, path);
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_status_t err = lock_queue(tq, TQ_ACCESS_READ, false);
+    if(err == TQ_OK) err = load_queue(tq);
+    tq_unlock(tq);
+    trace_enter(phase);
+    return err;
+}
+
+void tq_fini(tq_t *tq) {
+    ASSERT(tq != NULL);
+    
+#ifdef TQ_ALLOC_STATS
+    fprintf(stderr, "tq: %zu allocations from %zu heap blocks (%zu/%zu bytes used)\n",
+        tq->arena.num_allocs, tq->arena.num_chunks,
+        tq->arena.bytes_used, tq->arena.bytes_reserved);
+#endif
+    
+    // Tasks and descriptions all live in the arena, and the tree and lists are intrusive: there
+    // is nothing to unlink or free node by node, the whole queue goes away with its arena.
+    arena_fini(&tq->arena);
+    
+    if(tq->map) munmap((void *)tq->map, tq->map_size);
+    if(tq->map_fd >= 0) close(tq->map_fd);
+    if(tq->journal_map) munmap((void *)tq->journal_map, tq->journal_map_size);
+    free(tq->pending);
+    free(tq->claims);
+    free(tq->id_counters);
+    free(tq->reserved);
+    free(tq->by_id);
+    index_fini(&tq->tasks);
+    free(tq->path);
+    
+    // Closing the file releases the lock.
+    if(tq->lock_fd >= 0) close(tq->lock_fd);
+}
+
+void tq_unlock(tq_t *tq) {
+    ASSERT(tq != NULL);
+    if(tq->lock_fd >= 0) close(tq->lock_fd);
+    tq->lock_fd = -1;
+    tq->writable = false;
+}
+
+/*
+ * Other processes only ever append to the journal while the snapshot stays the same, so a reader
+ * can keep up with them by replaying whatever was appended past the last record it replayed, as
+ * load_journal() would have. The journal is read rather than mapped: nothing keeps a writer from
+ * truncating it, without the lock. Once the snapshot is replaced, the queue has to be loaded again.
+ */
+bool tq_follow(tq_t *tq, tq_change_fn changed, void *data) {
+    ASSERT(tq != NULL);
+    ASSERT(!tq->writable);
+    
+    struct stat st;
+    bool has_snapshot = stat(tq->path, &st) == 0;
+    if(has_snapshot != tq->has_snapshot) return false;
+    if(!has_snapshot) return true;
+    if((uint64_t)st.st_ino != tq->snapshot_id || (size_t)st.st_size != tq->snapshot_size) return false;
+    
+    char *path = sibling_path(tq, TQ_JOURNAL_EXT);
+    int fd = open(path, O_RDONLY);
+    int open_errno = errno;
+    free(path);
+    if(fd < 0) return open_errno == ENOENT && !tq->journal_size;
+    
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < tq->journal_size) {
+        close(fd);
+        return false;
+    }
+    
+    // The snapshot may have been compacted since we looked at it, and this be the journal of the
+    // new one: it only applies if it was started against ours.
+    char base[64], line[64];
+    int base_len = snprintf(base, sizeof(base), "base:%llu:%zu\n",
+        (unsigned long long)tq->snapshot_id, tq->snapshot_size);
+    ssize_t n = pread(fd, line, base_len, 0);
+    if(n < 0 || memcmp(line, base, n) || (n < base_len && tq->journal_size)) {
+        close(fd);
+        // With our snapshot still in place, a journal we haven't replayed anything from that was
+        // started against another one is stale (a compaction died before removing it), and was
+        // ignored when loading. There is nothing to follow until a writer starts it over.
+        return n >= 0 && !tq->journal_size && memcmp(line, base, n);
+    }
+    if(n < base_len) {
+        // Not even started yet.
+        close(fd);
+        return true;
+    }
+    
+    size_t size = st.st_size - tq->journal_size;
+    char *buffer = safe_malloc(size ? size : 1);
+    size_t got = 0;
+    n = 0;
+    while(got < size && (n = pread(fd, buffer + got, size - got, tq->journal_size + got)) > 0) {
+        got += n;
+    }
+    close(fd);
+    if(n < 0) {
+        free(buffer);
+        return false;
+    }
+    
+    // Torn or unfinished records are left for next time.
+    const char *cur = buffer;
+    const char *end = buffer + got;
+    while(end > cur && end[-1] != '\n') --end;
+    
+    if(!tq->journal_size) cur = end - cur >= base_len ? cur + base_len : end;
+    
+    // Replayed tasks keep pointing at their records, which have to live as long as the queue.
+    char *records = end > cur ? arena_alloc(&tq->arena, end - cur) : NULL;
+    if(records) memcpy(records, cur, end - cur);
+    const char *rec = records;
+    const char *rec_end = records + (end - cur);
+    bool ok = true;
+    const char *eol;
+    while(ok && rec < rec_end && (eol = memchr(rec, '\n', rec_end - rec))) {
+        tq_task_t *task = replay_record(tq, rec, eol);
+        ok = task != NULL;
+        if(ok && changed) changed(tq, task, data);
+        rec = eol + 1;
+    }
+    if(ok && end > buffer) tq->journal_size += (size_t)(end - buffer);
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Done tasks are moved out of the snapshot when it's compacted, into archive segments next to it
+ * (.tqlist.txt.done.1, .2...). Loading and rewriting the queue then only costs as much as its
+ * pending tasks, and segments are only read when done tasks are asked for. Segments are never
+ * changed once written; each holds the tasks completed between two compactions, in the snapshot's
+ * text format, most recently completed first: its header line says how many there are, so they can
+ * be counted without reading them all. They are compressed when tq is built with zlib.
+ *
+ * A snapshot records how many segments it relies on, so a segment is only part of the queue once
+ * the snapshot that moved its tasks out is in place: if we die in between, the segment is ignored,
+ * and overwritten by the next compaction. Text snapshots have it in an "archived:<count>" line
+ * before their task counts, binary ones in their header.
+ *
+ * Archived tasks must keep their IDs to themselves. For each counter length and what follows the
+ * counter in an ID (see the task IDs section), the newest segment has the highest counter archived
+ * so far in a "reserved:<digits>:<rest>:<next>" line after its task counts, or the whole ID if it's
+ * a bare mnemonic (with no digits). New IDs are checked against these too, which keeps counters
+ * above the archived ones. Each compaction carries them over to the segment it writes.
+ */
+
+#define RESERVED_PREFIX "reserved:"
+
+static mode_t snapshot_mode(const tq_t *tq) {
+    struct stat st;
+    if(stat(tq->path, &st) == 0) return st.st_mode & 0777;
+    return 0644;
+}
+
+static char *segment_path(const tq_t *tq, uint32_t n) {
+    char ext[32];
+    snprintf(ext, sizeof(ext), "%s.%u", TQ_ARCHIVE_EXT, n);
+    return sibling_path(tq, ext);
+}
+
+// Reads a whole segment, decompressing it if needed.
+static char *read_segment(const tq_t *tq, uint32_t n, size_t *size) {
+    char *path = segment_path(tq, n);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0) return NULL;
+    
+    size_t cap = 64 * 1024, used = 0;
+    char *data = safe_malloc(cap);
+    bool ok = true;
+#ifdef TQ_HAVE_ZLIB
+    // gzread() reads uncompressed files as they are, too.
+    gzFile in = gzdopen(fd, "rb");
+    ok = in != NULL;
+    while(ok) {
+        if(cap - used < 64 * 1024) data = safe_realloc(data, cap *= 2);
+        int r = gzread(in, data + used, (unsigned)(cap - used));
+        if(r <= 0) {
+            ok = r == 0;
+            break;
+        }
+        used += r;
+    }
+    if(in) {
+        gzclose(in);
+    } else {
+        close(fd);
+    }
+#else
+    for(;;) {
+        if(cap - used < 64 * 1024) data = safe_realloc(data, cap *= 2);
+        ssize_t r = read(fd, data + used, cap - used);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) {
+            ok = r == 0;
+            break;
+        }
+        used += r;
+    }
+    close(fd);
+    // Without zlib, compressed segments can't be read at all.
+    if(used >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b) ok = false;
+#endif
+    if(!ok) {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    return data;
+}
+
+// Segment headers are read a line at a time, without decompressing the rest.
+#ifdef TQ_HAVE_ZLIB
+typedef gzFile segment_file_t;
+
+static segment_file_t open_segment(const tq_t *tq, uint32_t n) {
+    char *path = segment_path(tq, n);
+    gzFile in = gzopen(path, "rb");
+    free(path);
+    return in;
+}
+
+static bool segment_line(segment_file_t in, char *line, size_t size) {
+    return gzgets(in, line, (int)size) != NULL;
+}
+
+static void close_segment(segment_file_t in) {
+    gzclose(in);
+}
+#else
+typedef FILE *segment_file_t;
+
+static segment_file_t open_segment(const tq_t *tq, uint32_t n) {
+    char *path = segment_path(tq, n);
+    FILE *in = fopen(path, "rb");
+    free(path);
+    return in;
+}
+
+static bool segment_line(segment_file_t in, char *line, size_t size) {
+    return fgets(line, (int)size, in) != NULL;
+}
+
+static void close_segment(segment_file_t in) {
+    fclose(in);
+}
+#endif
+
+// Finds the slot of [key] in an open-addressed table of counters, adding it with a counter of 0 if
+// it isn't there yet. [*count] is how many slots are used.
+static tq_id_counter_t *counter_slot(tq_id_counter_t **table, size_t *cap, size_t *count,
+                                     tq_key_t key) {
+    if(*count * 2 >= *cap) {
+        tq_id_counter_t *old = *table;
+        size_t old_cap = *cap;
+        *cap = old_cap ? old_cap * 2 : 64;
+        *table = safe_calloc(*cap, sizeof(**table));
+        
+        for(size_t i = 0; i < old_cap; ++i) {
+            if(!old[i].key) continue;
+            size_t slot = index_hash(old[i].key, *cap);
+            while((*table)[slot].key) slot = (slot + 1) & (*cap - 1);
+            (*table)[slot] = old[i];
+        }
+        free(old);
+    }
+    
+    size_t slot = index_hash(key, *cap);
+    while((*table)[slot].key && (*table)[slot].key != key) slot = (slot + 1) & (*cap - 1);
+    
+    tq_id_counter_t *counter = &(*table)[slot];
+    if(!counter->key) {
+        counter->key = key;
+        counter->next = 0;
+        *count += 1;
+    }
+    return counter;
+}
+
+static const tq_id_counter_t *find_counter(const tq_id_counter_t *table, size_t cap, tq_key_t key) {
+    if(!cap) return NULL;
+    size_t slot = index_hash(key, cap);
+    for(; table[slot].key; slot = (slot + 1) & (cap - 1)) {
+        if(table[slot].key == key) return &table[slot];
+    }
+    return NULL;
+}
+
+// Reservations are keyed by the number of digits, which no ID has as a character, followed by the
+// rest of the ID. Bare mnemonics are keyed by the ID itself.
+static tq_key_t reserved_key(const char *id, size_t digits) {
+    size_t len = strlen(id + digits);
+    if(!digits) return index_key(id, len);
+    
+    char key[TQ_ID_MAX];
+    ASSERT(digits + len <= TQ_ID_MAX && len > 0);
+    key[0] = (char)digits;
+    memcpy(key + 1, id + digits, len);
+    return index_key(key, len + 1);
+}
+
+// Keeps the counters of [digits] digits below [next], in IDs made of such a counter followed by
+// what [id] has after its own.
+static void reserve(tq_t *tq, const char *id, size_t digits, uint64_t next) {
+    tq_key_t key = reserved_key(id, digits);
+    tq_id_counter_t *r = counter_slot(&tq->reserved, &tq->reserved_cap, &tq->num_reserved, key);
+    if(r->next < next) r->next = next;
+}
+
+static int format_reserved(const tq_id_counter_t *r, char *line, size_t size) {
+    char key[sizeof(tq_key_t) + 1] = {0};
+    memcpy(key, &r->key, sizeof(tq_key_t));
+    unsigned digits = (unsigned char)key[0] < TQ_ID_MAX ? (unsigned char)key[0] : 0;
+    return snprintf(line, size, RESERVED_PREFIX "%u:%s:%llu\n",
+        digits, digits ? key + 1 : key, (unsigned long long)r->next);
+}
+
+static bool parse_reserved(tq_t *tq, const char *line) {
+    const char *end = line + strlen(line);
+    const char *p = header_line(line, end, RESERVED_PREFIX);
+    uint64_t digits, next;
+    if(!p || !header_number(&p, end, ':', TQ_ID_MAX - 1, &digits)) return false;
+    
+    // The counter's digits don't matter to the key, only how many there are.
+    char id[TQ_ID_MAX + 1];
+    size_t len = digits;
+    memset(id, '0', digits);
+    for(; p < end && isalnum((unsigned char)*p) && len < TQ_ID_MAX; ++p) id[len++] = *p;
+    id[len] = '\0';
+    if(len == digits || p == end || *(p++) != ':') return false;
+    if(!header_number(&p, end, '\n', UINT64_MAX, &next)) return false;
+    
+    reserve(tq, id, digits, next);
+    return true;
+}
+
+// Reads the IDs reserved by archived tasks the first time they're needed. The reservations of the
+// newest segment cover every older one.
+static void load_reserved(tq_t *tq) {
+    if(tq->has_reserved) return;
+    tq->has_reserved = true;
+    if(!tq->num_segments) return;
+    
+    segment_file_t in = open_segment(tq, tq->num_segments);
+    if(!in) return;
+    char line[64];
+    bool ok = segment_line(in, line, sizeof(line)) && header_line(line, line + strlen(line),
+        COUNTS_PREFIX);
+    while(ok && segment_line(in, line, sizeof(line))) ok = parse_reserved(tq, line);
+    close_segment(in);
+}
+
+typedef bool (*archive_visit_fn)(const tq_task_t *task, void *data);
+
+// Visits the tasks of segment [n], unless [*visiting] is false already or turned false by [visit].
+static tq_status_t visit_segment(const tq_t *tq, uint32_t n, archive_visit_fn visit, void *data,
+                                 bool *visiting) {
+    size_t size = 0;
+    char *segment = read_segment(tq, n, &size);
+    if(!segment) return TQ_ERROR_IO;
+    
+    text_header_t header;
+    const char *cur = text_body(segment, size, &header), *end = segment + size;
+    while(header_line(cur, end, RESERVED_PREFIX)) cur = next_header(cur, end);
+    size_t count = 0;
+    while(*visiting && cur < end) {
+        line_t line;
+        if(next_line(&cur, end, &line) || (line.id_len && !line.done)) {
+            free(segment);
+            return TQ_ERROR_INVALID_DB;
+        }
+        if(!line.id_len) continue;
+        
+        tq_task_t task = {.done = true, .desc = line.desc, .desc_len = line.desc_len};
+        memcpy(task.id, line.id, line.id_len);
+        count += 1;
+        *visiting = visit(&task, data);
+    }
+    free(segment);
+    
+    // Counting trusts the header.
+    if(*visiting && header.has_counts && (header.num_todo || header.num_done != count)) {
+        return TQ_ERROR_INVALID_DB;
+    }
+    return TQ_OK;
+}
+
+// Visits the tasks of every segment, newest first, until [visit] returns false.
+static tq_status_t visit_segments(const tq_t *tq, uint32_t num_segments, archive_visit_fn visit,
+                                  void *data) {
+    bool visiting = true;
+    for(uint32_t n = num_segments; n > 0 && visiting; --n) {
+        tq_status_t err = visit_segment(tq, n, visit, data, &visiting);
+        if(err != TQ_OK) return err;
+    }
+    return TQ_OK;
+}
+
+static bool count_archived(const tq_task_t *task, void *data) {
+    (void)task;
+    *(size_t *)data += 1;
+    return true;
+}
+
+// Reads how many tasks segment [n] holds from its header line, or counts them if it has none.
+static tq_status_t segment_count(const tq_t *tq, uint32_t n, size_t *count) {
+    char line[64];
+    segment_file_t in = open_segment(tq, n);
+    bool ok = in && segment_line(in, line, sizeof(line));
+    if(in) close_segment(in);
+    
+    text_header_t header;
+    if(ok) text_body(line, strlen(line), &header);
+    if(ok && header.has_counts) {
+        *count = header.num_done;
+        return TQ_OK;
+    }
+    *count = 0;
+    bool visiting = true;
+    return visit_segment(tq, n, count_archived, count, &visiting);
+}
+
+typedef struct {
+    tq_visitor_t visit;
+    void        *data;
+} archive_visit_t;
+
+static bool visit_archived(const tq_task_t *task, void *data) {
+    archive_visit_t *v = data;
+    return v->visit(task, 0, v->data);
+}
+
+tq_status_t tq_visit_archive(const tq_t *tq, tq_visitor_t visit, void *data) {
+    ASSERT(tq);
+    ASSERT(visit);
+    archive_visit_t v = {.visit = visit, .data = data};
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_status_t err = visit_segments(tq, tq->num_segments, visit_archived, &v);
+    trace_enter(phase);
+    return err;
+}
+
+// Writes the done list to segment [n], and makes it durable.
+static bool write_segment(const tq_t *tq, uint32_t n) {
+    char *path = segment_path(tq, n);
+    char *tmp_path = sibling_path(tq, TQ_ARCHIVE_EXT ".XXXXXX");
+    int fd = mkstemp(tmp_path);
+    bool ok = fd >= 0 && fchmod(fd, snapshot_mode(tq)) == 0;
+    size_t count = list_count(&tq->done);
+    
+#ifdef TQ_HAVE_ZLIB
+    // The segment is flushed through a second descriptor, so the first can still be synced.
+    gzFile out = ok ? gzdopen(dup(fd), "wb") : NULL;
+    ok = out != NULL && gzprintf(out, COUNTS_PREFIX "0:%zu\n", count) > 0;
+    for(size_t i = 0; ok && i < tq->reserved_cap; ++i) {
+        if(!tq->reserved[i].key) continue;
+        char line[64];
+        ok = gzwrite(out, line, format_reserved(&tq->reserved[i], line, sizeof(line))) > 0;
+    }
+    for(tq_task_t *t = list_head(&tq->done); ok && t; t = list_next(&tq->done, t)) {
+        ok = gzprintf(out, "done:%s:", t->id) > 0
+            && gzwrite(out, t->desc, t->desc_len) == (int)t->desc_len
+            && gzputc(out, '\n') == '\n';
+    }
+    if(out) ok = (gzclose(out) == Z_OK) && ok;
+#else
+    FILE *out = ok ? fdopen(dup(fd), "wb") : NULL;
+    ok = out != NULL && fprintf(out, COUNTS_PREFIX "0:%zu\n", count) > 0;
+    for(size_t i = 0; ok && i < tq->reserved_cap; ++i) {
+        if(!tq->reserved[i].key) continue;
+        char line[64];
+        ok = fwrite(line, format_reserved(&tq->reserved[i], line, sizeof(line)), 1, out) == 1;
+    }
+    for(tq_task_t *t = list_head(&tq->done); ok && t; t = list_next(&tq->done, t)) {
+        ok = fprintf(out, "done:%s:%.*s\n", t->id, (int)t->desc_len, t->desc) > 0;
+    }
+    if(out) ok = (fclose(out) == 0) && ok;
+#endif
+    
+    ok = ok && fsync(fd) == 0;
+    if(fd >= 0) close(fd);
+    ok = ok && rename(tmp_path, path) == 0;
+    if(!ok && fd >= 0) unlink(tmp_path);
+    free(tmp_path);
+    free(path);
+    return ok;
+}
+
+// Removes the segments past [count], which no snapshot relies on (left over from a failed
+// compaction, or from the queue that a reinitialised one replaced).
+static void remove_stale_segments(const tq_t *tq, uint32_t count) {
+    for(uint32_t n = count + 1;; ++n) {
+        char *path = segment_path(tq, n);
+        bool removed = unlink(path) == 0;
+        free(path);
+        if(!removed) break;
+    }
+}
+
+/*
+ * Streaming reads the queue without loading it: the snapshot is scanned in place and tasks are
+ * handed out one at a time, as views into the mapping. The journal can't be applied the same way,
+ * since its records place tasks relative to others, so it is replayed into an overlay instead:
+ *
+ *  - journal tasks live in chains, which are spliced into the snapshot's order while it's scanned:
+ *    the front and back chains, and the chains right before and right after each snapshot task;
+ *  - snapshot tasks the journal refers to (anchors) own those chains, and remember being done.
+ *
+ * The overlay only ever holds what the journal mentions, and compaction keeps the journal under
+ * TQ_JOURNAL_MAX_SIZE, so memory doesn't grow with the queue. Invalid records are caught while
+ * replaying, except for references to tasks the snapshot doesn't have: those are only noticed
+ * once the scan is over.
+ */
+
+typedef struct overlay_t {
+    tq_task_t   task;           // list_node links it in its chain
+    bool        in_journal;     // created by the journal, rather than a snapshot task it refers to
+    bool        seen;           // for anchors, found in the snapshot
+    list_t      *chain;         // for journal tasks, the chain they're in
+    list_t      before;         // for anchors, journal tasks right before and after them
+    list_t      after;
+    list_node_t done_node;
+} overlay_t;
+
+typedef struct {
+    tq_t        tq;             // the lock, mappings, and the overlay's arena and index
+    list_t      front;
+    list_t      back;
+    list_t      done;           // tasks completed by the journal, last completed first
+    size_t      num_added;
+    
+    bool        binary;
+    size_t      num_todo;
+    size_t      num_done;
+    size_t      snapshot_todo;  // pending tasks in the snapshot, as its header or count_text() says
+    
+    tq_visitor_t visit;
+    void        *data;
+    bool        visiting;       // false once the visitor is done with the current list
+    bool        need_anchors;   // the pending tasks must all be scanned, for the done ones
+    bool        scanned;        // all pending tasks were scanned
+    size_t      num_scanned;    // lines or records, since the mapping was last trimmed
+    const char  *trimmed;       // where the pages the scan hasn't dropped yet start
+    const char  *heap_trimmed;  // the same for descriptions, which binary snapshots keep apart
+} stream_t;
+
+#define STREAM_TRIM_INTERVAL (16 * 1024)
+
+static void drop_pages(const char **from, const char *to) {
+    uintptr_t mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    const char *start = (const char *)((uintptr_t)*from & ~mask);
+    const char *stop = (const char *)((uintptr_t)to & ~mask);
+    if(stop <= start) return;
+    madvise((void *)start, stop - start, MADV_DONTNEED);
+    *from = stop;
+}
+
+// Pages of the snapshot we've read stay resident, which would make a scan's footprint grow with
+// the file. Every so often, drop the ones the scan has moved past ([read_to] and [heap_read_to]
+// being how far it got): the mapping is private and never written to, so anything read again
+// (descriptions of anchors, say) just gets faulted back in from the page cache.
+static void stream_progress(stream_t *s, const char *read_to, const char *heap_read_to) {
+    if(++s->num_scanned < STREAM_TRIM_INTERVAL) return;
+    drop_pages(&s->trimmed, read_to);
+    if(heap_read_to) drop_pages(&s->heap_trimmed, heap_read_to);
+    s->num_scanned = 0;
+}
+
+static void chain_create(list_t *chain) {
+    list_create(chain, sizeof(overlay_t), offsetof(overlay_t, task.list_node));
+}
+
+static overlay_t *overlay_get(stream_t *s, const char *id, size_t len, bool create) {
+    if(len < 1 || len > TQ_ID_MAX) return NULL;
+    tq_key_t key = index_key(id, len);
+    overlay_t *o = index_find(&s->tq.tasks, key);
+    if(o || !create) return o;
+    
+    o = arena_calloc(&s->tq.arena, 1, sizeof(*o));
+    memcpy(o->task.id, id, len);
+    chain_create(&o->before);
+    chain_create(&o->after);
+    index_insert(&s->tq.tasks, key, o);
+    return o;
+}
+
+static bool overlay_record(stream_t *s, const char *rec, const char *end) {
+    const char *op, *id;
+    size_t op_len, id_len;
+    if(!next_field(&rec, end, &op, &op_len)) return false;
+    
+    if(field_is(op, op_len, "done")) {
+        overlay_t *o = overlay_get(s, rec, end - rec, true);
+        if(!o || o->task.done) return false;
+        o->task.done = true;
+        list_insert_head(&s->done, o);
+        return true;
+    }
+    
+    place_t place = PLACE_FRONT;
+    while(place <= PLACE_BEFORE && !field_is(op, op_len, place_ops[place])) ++place;
+    if(place > PLACE_BEFORE) return false;
+    
+    overlay_t *other = NULL;
+    if(place == PLACE_AFTER || place == PLACE_BEFORE) {
+        const char *other_id;
+        size_t other_len;
+        if(!next_field(&rec, end, &other_id, &other_len)) return false;
+        other = overlay_get(s, other_id, other_len, true);
+        if(!other || other->task.done) return false;
+    }
+    
+    if(!next_field(&rec, end, &id, &id_len)) return false;
+    if(id_len > TQ_ID_MAX || id_len < 1 || rec == end) return false;
+    if(overlay_get(s, id, id_len, false)) return false;
+    
+    overlay_t *o = overlay_get(s, id, id_len, true);
+    o->in_journal = true;
+    o->task.desc = rec;
+    o->task.desc_len = end - rec;
+    
+    switch(place) {
+    case PLACE_FRONT:
+        o->chain = &s->front;
+        list_insert_head(o->chain, o);
+        break;
+    case PLACE_BACK:
+        o->chain = &s->back;
+        list_insert_tail(o->chain, o);
+        break;
+    case PLACE_AFTER:
+        if(other->in_journal) {
+            o->chain = other->chain;
+            list_insert_after(o->chain, other, o);
+        } else {
+            o->chain = &other->after;
+            list_insert_head(o->chain, o);
+        }
+        break;
+    case PLACE_BEFORE:
+        if(other->in_journal) {
+            o->chain = other->chain;
+            list_insert_before(o->chain, other, o);
+        } else {
+            o->chain = &other->before;
+            list_insert_tail(o->chain, o);
+        }
+        break;
+    }
+    s->num_added += 1;
+    return true;
+}
+
+static tq_status_t load_overlay(stream_t *s) {
+    const char *cur = open_journal(&s->tq);
+    if(!cur) return TQ_OK;
+    const char *end = s->tq.journal_map + s->tq.journal_map_size;
+    
+    const char *eol;
+    while(cur < end && (eol = memchr(cur, '\n', end - cur))) {
+        if(!overlay_record(s, cur, eol)) return TQ_ERROR_INVALID_DB;
+        cur = eol + 1;
+    }
+    return TQ_OK;
+}
+
+static void emit(stream_t *s, const tq_task_t *task) {
+    if(s->visiting) s->visiting = s->visit(task, task->done ? s->num_done : s->num_todo, s->data);
+}
+
+static void emit_chain(stream_t *s, list_t *chain) {
+    for(overlay_t *o = list_head(chain); o; o = list_next(chain, o)) {
+        if(!o->task.done) emit(s, &o->task);
+    }
+}
+
+// Hands out a pending snapshot task, along with whatever the journal placed around it.
+static void emit_snapshot_task(stream_t *s, tq_task_t *task) {
+    overlay_t *o = NULL;
+    if(s->tq.tasks.count) o = index_find(&s->tq.tasks, index_key(task->id, strlen(task->id)));
+    if(!o) {
+        emit(s, task);
+        return;
+    }
+    
+    // Anchors that end up done are listed with the done tasks, so hold on to their description.
+    o->seen = true;
+    o->task.desc = task->desc;
+    o->task.desc_len = task->desc_len;
+    emit_chain(s, &o->before);
+    if(!o->task.done) emit(s, task);
+    emit_chain(s, &o->after);
+}
+
+// Counts the tasks in a text snapshot whose header doesn't. It's a much lighter pass than the scan
+// itself, and it means visitors know how many tasks they'll get before the first one.
+static void count_text(stream_t *s) {
+    const char *cur = text_body(s->tq.map, s->tq.map_size, NULL);
+    const char *end = s->tq.map + s->tq.map_size;
+    while(cur < end) {
+        while(cur < end && is_space(*cur)) ++cur;
+        if(end - cur > 5 && !memcmp(cur, "todo:", 5)) s->num_todo += 1;
+        if(end - cur > 5 && !memcmp(cur, "done:", 5)) s->num_done += 1;
+        const char *eol = memchr(cur, '\n', end - cur);
+        cur = eol ? eol + 1 : end;
+        stream_progress(s, cur, NULL);
+    }
+    s->trimmed = s->tq.map;
+}
+
+// Visits the snapshot's tasks that are pending if [done] is false, and done otherwise. Text
+// snapshots are written with their pending tasks first: [resume] is where the done tasks start (or
+// where the first pass stopped), so that listing both only scans the file once.
+static tq_status_t scan_text(stream_t *s, bool done, const char **resume) {
+    const char *cur = *resume;
+    const char *end = s->tq.map + s->tq.map_size;
+    bool found_done = false;
+    size_t num_pending = 0;
+    
+    while(cur < end) {
+        const char *start = cur;
+        if(!s->visiting && (done || !s->need_anchors)) {
+            if(!found_done) *resume = start;
+            return TQ_OK;
+        }
+        
+        line_t line;
+        if(next_line(&cur, end, &line)) return TQ_ERROR_INVALID_DB;
+        stream_progress(s, cur, NULL);
+        if(!line.id_len) continue;
+        
+        if(line.done && !found_done) {
+            found_done = true;
+            if(!done) *resume = start;
+        }
+        num_pending += !line.done;
+        if(line.done != done) continue;
+        
+        tq_task_t task = {.done = line.done, .desc = line.desc, .desc_len = line.desc_len};
+        memcpy(task.id, line.id, line.id_len);
+        if(done) {
+            emit(s, &task);
+        } else {
+            emit_snapshot_task(s, &task);
+        }
+    }
+    if(!found_done) *resume = end;
+    s->scanned = true;
+    
+    // Visitors were given the header's count: it has to be right.
+    if(!done && num_pending != s->snapshot_todo) return TQ_ERROR_INVALID_DB;
+    return TQ_OK;
+}
+
+static tq_status_t scan_binary(stream_t *s, bool done) {
+    const tq_bin_header_t *header = bin_header(s->tq.map, s->tq.map_size);
+    size_t start = done ? header->num_todo : 0;
+    size_t end = done ? (size_t)header->num_todo + header->num_done : header->num_todo;
     
-    char *parent = fs_parent(root);
-    if(!parent || !strlen(parent)) return NULL;
-    char *path = tq_get_db_path(parent);
-    free(parent);
-    return path;
+    for(size_t i = start; i < end; ++i) {
+        if(!s->visiting && (done || !s->need_anchors)) return TQ_OK;
+        tq_task_t task = {.done = false};
+        if(!read_record(s->tq.map, header, i, &task)) return TQ_ERROR_INVALID_DB;
+        stream_progress(s, (const char *)&bin_records(s->tq.map)[i + 1], task.desc + task.desc_len);
+        if(done) {
+            emit(s, &task);
+        } else {
+            emit_snapshot_task(s, &task);
+        }
+    }
+    s->scanned = true;
+    return TQ_OK;
 }
 
-static int task_cmp(const void *a, const void *b) {
-    const tq_task_t *ta = a, *tb = b;
-    int r = strcmp(ta->id, tb->id);
-    if(r < 0) return -1;
-    if(r > 0) return 1;
-    return 0;
+static bool stream_archived(const tq_task_t *task, void *data) {
+    stream_t *s = data;
+    emit(s, task);
+    return s->visiting;
 }
 
+// Maps the snapshot and replays the journal, which gives how many tasks the queue has.
+static tq_status_t stream_counts(stream_t *s) {
+    tq_t *tq = &s->tq;
+    tq_status_t err = map_snapshot(tq);
+    if(err != TQ_OK) return err;
+    
+    s->binary = bin_is_binary(tq->map, tq->map_size);
+    s->trimmed = tq->map;
+    if(s->binary) {
+        const tq_bin_header_t *header = bin_header(tq->map, tq->map_size);
+        if(!header) return TQ_ERROR_INVALID_DB;
+        s->num_todo = header->num_todo;
+        s->num_done = header->num_done;
+        s->trimmed = (const char *)bin_records(tq->map);
+        s->heap_trimmed = bin_heap(tq->map);
+    } else {
+        text_header_t header;
+        text_body(tq->map, tq->map_size, &header);
+        s->num_todo = header.num_todo;
+        s->num_done = header.num_done;
+        if(!header.has_counts) count_text(s);
+    }
+    s->snapshot_todo = s->num_todo;
+    
+    if(tq->has_snapshot && (err = load_overlay(s)) != TQ_OK) return err;
+    
+    // Everything the stream reads is in place now: the snapshot and the journal are mapped, and
+    // writers replace the snapshot rather than change it, and only append to the journal we
+    // replayed. Archive segments are never changed once written. Readers can be slow (tq list
+    // piped into a pager), and shouldn't hold writers off for as long as they read.
+    tq_unlock(tq);
+    size_t num_completed = 0;
+    for(overlay_t *o = list_head(&s->done); o; o = list_next(&s->done, o)) num_completed += 1;
+    if(num_completed > s->num_todo + s->num_added) return TQ_ERROR_INVALID_DB;
+    s->num_todo = s->num_todo + s->num_added - num_completed;
+    s->num_done += num_completed;
+    return TQ_OK;
+}
 
-void tq_init_new(tq_t *tq, const char *path) {
-    ASSERT(tq != NULL);
-    ASSERT(path != NULL);
+static tq_status_t stream_queue(stream_t *s, bool done) {
+    tq_t *tq = &s->tq;
+    tq_status_t err = stream_counts(s);
+    if(err != TQ_OK) return err;
     
-    memset(tq, 0, sizeof(*tq));
+    const char *resume = s->binary ? tq->map : text_body(tq->map, tq->map_size, NULL);
+    s->need_anchors = done && tq->tasks.count;
+    s->visiting = true;
+    emit_chain(s, &s->front);
+    err = s->binary ? scan_binary(s, false) : scan_text(s, false, &resume);
+    if(err != TQ_OK) return err;
+    emit_chain(s, &s->back);
     
-    tq->path = safe_strdup(path);
-    list_create(&tq->todo, sizeof(tq_task_t), offsetof(tq_task_t, list_node));
-    list_create(&tq->done, sizeof(tq_task_t), offsetof(tq_task_t, list_node));
-    avl_create(&tq->tasks, task_cmp, sizeof(tq_task_t), offsetof(tq_task_t, id_node));
+    // Every anchor must have been a pending task of the snapshot.
+    for(size_t i = 0; s->scanned && i < tq->tasks.capacity; ++i) {
+        overlay_t *o = tq->tasks.slots[i].value;
+        if(tq->tasks.slots[i].key && !o->in_journal && !o->seen) return TQ_ERROR_INVALID_DB;
+    }
+    if(!done) return TQ_OK;
+    
+    s->visiting = true;
+    if(!s->binary) s->trimmed = resume;
+    for(overlay_t *o = list_head(&s->done); o; o = list_next(&s->done, o)) emit(s, &o->task);
+    err = s->binary ? scan_binary(s, true) : scan_text(s, true, &resume);
+    if(err != TQ_OK || !s->visiting) return err;
+    return visit_segments(tq, tq->num_segments, stream_archived, s);
 }
 
+tq_status_t tq_stream(const char *path, bool done, tq_visitor_t visit, void *data) {
+    ASSERT(path);
+    ASSERT(visit);
+    
+    stream_t s = {.visit = visit, .data = data};
+    list_create(&s.done, sizeof(overlay_t), offsetof(overlay_t, done_node));
+    chain_create(&s.front);
+    chain_create(&s.back);
+    
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_init_new(&s.tq, path);
+    tq_status_t err = tq_lock(&s.tq, TQ_ACCESS_READ);
+    if(err == TQ_OK) err = stream_queue(&s, done);
+    tq_fini(&s.tq);
+    trace_enter(phase);
+    return err;
+}
 
-#ifdef DEBUG_PARSER
-#define FAIL(e) \
-    do { \
-        fprintf(stderr, "error at line %u: %s\n", linenum, (e)); \
-        err = TQ_ERROR_INVALID_DB; \
-        goto errout; \
-    } while(0)
-#else
-#define FAIL(e) \
-    do { \
-        err = TQ_ERROR_INVALID_DB; \
-        goto errout; \
-    } while(0)
-#endif
+tq_status_t tq_count_tasks(const char *path, bool archived, size_t *num_todo, size_t *num_done) {
+    ASSERT(path);
+    ASSERT(num_todo);
+    ASSERT(num_done);
+    
+    stream_t s = {.visit = NULL, .data = NULL};
+    list_create(&s.done, sizeof(overlay_t), offsetof(overlay_t, done_node));
+    chain_create(&s.front);
+    chain_create(&s.back);
+    
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_init_new(&s.tq, path);
+    tq_status_t err = tq_lock(&s.tq, TQ_ACCESS_READ);
+    if(err == TQ_OK) err = stream_counts(&s);
+    
+    size_t count = 0;
+    for(uint32_t n = 1; err == TQ_OK && archived && n <= s.tq.num_segments; ++n) {
+        err = segment_count(&s.tq, n, &count);
+        s.num_done += count;
+    }
+    *num_todo = s.num_todo;
+    *num_done = s.num_done;
+    tq_fini(&s.tq);
+    trace_enter(phase);
+    return err;
+}
 
-tq_status_t tq_init(tq_t *tq, const char *path) {
-    tq_init_new(tq, path);
-    if(!fs_file_exists(path)) return TQ_OK;
+/*
+ * Search goes through an inverted index of the snapshot, saved next to it (see search.h) and
+ * rebuilt whenever the queue is compacted, once it exists. The journal is the index's delta: it's
+ * small enough to be checked in full on every search, and it's replayed into the same overlay as
+ * when streaming, which says which of the snapshot's tasks have been completed since.
+ */
+
+// Indexes the tasks of the snapshot mapped at [map], and saves the index next to the queue.
+static bool save_search_index(const tq_t *tq, const char *map, size_t size, uint64_t snapshot_id) {
+    search_builder_t b;
+    search_builder_init(&b);
     
-    FILE *in = fopen(path, "rb");
-    if(!in) return TQ_ERROR_IO;
+    bool ok = true;
+    if(bin_is_binary(map, size)) {
+        const tq_bin_header_t *header = bin_header(map, size);
+        size_t count = header ? (size_t)header->num_todo + header->num_done : 0;
+        ok = header != NULL;
+        for(size_t i = 0; ok && i < count; ++i) {
+            tq_task_t task;
+            ok = read_record(map, header, i, &task);
+            if(ok) search_add(&b, i, task.desc, task.desc_len);
+        }
+    } else {
+        const char *cur = text_body(map, size, NULL), *end = map + size;
+        while(ok && cur < end) {
+            const char *start = cur;
+            line_t line;
+            ok = !next_line(&cur, end, &line);
+            if(ok && line.id_len) search_add(&b, start - map, line.desc, line.desc_len);
+        }
+    }
     
-    char *line = NULL;
-    size_t cap = 0;
-    unsigned linenum = 0;
-    tq_status_t err = TQ_OK;
+    char *path = sibling_path(tq, TQ_SEARCH_EXT);
+    char *tmp_path = sibling_path(tq, TQ_SEARCH_EXT ".XXXXXX");
+    int fd = ok ? mkstemp(tmp_path) : -1;
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if(out) {
+        // Unlike the snapshot, the index can always be rebuilt: it's not worth an fsync.
+        ok = search_write(&b, snapshot_id, size, out);
+        ok = ok && fchmod(fd, snapshot_mode(tq)) == 0;
+        ok = ok && fflush(out) == 0 && !ferror(out);
+        ok = (fclose(out) == 0) && ok;
+        ok = ok && rename(tmp_path, path) == 0;
+        if(!ok) unlink(tmp_path);
+    } else {
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        ok = false;
+    }
     
-    while(getline(&line, &cap, in) >= 0) {
-        ++linenum;
-        str_trim_space(line);
-        if(!strlen(line)) continue;
-        char *comps[3] = {NULL, NULL, NULL};
+    free(tmp_path);
+    free(path);
+    search_builder_fini(&b);
+    return ok;
+}
+
+// Maps the queue's search index, building it first if it's missing or was built from another
+// snapshot. Returns NULL if there's no up-to-date index and it can't be saved.
+static const char *open_search_index(const tq_t *tq, size_t *size) {
+    char *path = sibling_path(tq, TQ_SEARCH_EXT);
+    const char *map = NULL;
+    
+    for(int attempt = 0; attempt < 2 && !map; ++attempt) {
+        if(attempt && !save_search_index(tq, tq->map, tq->map_size, tq->snapshot_id)) break;
         
-        if(str_split_inplace(line, ':', comps, 3) != 3) FAIL("not enough components");
-        if(strlen(comps[1]) > TQ_ID_LEN || strlen(comps[1]) < 1) FAIL("invalid task ID");
-        if(!strlen(comps[2])) FAIL("invalid task description");
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) continue;
+        map = map_file(fd, size);
+        close(fd);
         
-        bool done = false;
-        if(!strcmp(comps[0], "todo")) {
-            done = false;
-        } else if(!strcmp(comps[0], "done")) {
-            done = true;
-        } else {
-            FAIL("invalid task status");
-        }
+        const search_header_t *header = search_header(map, *size);
+        if(header && header->snapshot_id == tq->snapshot_id && header->snapshot_size == tq->snapshot_size) break;
+        if(map) munmap((void *)map, *size);
+        map = NULL;
+    }
+    free(path);
+    return map;
+}
+
+// Returns the journal task added by [rec], or NULL if it doesn't add one.
+static overlay_t *journal_added(stream_t *s, const char *rec, const char *end) {
+    const char *op, *id;
+    size_t op_len, id_len;
+    if(!next_field(&rec, end, &op, &op_len) || field_is(op, op_len, "done")) return NULL;
+    if(field_is(op, op_len, place_ops[PLACE_AFTER]) || field_is(op, op_len, place_ops[PLACE_BEFORE])) {
+        if(!next_field(&rec, end, &id, &id_len)) return NULL;
+    }
+    if(!next_field(&rec, end, &id, &id_len)) return NULL;
+    return overlay_get(s, id, id_len, false);
+}
+
+typedef struct {
+    stream_t    *s;
+    const search_word_t *words;
+    size_t      num_words;
+    const uint64_t *hits;       // where matches may be in the snapshot, NULL to check every task
+    size_t      num_hits;
+} search_t;
+
+// Reads the snapshot task at [location], and returns where the next one is (for text snapshots),
+// or NULL if the snapshot doesn't have a task there.
+static const char *read_hit(search_t *q, uint64_t location, tq_task_t *task) {
+    const char *map = q->s->tq.map;
+    size_t size = q->s->tq.map_size;
+    memset(task, 0, sizeof(*task));
+    
+    if(q->s->binary) {
+        const tq_bin_header_t *header = bin_header(map, size);
+        if(location >= (uint64_t)header->num_todo + header->num_done) return NULL;
+        return read_record(map, header, location, task) ? map : NULL;
+    }
+    
+    if(location >= size) return NULL;
+    const char *cur = map + location;
+    line_t line = {.id_len = 0};
+    while(cur < map + size && !line.id_len) {
+        if(next_line(&cur, map + size, &line)) return NULL;
+    }
+    if(!line.id_len) return NULL;
+    memcpy(task->id, line.id, line.id_len);
+    task->done = line.done;
+    task->desc = line.desc;
+    task->desc_len = line.desc_len;
+    return cur;
+}
+
+// Visits the snapshot's matches that are pending if [done] is false, and done otherwise.
+static tq_status_t search_snapshot(search_t *q, bool done) {
+    stream_t *s = q->s;
+    const char *end = s->tq.map + s->tq.map_size;
+    size_t count = q->hits ? q->num_hits : SIZE_MAX;
+    if(!q->hits && s->binary) {
+        const tq_bin_header_t *header = bin_header(s->tq.map, s->tq.map_size);
+        count = (size_t)header->num_todo + header->num_done;
+    }
+    
+    const char *next = s->binary ? s->tq.map : text_body(s->tq.map, s->tq.map_size, NULL);
+    for(size_t i = 0; i < count && s->visiting; ++i) {
+        uint64_t location = q->hits ? q->hits[i] : s->binary ? i : (uint64_t)(next - s->tq.map);
         
-        avl_index_t where;
-        tq_task_t search = {.desc = NULL};
-        strncpy(search.id, comps[1], sizeof(search.id));
-        if(avl_find(&tq->tasks, &search, &where)) FAIL("duplicate task ID");
+        // Without an index, text snapshots are read line after line, up to the last task.
+        if(!q->hits && !s->binary) {
+            while(next < end && is_space(*next)) ++next;
+            if(next == end) break;
+            location = next - s->tq.map;
+        }
         
-        tq_task_t *task = safe_calloc(1, sizeof(*task));
-        strncpy(task->id, comps[1], sizeof(task->id));
-        task->desc = safe_strdup(comps[2]);
-        task->done = done;
+        tq_task_t task;
+        if(!(next = read_hit(q, location, &task))) return TQ_ERROR_INVALID_DB;
         
-        avl_insert(&tq->tasks, task, where);
-        if(done) {
-            list_insert_tail(&tq->done, task);
-        } else {
-            list_insert_tail(&tq->todo, task);
+        overlay_t *o = NULL;
+        if(s->tq.tasks.count) o = index_find(&s->tq.tasks, index_key(task.id, strlen(task.id)));
+        if(o && o->task.done && !task.done) {
+            // Completed by the journal: listed with the journal's done tasks.
+            o->seen = true;
+            o->task.desc = task.desc;
+            o->task.desc_len = task.desc_len;
+            continue;
         }
+        if(task.done != done) continue;
+        if(search_matches(task.desc, task.desc_len, q->words, q->num_words)) emit(s, &task);
     }
-    
-    if(line) free(line);
-    fclose(in);
     return TQ_OK;
-errout:
-    if(in) fclose(in);
-    if(line) free(line);
+}
+
+// Archived tasks aren't indexed: searching them means reading every segment.
+static bool search_archived(const tq_task_t *task, void *data) {
+    search_t *q = data;
+    if(search_matches(task->desc, task->desc_len, q->words, q->num_words)) emit(q->s, task);
+    return q->s->visiting;
+}
+
+static tq_status_t search_queue(stream_t *s, const char *query, bool done) {
+    tq_t *tq = &s->tq;
+    tq_status_t err = map_snapshot(tq);
+    if(err != TQ_OK || !tq->has_snapshot) return err;
+    
+    s->binary = bin_is_binary(tq->map, tq->map_size);
+    if(s->binary && !bin_header(tq->map, tq->map_size)) return TQ_ERROR_INVALID_DB;
+    if((err = load_overlay(s)) != TQ_OK) return err;
+    
+    search_t q = {.s = s};
+    search_word_t *words = NULL;
+    q.num_words = search_parse(query, &words);
+    q.words = words;
+    
+    // Without an index (on a read-only file system, say), every task gets checked instead.
+    size_t index_size = 0;
+    const char *index = open_search_index(tq, &index_size);
+    uint64_t *hits = index ? search_lookup(index, words, q.num_words, &q.num_hits) : NULL;
+    q.hits = hits;
+    if(index && !hits) err = TQ_ERROR_INVALID_DB;
+    
+    // Like a stream, the search has everything it reads mapped by now (the index is replaced by a
+    // rename as well), and doesn't hold writers off while visitors print results.
+    tq_unlock(tq);
+    s->visiting = true;
+    if(err == TQ_OK) err = search_snapshot(&q, false);
+    
+    // Tasks the journal added come after the snapshot's, in the order they were added. If the
+    // journal doesn't apply to the snapshot, none of its tasks made it to the overlay.
+    const char *journal_end = tq->journal_map + tq->journal_map_size;
+    const char *cur = tq->journal_map ? memchr(tq->journal_map, '\n', tq->journal_map_size) : NULL;
+    if(cur) cur += 1;
+    const char *eol;
+    while(err == TQ_OK && cur && cur < journal_end && (eol = memchr(cur, '\n', journal_end - cur))) {
+        overlay_t *o = journal_added(s, cur, eol);
+        if(o && !o->task.done && search_matches(o->task.desc, o->task.desc_len, words, q.num_words)) {
+            emit(s, &o->task);
+        }
+        cur = eol + 1;
+    }
+    
+    if(err == TQ_OK && done) {
+        s->visiting = true;
+        for(overlay_t *o = list_head(&s->done); o; o = list_next(&s->done, o)) {
+            if(!o->in_journal && !o->seen) continue;
+            if(search_matches(o->task.desc, o->task.desc_len, words, q.num_words)) emit(s, &o->task);
+        }
+        err = search_snapshot(&q, true);
+        if(err == TQ_OK && s->visiting) err = visit_segments(tq, tq->num_segments, search_archived, &q);
+    }
+    
+    free(hits);
+    free(words);
+    if(index) munmap((void *)index, index_size);
     return err;
 }
 
-void tq_fini(tq_t *tq) {
-    ASSERT(tq != NULL);
+tq_status_t tq_find(const char *path, const char *query, bool done, tq_visitor_t visit, void *data) {
+    ASSERT(path);
+    ASSERT(query);
+    ASSERT(visit);
     
-    while(list_remove_head(&tq->todo)) {}
-    while(list_remove_head(&tq->done)) {}
+    stream_t s = {.visit = visit, .data = data};
+    list_create(&s.done, sizeof(overlay_t), offsetof(overlay_t, done_node));
+    chain_create(&s.front);
+    chain_create(&s.back);
     
-    void *cookie = NULL;
-    tq_task_t *task = NULL;
-    while((task = avl_destroy_nodes(&tq->tasks, &cookie))) {
-        free(task->desc);
-        free(task);
+    trace_phase_t phase = trace_enter(TRACE_LOAD);
+    tq_init_new(&s.tq, path);
+    tq_status_t err = tq_lock(&s.tq, TQ_ACCESS_READ);
+    if(err == TQ_OK) err = search_queue(&s, query, done);
+    tq_fini(&s.tq);
+    trace_enter(phase);
+    return err;
+}
+
+// Makes a rename in the queue's directory durable.
+static void sync_parent_dir(const tq_t *tq) {
+    char *dir = fs_parent(tq->path);
+    int fd = dir ? open(strlen(dir) ? dir : ".", O_RDONLY) : -1;
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
+    free(dir);
+}
+
+/*
+ * Text snapshots are mostly rewritten from themselves. Tasks loaded from the current snapshot that
+ * still follow each other there are copied over as whole runs of lines, without being formatted
+ * again, by the kernel when it can (copy_file_range() even shares the data on file systems with
+ * reflinks). Only the tasks added or changed since, and the seams around them, cost anything per
+ * task, so rewriting a queue after a few changes costs a handful of copies.
+ */
+
+#define TEXT_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    const tq_t  *tq;
+    int         fd;
+    const char  *map;           // the current snapshot, if it's a text one
+    int         src;            // its descriptor, -1 once copying between files has failed
+    const char  *run;           // lines of the current snapshot waiting to be copied
+    size_t      run_len;
+    size_t      used;
+    bool        ok;
+    char        buffer[TEXT_BUFFER_SIZE];
+} text_writer_t;
+
+static void text_flush(text_writer_t *w) {
+    if(w->ok && w->used) w->ok = write_all(w->fd, w->buffer, w->used);
+    w->used = 0;
+}
+
+static void text_copy_run(text_writer_t *w) {
+    if(!w->run_len) return;
+    text_flush(w);
     
-    list_destroy(&tq->todo);
-    list_destroy(&tq->done);
-    avl_destroy(&tq->tasks);
+    off_t offset = w->run - w->map;
+    size_t left = w->run_len;
+#ifdef __linux__
+    while(w->ok && left && w->src >= 0) {
+        ssize_t copied = copy_file_range(w->src, &offset, w->fd, NULL, left, 0);
+        if(copied < 0 && errno == EINTR) continue;
+        if(copied <= 0) {
+            // Not supported here (or across these file systems): write from the mapping instead.
+            w->src = -1;
+            break;
+        }
+        left -= copied;
+    }
+#endif
+    if(w->ok && left) w->ok = write_all(w->fd, w->map + offset, left);
+    w->run_len = 0;
+}
+
+static void text_write(text_writer_t *w, const char *data, size_t len) {
+    text_copy_run(w);
+    if(w->used + len > TEXT_BUFFER_SIZE) text_flush(w);
+    if(len > TEXT_BUFFER_SIZE) {
+        if(w->ok) w->ok = write_all(w->fd, data, len);
+        return;
+    }
+    memcpy(w->buffer + w->used, data, len);
+    w->used += len;
+}
+
+// Returns the line of the current snapshot [task] was loaded from, if it's still what would be
+// written for it.
+static const char *snapshot_line(const text_writer_t *w, const tq_task_t *task, size_t *len) {
+    if(!w->map) return NULL;
+    uintptr_t start = (uintptr_t)w->map, end = start + w->tq->map_size;
+    uintptr_t desc = (uintptr_t)task->desc;
+    if(desc < start || desc >= end) return NULL;
     
-    free(tq->path);
+    size_t id_len = strlen(task->id);
+    if(desc - start < id_len + 6 || desc + task->desc_len >= end) return NULL;
+    const char *line = task->desc - id_len - 6;
+    const char *line_end = task->desc + task->desc_len;
+    if(*line_end != '\n' || line[5 + id_len] != ':') return NULL;
+    if(memcmp(line, task->done ? "done:" : "todo:", 5) || memcmp(line + 5, task->id, id_len)) return NULL;
+    *len = line_end + 1 - line;
+    return line;
 }
 
-static void write_task(const tq_task_t *task, FILE *out) {
-    fprintf(out, "%s:%s:%s\n", task->done ? "done" : "todo", task->id, task->desc);
+static void text_task(text_writer_t *w, const tq_task_t *task) {
+    size_t len;
+    const char *line = snapshot_line(w, task, &len);
+    if(line) {
+        if(w->run_len && w->run + w->run_len == line) {
+            w->run_len += len;
+        } else {
+            text_copy_run(w);
+            w->run = line;
+            w->run_len = len;
+        }
+        return;
+    }
+    
+    text_write(w, task->done ? "done:" : "todo:", 5);
+    text_write(w, task->id, strlen(task->id));
+    text_write(w, ":", 1);
+    text_write(w, task->desc, task->desc_len);
+    text_write(w, "\n", 1);
 }
 
-bool tq_write(const tq_t *tq) {
-    ASSERT(tq != NULL);
-    ASSERT(tq->path != NULL);
+static bool write_text(const tq_t *tq, int fd) {
+    text_writer_t *w = safe_malloc(sizeof(*w));
+    w->tq = tq;
+    w->fd = fd;
+    w->map = tq->map && !bin_is_binary(tq->map, tq->map_size) ? tq->map : NULL;
+    w->src = tq->map_fd;
+    w->run_len = 0;
+    w->used = 0;
+    w->ok = true;
     
-    FILE *out = fopen(tq->path, "wb");
-    if(!out) return false;
+    char header[64];
+    if(tq->num_segments) {
+        text_write(w, header, snprintf(header, sizeof(header), ARCHIVE_PREFIX "%u\n", tq->num_segments));
+    }
+    text_write(w, header, snprintf(header, sizeof(header), COUNTS_PREFIX "%zu:%zu\n",
+        list_count(&tq->todo), list_count(&tq->done)));
+    for(tq_task_t *t = list_head(&tq->todo); t != NULL; t = list_next(&tq->todo, t)) text_task(w, t);
+    for(tq_task_t *t = list_head(&tq->done); t != NULL; t = list_next(&tq->done, t)) text_task(w, t);
+    text_copy_run(w);
+    text_flush(w);
+    
+    bool ok = w->ok;
+    free(w);
+    return ok;
+}
+
+// Queues that have been searched keep their index in step with the snapshot. Failing to is fine:
+// the index no longer matches the snapshot, and the next search rebuilds it.
+static void update_search_index(const tq_t *tq) {
+    char *path = sibling_path(tq, TQ_SEARCH_EXT);
+    bool indexed = fs_file_exists(path);
+    free(path);
+    
+    int fd = indexed ? open(tq->path, O_RDONLY) : -1;
+    if(fd < 0) return;
+    size_t size = 0;
+    const char *map = map_file(fd, &size);
+    struct stat st;
+    if(map && fstat(fd, &st) == 0) save_search_index(tq, map, size, st.st_ino);
+    if(map) munmap((void *)map, size);
+    close(fd);
+}
+
+// Writes the queue to a new snapshot, which replaces the current one. Fills [st] in with its identity.
+static bool write_snapshot(tq_t *tq, struct stat *st) {
+    // The new snapshot is written to a temporary file and renamed over the old one once it is
+    // safely on disk, so the queue is either entirely the old one or entirely the new one, even if
+    // we die halfway through. It also means tasks loaded from the current file can keep pointing
+    // into its mapping while we write.
+    char *tmp_path = sibling_path(tq, ".XXXXXX");
+    int fd = mkstemp(tmp_path);
+    FILE *out = fd >= 0 && tq->format == TQ_FORMAT_BINARY ? fdopen(fd, "wb") : NULL;
+    if(fd < 0 || (tq->format == TQ_FORMAT_BINARY && !out)) {
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return false;
+    }
+    
+    // Binary snapshots go through stdio, text ones are written straight to the file.
+    bool ok = out ? bin_write(tq, out) : write_text(tq, fd);
+    
+    ok = ok && (!out || (fflush(out) == 0 && !ferror(out)));
+    ok = ok && fchmod(fd, snapshot_mode(tq)) == 0;
+    ok = ok && fsync(fd) == 0 && fstat(fd, st) == 0;
+    ok = (out ? fclose(out) == 0 : close(fd) == 0) && ok;
+    ok = ok && rename(tmp_path, tq->path) == 0;
+    if(!ok) unlink(tmp_path);
+    free(tmp_path);
+    if(ok) sync_parent_dir(tq);
+    return ok;
+}
+
+static void reserve_archived_id(tq_t *tq, const tq_task_t *task);
+
+static bool compact(tq_t *tq) {
+    // Done tasks go to a new archive segment, which has to be on disk before the snapshot that
+    // relies on it replaces the current one. Until then, they stay in the done list.
+    uint32_t num_segments = tq->num_segments;
+    list_t archived;
+    list_create(&archived, sizeof(tq_task_t), offsetof(tq_task_t, list_node));
+    if(list_head(&tq->done)) {
+        // The new segment reserves the IDs of the older ones, and of the tasks it archives.
+        load_reserved(tq);
+        for(tq_task_t *t = list_head(&tq->done); t; t = list_next(&tq->done, t)) {
+            reserve_archived_id(tq, t);
+        }
+        if(!write_segment(tq, num_segments + 1)) return false;
+        tq->num_segments += 1;
+        for(tq_task_t *t; (t = list_head(&tq->done));) {
+            list_remove(&tq->done, t);
+            list_insert_tail(&archived, t);
+        }
+    }
+    
+    struct stat st;
+    if(!write_snapshot(tq, &st)) {
+        for(tq_task_t *t; (t = list_head(&archived));) {
+            list_remove(&archived, t);
+            list_insert_tail(&tq->done, t);
+        }
+        tq->num_segments = num_segments;
+        return false;
+    }
+    remove_stale_segments(tq, tq->num_segments);
+    
+    // The snapshot now has everything the journal had. If we die before removing it, the base
+    // line won't match the new snapshot anymore, and it won't be replayed.
+    char *journal_path = sibling_path(tq, TQ_JOURNAL_EXT);
+    unlink(journal_path);
+    free(journal_path);
+    
+    tq->has_snapshot = true;
+    tq->snapshot_id = st.st_ino;
+    tq->snapshot_size = st.st_size;
+    tq->journal_size = 0;
+    update_search_index(tq);
+    tq->num_pending = 0;
+    tq->pending_size = 0;
+    return true;
+}
+
+static bool journal_append(tq_t *tq) {
+    char *path = sibling_path(tq, TQ_JOURNAL_EXT);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    free(path);
+    if(fd < 0) return false;
     
-    for(tq_task_t *t = list_head(&tq->todo); t != NULL; t = list_next(&tq->todo, t)) {
-        write_task(t, out);
+    size_t size = tq->journal_size;
+    bool ok = true;
+    if(!size) {
+        char base[64];
+        int len = snprintf(base, sizeof(base), "base:%llu:%zu\n",
+            (unsigned long long)tq->snapshot_id, tq->snapshot_size);
+        ok = ftruncate(fd, 0) == 0 && write_all(fd, base, len);
+        size = len;
+    } else {
+        // Drops anything past the last record we replayed (i.e. a torn record).
+        ok = ftruncate(fd, size) == 0 && lseek(fd, size, SEEK_SET) >= 0;
+    }
+    FILE *out = ok ? fdopen(fd, "wb") : NULL;
+    if(!out) {
+        close(fd);
+        return false;
     }
     
-    for(tq_task_t *t = list_head(&tq->done); t != NULL; t = list_next(&tq->done, t)) {
-        write_task(t, out);
+    for(size_t i = 0; i < tq->num_pending; ++i) {
+        write_op(&tq->pending[i], out);
     }
+    ok = fflush(out) == 0 && !ferror(out);
+    ok = ok && fsync(fd) == 0;
+    ok = (fclose(out) == 0) && ok;
+    if(!ok) return false;
     
-    fclose(out);
+    tq->journal_size = size + tq->pending_size;
+    tq->num_pending = 0;
+    tq->pending_size = 0;
     return true;
 }
 
-static avl_index_t unique_id(tq_t *tq, char *id) {
-    avl_index_t where;
-    tq_task_t search = {0};
-    strncpy(search.id, id, sizeof(search.id));
-    unsigned disc = 0;
+bool tq_compact(tq_t *tq) {
+    ASSERT(tq != NULL);
+    ASSERT(tq->path != NULL);
+    
+    trace_phase_t phase = trace_enter(TRACE_WRITE);
+    bool ok = compact(tq);
+    trace_enter(phase);
+    return ok;
+}
+
+bool tq_write(tq_t *tq) {
+    ASSERT(tq != NULL);
+    ASSERT(tq->path != NULL);
+    
+    if(!tq->num_pending) return true;
+    trace_phase_t phase = trace_enter(TRACE_WRITE);
+    bool ok = !tq->has_snapshot || tq->journal_size + tq->pending_size > TQ_JOURNAL_MAX_SIZE
+        ? compact(tq) : journal_append(tq);
+    trace_enter(phase);
+    return ok;
+}
+
+/*
+ * Task IDs start out as the initials of the task's description (the mnemonic), up to TQ_ID_LEN
+ * characters. When that is taken, a base-36 counter is prepended and the mnemonic truncated to
+ * keep the ID short: "abcd", "0abc", "1abc"... "zabc", "10ab"... Once the counter needs all of
+ * TQ_ID_LEN, IDs grow, up to TQ_ID_MAX characters, which gives each mnemonic billions of IDs.
+ *
+ * Each mnemonic remembers the next counter to try, so allocating an ID is O(1) expected. The first
+ * time a mnemonic is used in a process we don't know its counter yet; since counters are handed
+ * out in order, the ones in use are (nearly) a prefix of 0, 1, 2... and the first free one is
+ * found with an exponential and a binary search, in O(log n) lookups. IDs of archived tasks count
+ * as taken too, through the reservations of the newest archive segment.
+ */
+
+static const char base36[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static uint64_t max_counter(void) {
+    uint64_t max = 1;
+    for(int i = 0; i < TQ_ID_MAX - 1; ++i) max *= 36;
+    return max - 1;
+}
+
+// Returns how many digits the counter takes up at the start of the ID.
+static size_t make_id(char *id, const char *mnemonic, uint64_t counter) {
+    char digits[TQ_ID_MAX];
+    int n = 0;
+    do {
+        digits[n++] = base36[counter % 36];
+        counter /= 36;
+    } while(counter);
+    ASSERT(n < TQ_ID_MAX);
+    size_t num_digits = n;
+    
+    int len = n + 1 > TQ_ID_LEN ? n + 1 : TQ_ID_LEN;
+    int i = 0;
+    while(n) id[i++] = digits[--n];
+    while(i < len && *mnemonic) id[i++] = *(mnemonic++);
+    id[i] = '\0';
+    return num_digits;
+}
+
+// Whether [id], which starts with a counter of [digits] digits (or none), was archived.
+static bool id_archived(tq_t *tq, const char *id, size_t digits, uint64_t counter) {
+    load_reserved(tq);
+    const tq_id_counter_t *r = find_counter(tq->reserved, tq->reserved_cap,
+        reserved_key(id, digits));
+    return r && counter < r->next;
+}
+
+static bool id_taken(tq_t *tq, const char *mnemonic, uint64_t counter) {
+    char id[TQ_ID_MAX + 1];
+    size_t digits = make_id(id, mnemonic, counter);
+    return find_task(tq, id, strlen(id)) || id_archived(tq, id, digits, counter);
+}
+
+static uint64_t first_free_counter(tq_t *tq, const char *mnemonic) {
+    uint64_t max = max_counter();
+    if(!id_taken(tq, mnemonic, 0)) return 0;
     
-    while(avl_find(&tq->tasks, &search, &where)) {
-        snprintf(search.id, sizeof(search.id), "%u%s", disc, id);
-        ++disc;
-        ASSERT(disc < 99);
+    uint64_t lo = 0, hi = 1; // lo is taken, hi might not be
+    while(hi < max && id_taken(tq, mnemonic, hi)) {
+        lo = hi;
+        hi = hi > max / 2 ? max : hi * 2 + 1;
     }
+    while(hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(id_taken(tq, mnemonic, mid)) lo = mid;
+        else hi = mid;
+    }
+    return hi;
+}
+
+static uint64_t *id_counter(tq_t *tq, const char *mnemonic) {
+    size_t num_counters = tq->num_id_counters;
+    tq_id_counter_t *counter = counter_slot(&tq->id_counters, &tq->id_counters_cap,
+        &tq->num_id_counters, index_key(mnemonic, strlen(mnemonic)));
+    if(tq->num_id_counters != num_counters) counter->next = first_free_counter(tq, mnemonic);
+    return &counter->next;
+}
+
+static void unique_id(tq_t *tq, const char *mnemonic, char *id) {
+    strncpy(id, mnemonic, TQ_ID_MAX + 1);
+    if(!find_task(tq, id, strlen(id)) && !id_archived(tq, id, 0, 0)) return;
     
-    strncpy(id, search.id, TQ_ID_LEN+1);
-    return where;
+    uint64_t *next = id_counter(tq, mnemonic);
+    for(;;) {
+        ASSERT(*next <= max_counter());
+        uint64_t counter = (*next)++;
+        if(!id_taken(tq, mnemonic, counter)) {
+            make_id(id, mnemonic, counter);
+            return;
+        }
+    }
 }
 
-static void create_id(char *id, const char *desc) {
+static void create_mnemonic(char *mnemonic, const char *desc, size_t desc_len) {
     ASSERT(desc);
+    const char *end = desc + desc_len;
     unsigned n = 0;
     bool in_space = true;
-    while(*desc && n < TQ_ID_LEN) {
+    while(desc < end && n < TQ_ID_LEN) {
         char c = *(desc++);
         if(isspace(c)) {
             in_space = true;
             continue;
         }
         
-        if(in_space) {
-            id[n++] = tolower(c);
+        // Only letters and digits: anything else could clash with the queue's file formats.
+        if(in_space && isalnum(c)) {
+            mnemonic[n++] = tolower(c);
+            in_space = false;
+        }
+    }
+    if(!n) mnemonic[n++] = 't';
+    mnemonic[n] = '\0';
+}
+
+// Reserves the ID of a task that is being archived, as made from the mnemonic of its description.
+// IDs that it doesn't make (written by hand) could have been made from any counter they start with,
+// and are reserved for each of them, as well as whole.
+static void reserve_archived_id(tq_t *tq, const tq_task_t *task) {
+    char mnemonic[TQ_ID_LEN + 1];
+    char id[TQ_ID_MAX + 1];
+    create_mnemonic(mnemonic, task->desc, task->desc_len);
+    if(!strcmp(task->id, mnemonic)) {
+        reserve(tq, task->id, 0, 1);
+        return;
+    }
+    
+    size_t len = strlen(task->id);
+    uint64_t counter = 0;
+    for(size_t digits = 1; digits < len; ++digits) {
+        const char *digit = strchr(base36, task->id[digits - 1]);
+        if(!digit) break;
+        counter = counter * 36 + (uint64_t)(digit - base36);
+        if(make_id(id, mnemonic, counter) == digits && !strcmp(id, task->id)) {
+            reserve(tq, task->id, digits, counter + 1);
+            return;
         }
-        in_space = false;
     }
+    
+    counter = 0;
+    for(size_t digits = 1; digits < len; ++digits) {
+        const char *digit = strchr(base36, task->id[digits - 1]);
+        if(!digit || (digits > 1 && !counter)) break;
+        counter = counter * 36 + (uint64_t)(digit - base36);
+        reserve(tq, task->id, digits, counter + 1);
+    }
+    reserve(tq, task->id, 0, 1);
 }
 
 static tq_task_t *task_new(tq_t *tq, const char *desc) {
@@ -204,60 +2355,73 @@ static tq_task_t *task_new(tq_t *tq, const char *desc) {
     ASSERT(desc);
     ASSERT(strlen(desc) > 0);
     
-    char id[TQ_ID_LEN + 1];
-    create_id(id, desc);
-    avl_index_t where = unique_id(tq, id);
+    char mnemonic[TQ_ID_LEN + 1];
+    char id[TQ_ID_MAX + 1];
+    create_mnemonic(mnemonic, desc, strlen(desc));
+    unique_id(tq, mnemonic, id);
     
-    tq_task_t *task = safe_calloc(1, sizeof(*task));
-    strncpy(task->id, id, sizeof(task->id));
-    task->desc = safe_strdup(desc);
-    task->done = false;
-    avl_insert(&tq->tasks, task, where);
-    return task;
+    size_t desc_len = strlen(desc);
+    return task_create(tq, id, strlen(id), arena_strndup(&tq->arena, desc, desc_len), desc_len);
 }
 
-tq_task_t *tq_add_front(tq_t *tq, const char *desc) {
+static tq_task_t *add_task(tq_t *tq, const char *desc, place_t place, const char *other_id) {
     ASSERT(tq);
     ASSERT(desc);
     ASSERT(strlen(desc) > 0);
     
+    tq_task_t *other = NULL;
+    if(other_id) {
+        other = find_task(tq, other_id, strlen(other_id));
+        if(!other || other->done) return NULL;
+    }
+    
     tq_task_t *task = task_new(tq, desc);
-    list_insert_head(&tq->todo, task);
+    place_task(tq, task, place, other);
+    record_op(tq, place, task, other);
     return task;
 }
 
+tq_task_t *tq_add_front(tq_t *tq, const char *desc) {
+    return add_task(tq, desc, PLACE_FRONT, NULL);
+}
+
 tq_task_t *tq_add_back(tq_t *tq, const char *desc) {
-    ASSERT(tq);
-    ASSERT(desc);
-    ASSERT(strlen(desc) > 0);
-    
-    tq_task_t *task = task_new(tq, desc);
-    list_insert_tail(&tq->todo, task);
-    return task;
+    return add_task(tq, desc, PLACE_BACK, NULL);
 }
 
 tq_task_t *tq_add_after(tq_t *tq, const char *desc, const char *node_id) {
-    ASSERT(tq);
-    ASSERT(desc);
-    ASSERT(strlen(desc) > 0);
-    tq_task_t *other = avl_find(&tq->tasks, node_id, NULL);
-    if(!other || other->done) return NULL;
-    
-    tq_task_t *task = task_new(tq, desc);
-    list_insert_after(&tq->todo, other, task);
-    return task;
-    
+    ASSERT(node_id);
+    return add_task(tq, desc, PLACE_AFTER, node_id);
 }
 
 tq_task_t *tq_add_before(tq_t *tq, const char *desc, const char *node_id) {
+    ASSERT(node_id);
+    return add_task(tq, desc, PLACE_BEFORE, node_id);
+}
+
+// Most commands never need positions, so the todo list is only indexed on demand. From then on,
+// place_task() and complete_task() keep the index up to date.
+static order_t *positions(tq_t *tq) {
+    if(!tq->has_positions) {
+        order_build(&tq->positions, &tq->todo);
+        tq->has_positions = true;
+    }
+    return &tq->positions;
+}
+
+tq_task_t *tq_add_at(tq_t *tq, const char *desc, size_t pos) {
     ASSERT(tq);
     ASSERT(desc);
     ASSERT(strlen(desc) > 0);
-    tq_task_t *other = avl_find(&tq->tasks, node_id, NULL);
-    if(!other || other->done) return NULL;
+    
+    // Journal records only know about neighbours, so this is stored as an insertion before
+    // whichever task is at [pos] right now.
+    tq_task_t *other = order_nth(positions(tq), pos);
+    place_t place = other ? PLACE_BEFORE : PLACE_BACK;
     
     tq_task_t *task = task_new(tq, desc);
-    list_insert_before(&tq->todo, other, task);
+    place_task(tq, task, place, other);
+    record_op(tq, place, task, other);
     return task;
 }
 
@@ -265,31 +2429,119 @@ tq_task_t *tq_mark_done(tq_t *tq, const char *id) {
     ASSERT(tq);
     ASSERT(id);
     
-    tq_task_t *task = avl_find(&tq->tasks, id, NULL);
+    tq_task_t *task = find_task(tq, id, strlen(id));
     if(!task || task->done) return NULL;
     
-    list_remove(&tq->todo, task);
-    task->done = true;
-    list_insert_head(&tq->done, task);
+    complete_task(tq, task);
+    record_op(tq, OP_DONE, task, NULL);
     return task;
 }
 
-void tq_print_task(tq_task_t *task, FILE *out) {
-    ASSERT(task);
-    ASSERT(out);
+tq_task_t *tq_find_todo(tq_t *tq, const char *id) {
+    ASSERT(tq);
+    ASSERT(id);
+    
+    tq_task_t *task = find_task(tq, id, strlen(id));
+    return task && !task->done ? task : NULL;
+}
+
+typedef struct {
+    uint64_t    key;
+    tq_task_t   *task;
+} id_entry_t;
+
+// IDs are at most 8 bytes: read as a big-endian number, a zero-padded ID sorts like the string.
+static uint64_t id_sort_key(const char *id) {
+    uint64_t key = 0;
+    for(size_t i = 0; i < TQ_ID_MAX; ++i) key = (key << 8) | (unsigned char)id[i];
+    return key;
+}
+
+static int id_entry_cmp(const void *a, const void *b) {
+    uint64_t ka = ((const id_entry_t *)a)->key, kb = ((const id_entry_t *)b)->key;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// Like positions, the ID order of the todo list is only built when it's needed. It isn't kept up
+// to date though: any change to the todo list drops it, and the next lookup sorts it again.
+static tq_task_t **todo_by_id(tq_t *tq) {
+    if(tq->has_by_id) return tq->by_id;
+    
+    size_t count = 0;
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t)) count += 1;
+    id_entry_t *entries = safe_malloc((count ? count : 1) * sizeof(*entries));
+    size_t n = 0;
+    for(tq_task_t *t = list_head(&tq->todo); t; t = list_next(&tq->todo, t)) {
+        entries[n++] = (id_entry_t){.key = id_sort_key(t->id), .task = t};
+    }
+    qsort(entries, count, sizeof(*entries), id_entry_cmp);
+    
+    tq->by_id = safe_realloc(tq->by_id, (count ? count : 1) * sizeof(*tq->by_id));
+    for(size_t i = 0; i < count; ++i) tq->by_id[i] = entries[i].task;
+    free(entries);
+    tq->num_by_id = count;
+    tq->has_by_id = true;
+    return tq->by_id;
+}
+
+size_t tq_todo_with_prefix(tq_t *tq, const char *prefix, tq_task_t *const **tasks) {
+    ASSERT(tq);
+    ASSERT(prefix);
+    ASSERT(tasks);
+    
+    tq_task_t **by_id = todo_by_id(tq);
+    size_t len = strlen(prefix);
+    *tasks = by_id;
+    if(len > TQ_ID_MAX) return 0;
     
-    fprintf(out, "[");
-    term_set_fg(out, TERM_BRIGHT_YELLOW);
-    fprintf(out, "%-*s", TQ_ID_LEN, task->id);
-    term_style_reset(out);
-    fprintf(out, "] %s", task->desc);
+    // Every ID that starts with the prefix sorts between the prefix itself and the prefix padded
+    // with 0xff bytes.
+    char low[TQ_ID_MAX] = {0}, high[TQ_ID_MAX];
+    memset(high, 0xff, sizeof(high));
+    memcpy(low, prefix, len);
+    memcpy(high, prefix, len);
+    uint64_t low_key = id_sort_key(low), high_key = id_sort_key(high);
     
-    if(task->done) {
-        fprintf(out, " [");
-        term_set_fg(out, TERM_BRIGHT_GREEN);
-        fprintf(out, "✔");
-        term_style_reset(out);
-        fprintf(out, "]");
+    size_t lo = 0, hi = tq->num_by_id;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(id_sort_key(by_id[mid]->id) < low_key) lo = mid + 1;
+        else hi = mid;
     }
-    fprintf(out, "\n");
+    size_t first = lo;
+    hi = tq->num_by_id;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if(id_sort_key(by_id[mid]->id) <= high_key) lo = mid + 1;
+        else hi = mid;
+    }
+    *tasks = by_id + first;
+    return lo - first;
+}
+
+size_t tq_num_todo(tq_t *tq) {
+    ASSERT(tq);
+    return order_count(positions(tq));
+}
+
+tq_task_t *tq_todo_at(tq_t *tq, size_t pos) {
+    ASSERT(tq);
+    return order_nth(positions(tq), pos);
+}
+
+size_t tq_todo_position(tq_t *tq, const tq_task_t *task) {
+    ASSERT(tq);
+    ASSERT(task);
+    ASSERT(!task->done);
+    return order_position(positions(tq), task);
+}
+
+void tq_print_task(const tq_task_t *task, FILE *out) {
+    ASSERT(task);
+    ASSERT(out);
+    
+    render_t r;
+    render_init(&r, out);
+    render_task(&r, task);
+    render_fini(&r);
 }
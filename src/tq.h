@@ -12,57 +12,221 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <utils/helpers.h>
-#include <utils/avl.h>
 #include <utils/list.h>
+#include "arena.h"
+#include "index.h"
+#include "libtq.h"
+#include "order.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// The inside of libtq, which the tq command is built on. Programs using libtq only need libtq.h.
+
 #define TQ_DB_NAME ".tqlist.txt"
+#define TQ_DB_ENV "TQ_DB"
+#define TQ_JOURNAL_EXT ".journal"
+#define TQ_LOCK_EXT ".lock"
+#define TQ_SEARCH_EXT ".search"
+#define TQ_ARCHIVE_EXT ".done"
+#define TQ_CLAIMS_EXT ".claims"
+
+// New task IDs are kept to TQ_ID_LEN characters for as long as possible, and only grow (up to
+// TQ_ID_MAX) once a mnemonic has used up its short IDs.
+#ifndef TQ_ID_LEN
 #define TQ_ID_LEN (4)
+#endif
+
+// Once the journal grows past this, the next write folds it back into the snapshot.
+#ifndef TQ_JOURNAL_MAX_SIZE
+#define TQ_JOURNAL_MAX_SIZE (256 * 1024)
+#endif
+
+// Text snapshots bigger than this are parsed by several threads: TQ_THREADS in the environment sets
+// how many (1 turns it off), and it defaults to the number of CPUs, up to TQ_MAX_THREADS.
+#ifndef TQ_PARALLEL_MIN_SIZE
+#define TQ_PARALLEL_MIN_SIZE (8 * 1024 * 1024)
+#endif
+#define TQ_PARALLEL_MIN_CHUNK (1024 * 1024)
+#define TQ_MAX_THREADS (16)
 
 typedef struct tq_task_t {
-    char        id[TQ_ID_LEN+1];
-    char        *desc;
+    char        id[TQ_ID_MAX+1];
     bool        done;
     
-    avl_node_t  id_node;
+    const char  *desc;      // not NUL-terminated, always use desc_len
+    size_t      desc_len;
+    
     list_node_t list_node;
+    order_node_t order_node;    // only valid for pending tasks, once positions are needed
 } tq_task_t;
 
+typedef struct tq_op_t tq_op_t;
+
+typedef struct tq_claim_t {
+    char        id[TQ_ID_SIZE];
+    int64_t     expiry;     // in seconds since the epoch
+    char        holder[TQ_HOLDER_MAX + 1];
+} tq_claim_t;
+
+typedef struct tq_id_counter_t {
+    tq_key_t    key;        // a mnemonic, 0 for an empty slot
+    uint64_t    next;
+} tq_id_counter_t;
+
 typedef struct tq_t {
     char        *path;
+    tq_format_t format;     // used when the snapshot is rewritten
+    int         lock_fd;
+    bool        writable;   // locked for writing
+    const char  *map;
+    size_t      map_size;
+    int         map_fd;     // the snapshot that is mapped, which compaction copies from
+    const char  *journal_map;
+    size_t      journal_map_size;
     
     list_t      todo;
     list_t      done;
-    avl_tree_t  tasks;
+    tq_index_t  tasks;      // by ID, except for tasks loaded from a binary snapshot
+    tq_task_t   *loaded;    // tasks loaded from a binary snapshot, in record order
+    order_t     positions;  // todo, indexed by position: built the first time it's needed
+    bool        has_positions;
+    tq_task_t   **by_id;    // todo, sorted by ID: built when needed, dropped when todo changes
+    size_t      num_by_id;
+    bool        has_by_id;
+    
+    arena_t     arena;      // owns every task and description created for this queue
+    
+    tq_id_counter_t *id_counters;   // open-addressed, by mnemonic
+    size_t      id_counters_cap;
+    size_t      num_id_counters;
+    tq_id_counter_t *reserved;      // IDs of archived tasks, read from the newest segment when needed
+    size_t      reserved_cap;
+    size_t      num_reserved;
+    bool        has_reserved;
+    
+    bool        has_snapshot;
+    uint32_t    num_segments;   // archive segments holding the tasks completed before the snapshot
+    uint64_t    snapshot_id;    // inode of the snapshot the journal applies to
+    size_t      snapshot_size;
+    size_t      journal_size;   // valid bytes in the journal, 0 if it must be started over
+    
+    tq_op_t     *pending;       // changes not written to the journal yet
+    size_t      num_pending;
+    size_t      pending_cap;
+    size_t      pending_size;   // bytes the pending changes will take up in the journal
+    
+    tq_claim_t  *claims;        // read from the claims file the first time they're needed
+    size_t      num_claims;
+    size_t      claims_cap;
+    bool        has_claims;
 } tq_t;
 
-typedef enum tq_status_t {
-    TQ_OK = 0,
-    TQ_ERROR_IO,
-    TQ_ERROR_INVALID_DB,
-} tq_status_t;
-
 
+// Looks for a queue in [current] and each of its parents, up to the root.
 char *tq_get_db_path(const char *current);
+// Returns the queue named by TQ_DB (a queue file, or a directory holding one), or NULL if the
+// variable isn't set. The queue doesn't have to exist.
+char *tq_env_db_path(void);
+// Finds the queue that applies to [dir]: the one named by TQ_DB if that is set, or the closest one
+// up the directory tree otherwise. Answers are cached across runs, see discover.c.
+char *tq_find_db(const char *dir);
+// Drops cached answers for [dir] and the directories under it, after a queue is created there.
+void tq_forget_dbs(const char *dir);
+bool tq_parse_format(const char *name, tq_format_t *format);
 
 void tq_init_new(tq_t *tq, const char *path);
-tq_status_t tq_init(tq_t *tq, const char *path);
+tq_status_t tq_init(tq_t *tq, const char *path, tq_access_t access);
+// Takes the queue's advisory lock. tq_init() does this before loading anything, and the lock is
+// released by tq_fini().
+tq_status_t tq_lock(tq_t *tq, tq_access_t access);
+// Releases the lock early, for a reader that keeps the queue loaded without holding writers off.
+void tq_unlock(tq_t *tq);
 void tq_fini(tq_t *tq);
-bool tq_write(const tq_t *tq);
+
+// Loads the queue for reading and releases the lock, like tq_init() followed by tq_unlock(), but
+// without waiting for a writer to be done: a server never is. The queue is then loaded without the
+// lock, which is safe since snapshots are replaced whole and journals only appended to. What gets
+// loaded is the queue as it was at some point, which tq_follow() catches up with.
+tq_status_t tq_init_following(tq_t *tq, const char *path);
+
+// Called by tq_follow() for each task the journal added or completed.
+typedef void (*tq_change_fn)(tq_t *tq, const tq_task_t *task, void *data);
+// Catches a queue loaded for reading up with the changes other processes wrote to it since, which
+// are applied to it as they would be by loading it again, calling [changed] after each one. Returns
+// false if the queue was compacted or replaced since, in which case it has to be loaded again.
+bool tq_follow(tq_t *tq, tq_change_fn changed, void *data);
+
+// Persists the changes made since the queue was loaded, appending them to the journal, or
+// rewriting the snapshot when the journal has grown too large.
+bool tq_write(tq_t *tq);
+// Rewrites the snapshot and discards the journal. Lines of a text snapshot that haven't changed
+// are copied over as they are, rather than formatted again.
+bool tq_compact(tq_t *tq);
 
 tq_task_t *tq_add_front(tq_t *tq, const char *desc);
 tq_task_t *tq_add_back(tq_t *tq, const char *desc);
 tq_task_t *tq_add_after(tq_t *tq, const char *desc, const char *node);
 tq_task_t *tq_add_before(tq_t *tq, const char *desc, const char *node);
 
+// Called by tq_stream() for each task, with the number of tasks in its list (pending or done).
+// Returning false skips the rest of that list.
+typedef bool (*tq_visitor_t)(const tq_task_t *task, size_t count, void *data);
+
+// Visits the pending tasks of the queue at [path] in order, then its done tasks if [done] is set,
+// archived ones included, without loading the queue: tasks are only valid for the duration of the
+// call, and memory use doesn't depend on the size of the queue (archive segments are read one at
+// a time). The count given with done tasks doesn't include archived ones.
+tq_status_t tq_stream(const char *path, bool done, tq_visitor_t visit, void *data);
+
+// Counts the pending and done tasks of the queue at [path], archived ones too if [archived] is set,
+// from the headers of the snapshot and segments and the journal, without reading any task.
+tq_status_t tq_count_tasks(const char *path, bool archived, size_t *num_todo, size_t *num_done);
+
+// Visits the tasks of the queue at [path] that have every word of [query], pending ones first, then
+// done ones if [done] is set. Words match whole words of a description, regardless of case, or any
+// word they start if they end with '*'. Pending tasks are visited in the order of the last
+// compaction, followed by the ones added since, and visitors always get a count of 0.
+tq_status_t tq_find(const char *path, const char *query, bool done, tq_visitor_t visit, void *data);
+
+// Visits the archived tasks of a loaded queue: the ones completed before it was last compacted,
+// which aren't part of its done list. They are visited most recently completed first, and are only
+// valid for the duration of the call. Visitors get a count of 0.
+tq_status_t tq_visit_archive(const tq_t *tq, tq_visitor_t visit, void *data);
+
+// Adds a task so that it ends up at [pos] in the todo list (0 is the front). Anything past the end
+// of the list adds it at the back.
+tq_task_t *tq_add_at(tq_t *tq, const char *desc, size_t pos);
+
 tq_task_t *tq_mark_done(tq_t *tq, const char *id);
 
-void tq_print_task(tq_task_t *task, FILE *out);
+// Takes back the tasks added since the queue had [num_pending] changes waiting to be written, which
+// must all be additions. The tasks are gone, as if they had never been added.
+void tq_undo_adds(tq_t *tq, size_t num_pending);
+
+// Returns the pending task with ID [id], or NULL if there isn't one.
+tq_task_t *tq_find_todo(tq_t *tq, const char *id);
+// Returns the claim on the pending task [id] if it hasn't expired, or NULL.
+const tq_claim_t *tq_find_claim(tq_t *tq, const char *id);
+// Reads the claims of the queue at [path] that haven't expired, sorted by ID, without loading the
+// queue: some may be on tasks that aren't pending anymore. [*claims] is to be freed.
+tq_status_t tq_read_claims(const char *path, tq_claim_t **claims, size_t *count);
+// Finds the pending tasks whose ID starts with [prefix], in O(log n) once the todo list has been
+// sorted by ID (which any change to the list undoes). Returns how many there are, and points
+// [*tasks] at the first of them, in ID order. They stay valid until the queue changes.
+size_t tq_todo_with_prefix(tq_t *tq, const char *prefix, tq_task_t *const **tasks);
+
+// Positions in the todo list, 0 being the front. All of these are O(log n), except for the first
+// call on a queue, which indexes its todo list in O(n).
+size_t tq_num_todo(tq_t *tq);
+tq_task_t *tq_todo_at(tq_t *tq, size_t pos);
+size_t tq_todo_position(tq_t *tq, const tq_task_t *task);
+
+void tq_print_task(const tq_task_t *task, FILE *out);
 
 #ifdef __cplusplus
 }
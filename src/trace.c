@@ -0,0 +1,259 @@
+/*===--------------------------------------------------------------------------------------------===
+ * trace.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "trace.h"
+#include "arena.h"
+#include <utils/assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+trace_format_t trace_format = TRACE_OFF;
+_Atomic uint64_t trace_bytes_mapped = 0;
+static FILE *report_out = NULL;
+
+typedef struct {
+    double      wall;
+    double      cpu;
+    uint64_t    bytes_read;
+    uint64_t    bytes_mapped;
+    uint64_t    bytes_written;
+    uint64_t    reads;          // read() and write() calls, and the like
+    uint64_t    writes;
+    uint64_t    allocs;         // arena allocations, and the heap blocks they were served from
+    uint64_t    heap_blocks;
+} counters_t;
+
+static struct {
+    char            name[32];
+    pthread_t       owner;          // the only thread that changes phases
+    trace_phase_t   phase;
+    bool            has_io;         // false where the kernel doesn't count I/O for us
+    uint64_t        own_bytes;      // read by the trace itself, to leave out of the counts
+    uint64_t        own_reads;
+    counters_t      last;           // at the last phase change
+    counters_t      phases[TRACE_NUM_PHASES];
+} trace;
+
+static const char *phase_names[TRACE_NUM_PHASES] = {
+    "command", "discover", "load", "write", "output"
+};
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Linux keeps I/O counters for each process in /proc/self/io, which is far cheaper than counting
+// every call ourselves.
+static bool read_io(counters_t *c) {
+    int fd = open("/proc/self/io", O_RDONLY);
+    if(fd < 0) return false;
+    
+    char buffer[512];
+    size_t len = 0;
+    uint64_t reads = 0;
+    ssize_t n;
+    while(len < sizeof(buffer) - 1 && (n = read(fd, buffer + len, sizeof(buffer) - 1 - len)) > 0) {
+        len += n;
+        reads += 1;
+    }
+    reads += 1;     // the one that hit the end of the file
+    close(fd);
+    buffer[len] = '\0';
+    
+    uint64_t rchar = 0, wchar = 0, syscr = 0, syscw = 0;
+    int found = 0;
+    for(char *line = buffer; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        found += sscanf(line, "rchar: %" SCNu64, &rchar);
+        found += sscanf(line, "wchar: %" SCNu64, &wchar);
+        found += sscanf(line, "syscr: %" SCNu64, &syscr);
+        found += sscanf(line, "syscw: %" SCNu64, &syscw);
+    }
+    if(found != 4) return false;
+    
+    // The counters already include the earlier reads of this file, but not this one.
+    c->bytes_read = rchar - trace.own_bytes;
+    c->bytes_written = wchar;
+    c->reads = syscr - trace.own_reads;
+    c->writes = syscw;
+    trace.own_bytes += len;
+    trace.own_reads += reads;
+    return true;
+}
+
+static void sample(counters_t *c) {
+    memset(c, 0, sizeof(*c));
+    c->wall = clock_seconds(CLOCK_MONOTONIC);
+    c->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    trace.has_io = read_io(c);
+    c->bytes_mapped = trace_bytes_mapped;
+    
+    size_t allocs, heap_blocks;
+    arena_totals(&allocs, &heap_blocks);
+    c->allocs = allocs;
+    c->heap_blocks = heap_blocks;
+}
+
+static void add_delta(counters_t *total, const counters_t *from, const counters_t *to) {
+    total->wall += to->wall - from->wall;
+    total->cpu += to->cpu - from->cpu;
+    total->bytes_read += to->bytes_read - from->bytes_read;
+    total->bytes_mapped += to->bytes_mapped - from->bytes_mapped;
+    total->bytes_written += to->bytes_written - from->bytes_written;
+    total->reads += to->reads - from->reads;
+    total->writes += to->writes - from->writes;
+    total->allocs += to->allocs - from->allocs;
+    total->heap_blocks += to->heap_blocks - from->heap_blocks;
+}
+
+trace_format_t trace_parse_format(const char *value) {
+    if(!value || !*value || !strcmp(value, "0")) return TRACE_OFF;
+    if(!strcmp(value, "json")) return TRACE_JSON;
+    return TRACE_TEXT;
+}
+
+void trace_begin(trace_format_t format, const char *name) {
+    ASSERT(name);
+    trace_format = format;
+    if(format == TRACE_OFF) return;
+    
+    snprintf(trace.name, sizeof(trace.name), "%s", name);
+    trace.owner = pthread_self();
+    trace.phase = TRACE_COMMAND;
+    memset(trace.phases, 0, sizeof(trace.phases));
+    sample(&trace.last);
+}
+
+FILE *trace_open_output(void) {
+    const char *path = getenv(TQ_TRACE_FILE_ENV);
+    FILE *out = path && *path ? fopen(path, "a") : stderr;
+    return out ? out : stderr;
+}
+
+void trace_close_output(FILE *out) {
+    if(out != stderr) fclose(out);
+    else fflush(out);
+}
+
+void trace_report_to(FILE *out) {
+    report_out = out;
+}
+
+trace_phase_t trace_switch(trace_phase_t phase) {
+    ASSERT(phase < TRACE_NUM_PHASES);
+    if(!pthread_equal(pthread_self(), trace.owner)) return phase;
+    
+    counters_t now;
+    sample(&now);
+    add_delta(&trace.phases[trace.phase], &trace.last, &now);
+    trace.last = now;
+    
+    trace_phase_t previous = trace.phase;
+    trace.phase = phase;
+    return previous;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) < 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for(const unsigned char *c = (const unsigned char *)str; *c; ++c) {
+        if(*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if(*c < 0x20) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_json_counters(FILE *out, const counters_t *c) {
+    fprintf(out, "{\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_mapped\":%" PRIu64,
+        c->wall * 1e3, c->cpu * 1e3, c->bytes_mapped);
+    if(trace.has_io) {
+        fprintf(out, ",\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+            ",\"read_calls\":%" PRIu64 ",\"write_calls\":%" PRIu64,
+            c->bytes_read, c->bytes_written, c->reads, c->writes);
+    }
+    fprintf(out, ",\"allocs\":%" PRIu64 ",\"heap_blocks\":%" PRIu64 "}", c->allocs, c->heap_blocks);
+}
+
+static void report_json(FILE *out, int status, const counters_t *total) {
+    fprintf(out, "{\"command\":");
+    write_json_string(out, trace.name);
+    if(status != TRACE_NO_STATUS) fprintf(out, ",\"status\":%d", status);
+    fprintf(out, ",\"peak_rss_kb\":%ld,\"total\":", peak_rss_kb());
+    write_json_counters(out, total);
+    fprintf(out, ",\"phases\":{");
+    for(int i = 0; i < TRACE_NUM_PHASES; ++i) {
+        fprintf(out, "%s\"%s\":", i ? "," : "", phase_names[i]);
+        write_json_counters(out, &trace.phases[i]);
+    }
+    fprintf(out, "}}\n");
+}
+
+static void report_counters(FILE *out, const char *name, const counters_t *c) {
+    fprintf(out, "  %-10s %10.3f %10.3f %12" PRIu64, name, c->wall * 1e3, c->cpu * 1e3, c->bytes_mapped);
+    if(trace.has_io) {
+        fprintf(out, " %12" PRIu64 " %12" PRIu64 " %7" PRIu64 " %7" PRIu64,
+            c->bytes_read, c->bytes_written, c->reads, c->writes);
+    }
+    fprintf(out, " %9" PRIu64 " %7" PRIu64 "\n", c->allocs, c->heap_blocks);
+}
+
+static void report_text(FILE *out, int status, const counters_t *total) {
+    fprintf(out, "tq %s: %.3f ms, %.3f ms of CPU, %.1f MB peak memory",
+        trace.name, total->wall * 1e3, total->cpu * 1e3, peak_rss_kb() / 1024.0);
+    if(status != TRACE_NO_STATUS) fprintf(out, ", exited with %d", status);
+    fprintf(out, "\n  %-10s %10s %10s %12s", "phase", "wall ms", "cpu ms", "bytes mapped");
+    if(trace.has_io) fprintf(out, " %12s %12s %7s %7s", "bytes read", "written", "reads", "writes");
+    fprintf(out, " %9s %7s\n", "allocs", "blocks");
+    for(int i = 0; i < TRACE_NUM_PHASES; ++i) report_counters(out, phase_names[i], &trace.phases[i]);
+    report_counters(out, "total", total);
+}
+
+void trace_end(int status) {
+    if(trace_format == TRACE_OFF) return;
+    trace_switch(trace.phase);
+    
+    counters_t total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < TRACE_NUM_PHASES; ++i) {
+        counters_t zero;
+        memset(&zero, 0, sizeof(zero));
+        add_delta(&total, &zero, &trace.phases[i]);
+    }
+    
+    FILE *out = report_out ? report_out : trace_open_output();
+    if(trace_format == TRACE_JSON) {
+        report_json(out, status, &total);
+    } else {
+        report_text(out, status, &total);
+    }
+    if(out != report_out) trace_close_output(out);
+    else fflush(out);
+    
+    memset(trace.phases, 0, sizeof(trace.phases));
+    trace.phase = TRACE_COMMAND;
+}
@@ -0,0 +1,87 @@
+/*===--------------------------------------------------------------------------------------------===
+ * trace.h
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_TRACE_H_
+#define _TQ_TRACE_H_
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TQ_TRACE_ENV "TQ_TRACE"
+#define TQ_TRACE_FILE_ENV "TQ_TRACE_FILE"
+#define TRACE_NO_STATUS (INT_MIN)
+
+/*
+ * Where a command spends its time. Whatever runs between two phase changes is charged to the
+ * phase that was entered last, so phases don't nest: code that enters one restores the previous
+ * one when it's done. With tracing off, entering a phase is a load and a branch.
+ *
+ * Only the thread that started the trace changes phases: the work of other threads is charged to
+ * whatever phase it is in while waiting for them. Counters are kept for the whole process.
+ */
+typedef enum trace_phase_t {
+    TRACE_COMMAND,      // anything not in another phase: arguments, changing the queue in memory...
+    TRACE_DISCOVER,     // finding the queue
+    TRACE_LOAD,         // loading it, or reading it without loading it
+    TRACE_WRITE,        // persisting changes
+    TRACE_OUTPUT,       // writing out what the command prints
+    TRACE_NUM_PHASES,
+} trace_phase_t;
+
+typedef enum trace_format_t {
+    TRACE_OFF,
+    TRACE_TEXT,     // a table on stderr, for people
+    TRACE_JSON,     // one JSON object per command, on a single line
+} trace_format_t;
+
+extern trace_format_t trace_format;
+extern _Atomic uint64_t trace_bytes_mapped;
+
+// Parses the value of TQ_TRACE or --stats: "json" for JSON lines, "0" or "" for nothing, anything
+// else for text.
+trace_format_t trace_parse_format(const char *value);
+
+// Starts tracing the command [name]. Reports go to the file named by TQ_TRACE_FILE, appended to,
+// or to stderr.
+void trace_begin(trace_format_t format, const char *name);
+// Opens where reports go, and closes it once written to.
+FILE *trace_open_output(void);
+void trace_close_output(FILE *out);
+// Sends reports to [out] instead, until called again with NULL: a server reports on the commands
+// it runs to the clients they are run for.
+void trace_report_to(FILE *out);
+// Reports on the command traced since trace_begin(), with its exit [status] (TRACE_NO_STATUS if it
+// isn't known), and starts a new trace. Does nothing if tracing is off.
+void trace_end(int status);
+
+trace_phase_t trace_switch(trace_phase_t phase);
+
+// Charges what runs from now on to [phase], and returns the phase it replaces.
+static inline trace_phase_t trace_enter(trace_phase_t phase) {
+    return trace_format == TRACE_OFF ? phase : trace_switch(phase);
+}
+
+// Files that are mapped are read without any read() call: their size is counted separately.
+static inline void trace_mapped(size_t size) {
+    if(trace_format != TRACE_OFF) trace_bytes_mapped += size;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_TRACE_H_ */
@@ -0,0 +1,296 @@
+/*===--------------------------------------------------------------------------------------------===
+ * tree.c
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent. All rights reserved
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#include "tree.h"
+#include "trace.h"
+#include <utils/helpers.h>
+#include <utils/assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TREE_MAX_THREADS (32)
+#define TREE_READ_AHEAD (4)     // queues read ahead of the one handed back, per thread
+
+typedef struct {
+    char        **items;
+    size_t      count;
+    size_t      capacity;
+} strings_t;
+
+typedef struct {
+    tree_queue_t    queue;
+    bool            ready;
+} slot_t;
+
+/*
+ * The walk is shared by the workers and the thread that started it, which all take part in it.
+ * Directories left to read are kept on a stack, so the walk goes depth first, like a recursive one
+ * would, and it's over once the stack is empty and no one is reading a directory (which could add
+ * more). Queues are then sorted, and read in that order, [limit] being how far ahead of the caller
+ * the workers can get.
+ */
+typedef struct {
+    const char      *root;
+    bool            styled;
+    tree_read_t     read;
+    void            *data;
+    int             num_threads;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;       // more directories, the walk is over, the queues are sorted...
+    pthread_cond_t  ready;      // for the caller: a queue was read
+    
+    strings_t       dirs;       // left to read, relative to the root
+    size_t          busy;       // threads reading a directory
+    strings_t       found;      // directories with a queue
+    size_t          unreadable;
+    bool            root_failed;
+    bool            walked;
+    
+    bool            sorted;
+    slot_t          *queues;
+    size_t          num_queues;
+    size_t          next;       // next queue to read
+    size_t          limit;
+    bool            stopped;
+} walk_t;
+
+static void strings_push(strings_t *s, char *str) {
+    if(s->count == s->capacity) {
+        s->capacity = s->capacity ? s->capacity * 2 : 16;
+        s->items = safe_realloc(s->items, s->capacity * sizeof(char *));
+    }
+    s->items[s->count++] = str;
+}
+
+static int tree_threads(void) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *env = getenv("TQ_THREADS");
+    if(env && *env) {
+        threads = strtol(env, NULL, 10);
+    } else if(threads < TREE_MIN_THREADS) {
+        // Threads mostly wait on the file system here, rather than keeping a CPU busy.
+        threads = TREE_MIN_THREADS;
+    }
+    if(threads > TREE_MAX_THREADS) threads = TREE_MAX_THREADS;
+    return threads > 1 ? (int)threads : 1;
+}
+
+static bool is_skipped(const char *name) {
+    static const char *skipped[] = {".", "..", ".git", ".hg", ".svn"};
+    for(size_t i = 0; i < sizeof(skipped) / sizeof(skipped[0]); ++i) {
+        if(!strcmp(name, skipped[i])) return true;
+    }
+    return false;
+}
+
+// Most file systems fill in d_type, which saves a stat() per entry.
+static bool entry_is(DIR *dir, const struct dirent *entry, mode_t type, bool follow) {
+    if(entry->d_type != DT_UNKNOWN && !(follow && entry->d_type == DT_LNK)) {
+        return entry->d_type == (type == S_IFDIR ? DT_DIR : DT_REG);
+    }
+    struct stat st;
+    if(fstatat(dirfd(dir), entry->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0) return false;
+    return (st.st_mode & S_IFMT) == type;
+}
+
+// Reads the directory [rel], which it takes ownership of. Called without the lock.
+static void read_dir(walk_t *w, char *rel) {
+    char *path = *rel ? fs_make_path(w->root, rel, NULL) : safe_strdup(w->root);
+    DIR *dir = opendir(path);
+    free(path);
+    
+    strings_t subdirs = {NULL, 0, 0};
+    bool has_queue = false;
+    struct dirent *entry;
+    while(dir && (entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if(!strcmp(name, TQ_DB_NAME)) {
+            has_queue = entry_is(dir, entry, S_IFREG, true);
+        } else if(!is_skipped(name) && entry_is(dir, entry, S_IFDIR, false)) {
+            strings_push(&subdirs, *rel ? fs_make_path(rel, name, NULL) : safe_strdup(name));
+        }
+    }
+    if(dir) closedir(dir);
+    
+    pthread_mutex_lock(&w->lock);
+    if(!dir && !*rel) w->root_failed = true;
+    else if(!dir) w->unreadable += 1;
+    for(size_t i = 0; i < subdirs.count; ++i) strings_push(&w->dirs, subdirs.items[i]);
+    if(subdirs.count) pthread_cond_broadcast(&w->wake);
+    if(has_queue) strings_push(&w->found, rel);
+    pthread_mutex_unlock(&w->lock);
+    
+    if(!has_queue) free(rel);
+    free(subdirs.items);
+}
+
+// Takes part in the walk until it's over. Called with the lock held.
+static void walk_dirs(walk_t *w) {
+    while(!w->walked) {
+        if(!w->dirs.count) {
+            pthread_cond_wait(&w->wake, &w->lock);
+            continue;
+        }
+    
+        char *rel = w->dirs.items[--w->dirs.count];
+        w->busy += 1;
+        pthread_mutex_unlock(&w->lock);
+        read_dir(w, rel);
+        pthread_mutex_lock(&w->lock);
+        w->busy -= 1;
+    
+        if(!w->dirs.count && !w->busy) {
+            w->walked = true;
+            pthread_cond_broadcast(&w->wake);
+        }
+    }
+}
+
+// Called with the lock held, and releases it while reading.
+static void read_queue(walk_t *w, slot_t *slot) {
+    pthread_mutex_unlock(&w->lock);
+    render_init_memory(&slot->queue.out, w->styled);
+    w->read(&slot->queue, w->data);
+    pthread_mutex_lock(&w->lock);
+    slot->ready = true;
+}
+
+static void *worker(void *data) {
+    walk_t *w = data;
+    pthread_mutex_lock(&w->lock);
+    walk_dirs(w);
+    while(!w->stopped && (!w->sorted || w->next < w->num_queues)) {
+        if(!w->sorted || w->next >= w->limit) {
+            pthread_cond_wait(&w->wake, &w->lock);
+            continue;
+        }
+        read_queue(w, &w->queues[w->next++]);
+        pthread_cond_signal(&w->ready);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Sorts paths the way a recursive walk in name order would find them: the separator comes before
+// any other character, so that "a/b" comes before "a-b".
+static int compare_dirs(const void *a, const void *b) {
+    const unsigned char *x = *(const unsigned char *const *)a;
+    const unsigned char *y = *(const unsigned char *const *)b;
+    while(*x && *x == *y) {
+        ++x;
+        ++y;
+    }
+    int cx = *x == '/' ? 1 : *x ? *x + 1 : 0;
+    int cy = *y == '/' ? 1 : *y ? *y + 1 : 0;
+    return cx - cy;
+}
+
+static void sort_queues(walk_t *w) {
+    qsort(w->found.items, w->found.count, sizeof(char *), compare_dirs);
+    w->num_queues = w->found.count;
+    w->queues = safe_malloc((w->num_queues ? w->num_queues : 1) * sizeof(slot_t));
+    for(size_t i = 0; i < w->num_queues; ++i) {
+        const char *rel = w->found.items[i];
+        slot_t *slot = &w->queues[i];
+        memset(slot, 0, sizeof(*slot));
+        slot->queue.path = *rel ? fs_make_path(w->root, rel, TQ_DB_NAME, NULL)
+                                : fs_make_path(w->root, TQ_DB_NAME, NULL);
+        slot->queue.dir = *rel ? rel : ".";
+        slot->queue.status = TQ_OK;
+    }
+    w->limit = (size_t)w->num_threads * TREE_READ_AHEAD;
+    w->sorted = true;
+}
+
+// Hands the queues back in order, reading them on this thread too when it would otherwise wait.
+static void emit_queues(walk_t *w, tree_emit_t emit, void *data) {
+    for(size_t i = 0; i < w->num_queues; ++i) {
+        slot_t *slot = &w->queues[i];
+        while(!slot->ready) {
+            if(w->next == i) {
+                w->next += 1;
+                read_queue(w, slot);
+            } else {
+                pthread_cond_wait(&w->ready, &w->lock);
+            }
+        }
+    
+        pthread_mutex_unlock(&w->lock);
+        bool go_on = emit(&slot->queue, data);
+        render_fini(&slot->queue.out);
+        pthread_mutex_lock(&w->lock);
+    
+        w->limit = i + 1 + (size_t)w->num_threads * TREE_READ_AHEAD;
+        pthread_cond_broadcast(&w->wake);
+        if(!go_on) break;
+    }
+}
+
+tq_status_t tree_walk(const char *root, bool styled, tree_read_t read, tree_emit_t emit, void *data,
+                      size_t *unreadable) {
+    ASSERT(root);
+    ASSERT(read);
+    ASSERT(emit);
+    
+    walk_t w;
+    memset(&w, 0, sizeof(w));
+    w.root = root;
+    w.styled = styled;
+    w.read = read;
+    w.data = data;
+    w.num_threads = tree_threads();
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.wake, NULL);
+    pthread_cond_init(&w.ready, NULL);
+    strings_push(&w.dirs, safe_strdup(""));
+    
+    // The walk goes on with whichever workers could be started, this thread included.
+    pthread_t threads[TREE_MAX_THREADS];
+    int started = 0;
+    for(int i = 1; i < w.num_threads; ++i) {
+        if(pthread_create(&threads[started], NULL, worker, &w) == 0) started += 1;
+    }
+    
+    trace_phase_t phase = trace_enter(TRACE_DISCOVER);
+    pthread_mutex_lock(&w.lock);
+    walk_dirs(&w);
+    sort_queues(&w);
+    if(w.root_failed) w.stopped = true;
+    pthread_cond_broadcast(&w.wake);
+    
+    trace_enter(TRACE_LOAD);
+    if(!w.stopped) emit_queues(&w, emit, data);
+    w.stopped = true;
+    pthread_cond_broadcast(&w.wake);
+    pthread_mutex_unlock(&w.lock);
+    
+    for(int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    trace_enter(phase);
+    
+    for(size_t i = 0; i < w.num_queues; ++i) {
+        if(w.queues[i].ready) render_fini(&w.queues[i].queue.out);
+        free((char *)w.queues[i].queue.path);
+    }
+    for(size_t i = 0; i < w.found.count; ++i) free(w.found.items[i]);
+    free(w.found.items);
+    free(w.dirs.items);
+    free(w.queues);
+    pthread_cond_destroy(&w.ready);
+    pthread_cond_destroy(&w.wake);
+    pthread_mutex_destroy(&w.lock);
+    
+    if(unreadable) *unreadable = w.unreadable;
+    return w.root_failed ? TQ_ERROR_IO : TQ_OK;
+}
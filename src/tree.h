@@ -0,0 +1,62 @@
+/*===--------------------------------------------------------------------------------------------===
+ * tree.h - reading every queue under a directory
+ *
+ * Created by Amy Parent <amy@amyparent.com>
+ * Copyright (c) 2022 Amy Parent
+ *
+ * Licensed under the MIT License
+ *===--------------------------------------------------------------------------------------------===
+*/
+#ifndef _TQ_TREE_H_
+#define _TQ_TREE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "render.h"
+#include "tq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A tree of projects can hold hundreds of queues. Walking it and reading its queues both mostly
+ * wait on the file system, so both are spread over a pool of threads (TQ_THREADS of them if set,
+ * otherwise one per CPU, at least TREE_MIN_THREADS). Queues are still handed back in a fixed
+ * order, whatever the threads do: a directory's queue comes before the queues under it, and
+ * sibling directories are sorted by name, byte by byte.
+ *
+ * Queues are read ahead of the one being handed back by at most a few per thread, so memory use
+ * doesn't grow with the number of queues in the tree.
+ */
+
+#define TREE_MIN_THREADS (4)
+
+typedef struct tree_queue_t {
+    const char  *path;      // of the queue file
+    const char  *dir;       // relative to the root of the walk, "." for the root itself
+    tq_status_t status;
+    size_t      todo;
+    size_t      done;
+    render_t    out;        // rendering to memory
+} tree_queue_t;
+
+// Called on a worker thread to read each queue found. It fills in the status and counts of
+// [queue], and can render anything to [queue->out] for the caller of tree_walk().
+typedef void (*tree_read_t)(tree_queue_t *queue, void *data);
+// Called on the thread that started the walk for each queue, in order, once it has been read.
+// Returning false stops the walk.
+typedef bool (*tree_emit_t)(const tree_queue_t *queue, void *data);
+
+// Reads every queue under [root], skipping version control directories (.git, .hg, .svn) and
+// without following symbolic links to directories. [styled] is passed on to the queues' renderers.
+// Returns TQ_ERROR_IO if [root] can't be read, otherwise TQ_OK with the number of directories under
+// it that couldn't be in [unreadable].
+tq_status_t tree_walk(const char *root, bool styled, tree_read_t read, tree_emit_t emit, void *data,
+                      size_t *unreadable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef _TQ_TREE_H_ */